@@ -0,0 +1,343 @@
+//
+//  DMAutoInvalidationBenchmarks.m
+//  DMAutoInvalidation
+//
+//  Created by agent on 2026-10-17.
+//  Copyright (c) 2026 Delicious Monster Software.
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+/* Prints one JSON object per measurement, each with a "benchmark" key naming what was measured plus its parameters,
+ * so runs can be collected and compared over time. Times are in nanoseconds. Pass --quick for smaller sizes. */
+
+#import <Foundation/Foundation.h>
+// <dmclean.filter: lines.sort.uniq>
+#import "DMAutoInvalidation.h"
+#import "DMIndexedNotificationCenter.h"
+#import "DMKeyPathDependencyPlan.h"
+#import "DMKeyValueObserver.h"
+#import "DMNotificationObserver.h"
+#import "DMObserverStatistics.h"
+
+#if !__has_feature(objc_arc)
+#error This file must be compiled with Automatic Reference Counting (ARC).
+#endif
+
+
+/* Owners get their own class, as the invalidator swizzles -dealloc of each owner class. */
+@interface DMBenchmarkOwner : NSObject
+@end
+
+@implementation DMBenchmarkOwner
+@end
+
+
+/* The least an observer can do, so attach/detach measures the invalidator alone. Like the library's observers it
+ * provides a link, so it's tracked without a set. */
+@interface DMBenchmarkObserver : NSObject <DMAutoInvalidation>
+@end
+
+@implementation DMBenchmarkObserver {
+    struct DMObserverInvalidatorLink _invalidatorLink;
+}
+
+- (void)invalidate;
+{ [DMObserverInvalidator observerDidInvalidate:self]; }
+
+- (struct DMObserverInvalidatorLink *)observerInvalidatorLink;
+{ return &_invalidatorLink; }
+
+@end
+
+
+@interface DMBenchmarkModel : NSObject
+@property (nonatomic) NSInteger value;
+@end
+
+@implementation DMBenchmarkModel
+@synthesize value;
+@end
+
+
+/* A synthetic entity graph for the dependency plan compiler, standing in for a Core Data model. */
+@interface DMBenchmarkEntity : NSObject <DMKeyPathDependencyEntity>
+@property (nonatomic, copy) NSString *name;
+@property (nonatomic, copy) NSArray *subentities;
+@property (nonatomic, copy) NSDictionary *propertiesByName;
+@end
+
+@implementation DMBenchmarkEntity
+@synthesize name, subentities, propertiesByName;
+- (NSSet *)keyPathsForValuesAffectingUnmodeledKey:(NSString *)key;
+{ return [key isEqual:@"summary"] ? [NSSet setWithObjects:@"attribute0", @"next.attribute1", nil] : nil; }
+@end
+
+@interface DMBenchmarkProperty : NSObject <DMKeyPathDependencyProperty>
+@property (nonatomic, copy) NSString *name;
+@property (nonatomic, weak) DMBenchmarkEntity *dependencyDestinationEntity;
+@property (nonatomic, weak) DMBenchmarkProperty *dependencyInverseProperty;
+@end
+
+@implementation DMBenchmarkProperty
+@synthesize name, dependencyDestinationEntity, dependencyInverseProperty;
+@end
+
+
+static BOOL quick;
+
+static void emitResult(NSString *benchmark, NSDictionary *parameters, NSDictionary *measurements)
+{
+    NSMutableDictionary *const result = [NSMutableDictionary dictionaryWithObject:benchmark forKey:@"benchmark"];
+    [result addEntriesFromDictionary:parameters];
+    [result addEntriesFromDictionary:measurements];
+    NSData *const json = [NSJSONSerialization dataWithJSONObject:result options:0 error:NULL];
+    fwrite(json.bytes, 1, json.length, stdout);
+    fputc('\n', stdout);
+    fflush(stdout);
+}
+
+static int compareLatencies(const void *a, const void *b)
+{
+    const uint64_t latencyA = *(const uint64_t *)a, latencyB = *(const uint64_t *)b;
+    return (latencyA < latencyB) ? -1 : (latencyA > latencyB);
+}
+
+static NSDictionary *latencyPercentiles(uint64_t *latencies, size_t count) // sorts latencies
+{
+    qsort(latencies, count, sizeof(*latencies), compareLatencies);
+    return @{
+        @"p50_ns": @(latencies[count * 50 / 100]),
+        @"p90_ns": @(latencies[count * 90 / 100]),
+        @"p99_ns": @(latencies[count * 99 / 100]),
+        @"max_ns": @(latencies[count - 1]),
+    };
+}
+
+
+#pragma mark Benchmarks
+
+/* Observers attached to and detached from a pool of owners by several threads at once, as when many objects set up
+ * and tear down observation concurrently. Measures the invalidator's bookkeeping and its sharded locks. */
+static void benchmarkAttachDetach(void)
+{
+    const NSUInteger operationsPerThread = quick ? 20000 : 200000;
+    const NSUInteger ownerCount = 64;
+    NSMutableArray *const owners = [NSMutableArray arrayWithCapacity:ownerCount];
+    for (NSUInteger i = 0; i < ownerCount; i++)
+        [owners addObject:[DMBenchmarkOwner new]];
+
+    for (NSUInteger threadCount = 1; threadCount <= 8; threadCount *= 2) {
+        const uint64_t startTime = DMObserverStatisticsCurrentTime();
+        dispatch_apply(threadCount, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t thread) {
+            @autoreleasepool {
+                for (NSUInteger i = 0; i < operationsPerThread; i++) {
+                    DMBenchmarkObserver *const observer = [DMBenchmarkObserver new];
+                    [DMObserverInvalidator attachObserver:observer toOwner:owners[(thread * 7 + i) % ownerCount]];
+                    [observer invalidate];
+                }
+            }
+        });
+        const uint64_t elapsed = DMObserverStatisticsCurrentTime() - startTime;
+        const NSUInteger operationCount = operationsPerThread * threadCount;
+        emitResult(@"attach_detach", @{@"threads": @(threadCount), @"operations": @(operationCount)}, @{
+            @"elapsed_ns": @(elapsed),
+            @"operations_per_second": @((double)operationCount * NSEC_PER_SEC / elapsed),
+        });
+    }
+}
+
+/* Several threads posting a notification that one observer (among many registered for other names) receives, timing
+ * each post. Posting is synchronous, so this is the time to find and run the observer, including waiting for its lock. */
+static void benchmarkFireLatency(void)
+{
+    const NSUInteger postsPerThread = quick ? 5000 : 50000;
+    const NSUInteger threadCount = 4;
+    const NSUInteger otherRegistrationCount = 1000;
+    NSString *const name = @"DMBenchmarkFireNotification";
+
+    for (NSNotificationCenter *notificationCenter in @[[NSNotificationCenter new], [DMIndexedNotificationCenter new]])
+        for (NSNumber *options in @[@0, @(DMNotificationObserverConcurrentDelivery)])
+            @autoreleasepool {
+                DMBenchmarkOwner *owner = [DMBenchmarkOwner new];
+                for (NSUInteger i = 0; i < otherRegistrationCount; i++)
+                    (void)[[DMNotificationObserver alloc] initWithName:[NSString stringWithFormat:@"DMBenchmarkOtherNotification%lu", (unsigned long)i] object:nil attachedToOwner:owner notificationCenter:notificationCenter options:0 action:^(NSNotification *notification, id localOwner, DMNotificationObserver *observer) { }];
+                __block volatile NSUInteger fireCount = 0;
+                (void)[[DMNotificationObserver alloc] initWithName:name object:nil attachedToOwner:owner notificationCenter:notificationCenter options:options.unsignedIntegerValue action:^(NSNotification *notification, id localOwner, DMNotificationObserver *observer) {
+                    __atomic_add_fetch(&fireCount, 1, __ATOMIC_RELAXED);
+                }];
+
+                uint64_t *const latencies = calloc(postsPerThread * threadCount, sizeof(uint64_t));
+                dispatch_apply(threadCount, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t thread) {
+                    @autoreleasepool {
+                        NSNotification *const notification = [NSNotification notificationWithName:name object:nil];
+                        for (NSUInteger i = 0; i < postsPerThread; i++) {
+                            const uint64_t postTime = DMObserverStatisticsCurrentTime();
+                            [notificationCenter postNotification:notification];
+                            latencies[thread * postsPerThread + i] = DMObserverStatisticsCurrentTime() - postTime;
+                        }
+                    }
+                });
+                if (fireCount != postsPerThread * threadCount) { // not an assertion, as they're compiled out here
+                    fprintf(stderr, "fire_latency: %lu of %lu posts fired the observer\n", (unsigned long)fireCount, (unsigned long)(postsPerThread * threadCount));
+                    exit(EXIT_FAILURE);
+                }
+
+                emitResult(@"fire_latency", @{
+                    @"center": NSStringFromClass([notificationCenter class]),
+                    @"concurrent_delivery": @(options.unsignedIntegerValue != 0),
+                    @"threads": @(threadCount),
+                    @"posts": @(postsPerThread * threadCount),
+                    @"other_registrations": @(otherRegistrationCount),
+                }, latencyPercentiles(latencies, postsPerThread * threadCount));
+                free(latencies);
+                owner = nil;
+            }
+}
+
+/* One key-value observer over many targets, created and then invalidated. */
+static void benchmarkKeyValueObserverSetupTeardown(void)
+{
+    const NSUInteger maxTargetCount = quick ? 10000 : 100000;
+    for (NSUInteger targetCount = 1; targetCount <= maxTargetCount; targetCount *= 10)
+        @autoreleasepool {
+            NSMutableArray *const targets = [NSMutableArray arrayWithCapacity:targetCount];
+            for (NSUInteger i = 0; i < targetCount; i++)
+                [targets addObject:[DMBenchmarkModel new]];
+            DMBenchmarkOwner *const owner = [DMBenchmarkOwner new];
+
+            const uint64_t setupStartTime = DMObserverStatisticsCurrentTime();
+            DMKeyValueObserver *const observer = [DMKeyValueObserver observerWithKeyPath:@"value" objects:targets attachedToOwner:owner changeAction:^(id localOwner, DMKeyValueObserver *observer) { }];
+            const uint64_t teardownStartTime = DMObserverStatisticsCurrentTime();
+            [observer invalidate];
+            const uint64_t endTime = DMObserverStatisticsCurrentTime();
+
+            emitResult(@"kvo_setup_teardown", @{@"targets": @(targetCount)}, @{
+                @"setup_ns": @(teardownStartTime - setupStartTime),
+                @"teardown_ns": @(endTime - teardownStartTime),
+                @"setup_ns_per_target": @((double)(teardownStartTime - setupStartTime) / targetCount),
+            });
+        }
+}
+
+/* An owner with many observers deallocating, which invalidates them all. */
+static void benchmarkOwnerDeallocTeardown(void)
+{
+    const NSUInteger maxObserverCount = quick ? 1000 : 10000;
+    DMBenchmarkModel *const target = [DMBenchmarkModel new];
+    NSArray *const observerKinds = @[@"notification", @"notification_indexed_center", @"kvo"];
+    for (NSString *observerKind in observerKinds)
+        for (NSUInteger observerCount = 1; observerCount <= maxObserverCount; observerCount *= 10) {
+            NSNotificationCenter *const notificationCenter = [observerKind isEqual:@"notification_indexed_center"] ? [DMIndexedNotificationCenter new] : [NSNotificationCenter defaultCenter];
+            DMBenchmarkOwner *owner = [DMBenchmarkOwner new];
+            @autoreleasepool { // So the owner holds the only references to the observers
+                for (NSUInteger i = 0; i < observerCount; i++)
+                    if ([observerKind isEqual:@"kvo"])
+                        [DMKeyValueObserver observerWithKeyPath:@"value" objects:@[target] attachedToOwner:owner changeAction:^(id localOwner, DMKeyValueObserver *observer) { }];
+                    else
+                        (void)[[DMNotificationObserver alloc] initWithName:@"DMBenchmarkTeardownNotification" object:nil attachedToOwner:owner notificationCenter:notificationCenter action:^(NSNotification *notification, id localOwner, DMNotificationObserver *observer) { }];
+            }
+
+            const uint64_t startTime = DMObserverStatisticsCurrentTime();
+            owner = nil;
+            const uint64_t elapsed = DMObserverStatisticsCurrentTime() - startTime;
+            emitResult(@"owner_dealloc_teardown", @{@"observer_kind": observerKind, @"observers": @(observerCount)}, @{
+                @"elapsed_ns": @(elapsed),
+                @"ns_per_observer": @((double)elapsed / observerCount),
+            });
+        }
+}
+
+#if !DM_WITHOUT_DEPENDENCY_PLAN
+/* Compiling a dependency plan for key paths reaching through a chain of entities, each with subentities, as when a
+ * managed object observer is first set up for an entity; then fetching the cached plan, as every later setup does. */
+static void benchmarkPlanCompile(void)
+{
+    const NSUInteger iterationCount = quick ? 200 : 2000;
+    const NSUInteger attributeCount = 16;
+    for (NSUInteger chainLength = 2; chainLength <= 8; chainLength *= 2) {
+        NSMutableArray *const entities = [NSMutableArray array]; // keeps the graph alive; properties refer to entities weakly
+        NSMutableArray *const chain = [NSMutableArray array];
+        for (NSUInteger i = 0; i < chainLength; i++) {
+            NSMutableArray *const family = [NSMutableArray array];
+            for (NSUInteger j = 0; j < 4; j++) {
+                DMBenchmarkEntity *const entity = [DMBenchmarkEntity new];
+                entity.name = [NSString stringWithFormat:@"Entity%lu_%lu", (unsigned long)i, (unsigned long)j];
+                [family addObject:entity];
+            }
+            [family[0] setSubentities:[family subarrayWithRange:NSMakeRange(1, family.count - 1)]];
+            [entities addObjectsFromArray:family];
+            [chain addObject:family[0]];
+        }
+        NSMutableArray *const inverseProperties = [NSMutableArray array]; // only referred to weakly, so kept here
+        for (NSUInteger i = 0; i < chainLength; i++) {
+            NSMutableDictionary *const propertiesByName = [NSMutableDictionary dictionary];
+            for (NSUInteger k = 0; k < attributeCount; k++) {
+                DMBenchmarkProperty *const attribute = [DMBenchmarkProperty new];
+                attribute.name = [NSString stringWithFormat:@"attribute%lu", (unsigned long)k];
+                propertiesByName[attribute.name] = attribute;
+            }
+            if (i + 1 < chainLength) {
+                DMBenchmarkProperty *const next = [DMBenchmarkProperty new], *const previous = [DMBenchmarkProperty new];
+                next.name = @"next", previous.name = @"previous";
+                next.dependencyDestinationEntity = chain[i + 1], previous.dependencyDestinationEntity = chain[i];
+                next.dependencyInverseProperty = previous, previous.dependencyInverseProperty = next;
+                propertiesByName[next.name] = next;
+                [inverseProperties addObject:previous];
+            }
+            for (DMBenchmarkEntity *entity in [@[chain[i]] arrayByAddingObjectsFromArray:[chain[i] subentities]])
+                entity.propertiesByName = propertiesByName;
+        }
+
+        NSMutableSet *const keyPaths = [NSMutableSet setWithObject:@"summary"];
+        NSMutableString *const keyPathPrefix = [NSMutableString string];
+        for (NSUInteger i = 0; i < chainLength; i++, [keyPathPrefix appendString:@"next."])
+            [keyPaths addObject:[keyPathPrefix stringByAppendingFormat:@"attribute%lu", (unsigned long)i]];
+
+        uint64_t startTime = DMObserverStatisticsCurrentTime();
+        @autoreleasepool {
+            for (NSUInteger i = 0; i < iterationCount; i++)
+                (void)[[DMKeyPathDependencyPlan alloc] initWithEntity:chain[0] keyPaths:keyPaths];
+        }
+        const uint64_t compileElapsed = DMObserverStatisticsCurrentTime() - startTime;
+
+        startTime = DMObserverStatisticsCurrentTime();
+        @autoreleasepool {
+            for (NSUInteger i = 0; i < iterationCount; i++)
+                [DMKeyPathDependencyPlan planForEntity:chain[0] keyPaths:keyPaths];
+        }
+        const uint64_t cachedElapsed = DMObserverStatisticsCurrentTime() - startTime;
+
+        emitResult(@"plan_compile", @{@"chain_length": @(chainLength), @"entities": @(entities.count), @"key_paths": @(keyPaths.count)}, @{
+            @"compile_ns": @((double)compileElapsed / iterationCount),
+            @"cached_lookup_ns": @((double)cachedElapsed / iterationCount),
+        });
+    }
+}
+#endif
+
+
+int main(int argc, const char *argv[])
+{
+    @autoreleasepool {
+        for (int i = 1; i < argc; i++)
+            if (!strcmp(argv[i], "--quick"))
+                quick = YES;
+
+        benchmarkAttachDetach();
+        benchmarkFireLatency();
+        benchmarkKeyValueObserverSetupTeardown();
+        benchmarkOwnerDeallocTeardown();
+#if !DM_WITHOUT_DEPENDENCY_PLAN
+        benchmarkPlanCompile();
+#endif
+    }
+    return 0;
+}
@@ -0,0 +1,38 @@
+//
+//  DMActionCoalescer.h
+//  DMAutoInvalidation
+//
+//  Created by agent on 2026-10-17.
+//  Copyright (c) 2026 Delicious Monster Software.
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+
+
+/* The flush block is passed the number of triggers in the batch, and the distinct (by identity) non-nil objects
+ * that were passed with them, in no particular order. */
+typedef void(^DMActionCoalescerFlushBlock)(NSUInteger triggerCount, NSArray *distinctObjects);
+
+
+/* DMActionCoalescer collects triggers from any thread and flushes them as one batch on a queue. A batch is
+ * flushed `interval` seconds after its first trigger; with an interval of zero, it's flushed once the work already
+ * submitted to the queue has drained (for the main queue, that's the end of the current run loop turn).
+ * This is a building block for the coalescing observers; it knows nothing about owners or invalidation, so the
+ * flush block should go through the observer's usual checks. */
+@interface DMActionCoalescer : NSObject
+
+- (id)initWithInterval:(NSTimeInterval)interval queue:(dispatch_queue_t)queue flushBlock:(DMActionCoalescerFlushBlock)flushBlock __attribute__((nonnull(2,3)));
+
+- (void)addTriggerWithObject:(id)object;
+- (void)cancel; // Drops any pending batch and the flush block, which won't be called again
+
+@end
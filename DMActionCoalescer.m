@@ -0,0 +1,112 @@
+//
+//  DMActionCoalescer.m
+//  DMAutoInvalidation
+//
+//  Created by agent on 2026-10-17.
+//  Copyright (c) 2026 Delicious Monster Software.
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#import "DMActionCoalescer.h"
+
+#if !__has_feature(objc_arc)
+#error This file must be compiled with Automatic Reference Counting (ARC).
+#endif
+
+
+@implementation DMActionCoalescer {
+    NSTimeInterval _interval;
+    dispatch_queue_t _queue;
+    DMActionCoalescerFlushBlock _flushBlock;
+
+    dispatch_semaphore_t _mutex; // guards the following
+    BOOL _cancelled;
+    BOOL _flushScheduled;
+    NSUInteger _pendingTriggerCount;
+    NSHashTable *_pendingObjects;
+}
+
+#pragma mark API
+
+- (id)initWithInterval:(NSTimeInterval)interval queue:(dispatch_queue_t)queue flushBlock:(DMActionCoalescerFlushBlock)flushBlock;
+{
+    NSParameterAssert(queue && flushBlock);
+    if (!(self = [super init]))
+        return nil;
+    _interval = MAX(interval, 0);
+    _queue = queue;
+    _flushBlock = [flushBlock copy];
+    _mutex = dispatch_semaphore_create(1);
+    _pendingObjects = [[NSHashTable alloc] initWithOptions:(NSPointerFunctionsStrongMemory | NSPointerFunctionsObjectPointerPersonality) capacity:0];
+    return self;
+}
+
+- (void)addTriggerWithObject:(id)object;
+{
+    BOOL needsSchedule = NO;
+    dispatch_semaphore_wait(_mutex, DISPATCH_TIME_FOREVER); {
+        if (!_cancelled) {
+            _pendingTriggerCount++;
+            if (object)
+                [_pendingObjects addObject:object];
+            if (!_flushScheduled)
+                needsSchedule = _flushScheduled = YES;
+        }
+    } dispatch_semaphore_signal(_mutex);
+
+    if (!needsSchedule)
+        return;
+
+    // One block per batch, not per trigger. It keeps us alive until the flush, which then sees whether we've been cancelled.
+    dispatch_block_t flush = ^{ [self _flush]; };
+    if (_interval > 0)
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(_interval * NSEC_PER_SEC)), _queue, flush);
+    else
+        dispatch_async(_queue, flush);
+}
+
+- (void)cancel;
+{
+    // The scheduled flush can't be unscheduled, but it only holds us; let go of the batch and whatever the flush block captures now
+    NSArray *pendingObjects;
+    DMActionCoalescerFlushBlock flushBlock;
+    dispatch_semaphore_wait(_mutex, DISPATCH_TIME_FOREVER); {
+        _cancelled = YES;
+        _pendingTriggerCount = 0;
+        pendingObjects = _pendingObjects.allObjects; // Released outside the lock; dealloc could do anything
+        [_pendingObjects removeAllObjects];
+        flushBlock = _flushBlock;
+        _flushBlock = nil;
+    } dispatch_semaphore_signal(_mutex);
+}
+
+
+#pragma mark Private
+
+- (void)_flush;
+{
+    NSUInteger triggerCount;
+    NSArray *distinctObjects;
+    DMActionCoalescerFlushBlock flushBlock;
+    dispatch_semaphore_wait(_mutex, DISPATCH_TIME_FOREVER); {
+        flushBlock = _flushBlock;
+        triggerCount = _pendingTriggerCount;
+        distinctObjects = _pendingObjects.allObjects;
+        _pendingTriggerCount = 0;
+        [_pendingObjects removeAllObjects];
+        _flushScheduled = NO;
+    } dispatch_semaphore_signal(_mutex);
+
+    if (triggerCount && flushBlock)
+        flushBlock(triggerCount, distinctObjects);
+}
+
+@end
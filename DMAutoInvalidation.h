@@ -20,6 +20,14 @@
 @protocol DMAutoInvalidation;
 
 
+/* The invalidator's bookkeeping, kept in the observer if it provides room (see -observerInvalidatorLink). Observers
+ * should start with it zeroed and otherwise leave it alone. */
+struct DMObserverInvalidatorLink {
+    void *invalidator; // unretained; NULL when not attached
+    void *previousObserver, *nextObserver; // in the invalidator's list, which retains each observer in it
+};
+
+
 @interface DMObserverInvalidator : NSObject
 + (void)attachObserver:(id<DMAutoInvalidation>)observer toOwner:(id)owner; // Calls -setInvalidator: on the observer
 + (void)observerDidInvalidate:(id<DMAutoInvalidation>)observer; // Observers must call this as part of their -invalidate
@@ -28,4 +36,14 @@
 
 @protocol DMAutoInvalidation <NSObject>
 - (void)invalidate;
+
+@optional
+/* Sent in place of -invalidate when an owner deallocates, once per observer class, with all of that class's
+ * observers attached to the owner. Implementations must invalidate each observer, but should not call
+ * +observerDidInvalidate: (the invalidator is going away with the owner). Gives a chance to batch teardown work. */
++ (void)invalidateObserversForDeallocatingOwner:(NSArray *)observers;
+
+/* Observers that return storage here are kept in an intrusive list threaded through it, rather than in a set with an
+ * associated object pointing back, which makes attaching and detaching cheaper. Must return the same pointer each time. */
+- (struct DMObserverInvalidatorLink *)observerInvalidatorLink;
 @end
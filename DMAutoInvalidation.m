@@ -16,6 +16,7 @@
 //
 
 #import "DMAutoInvalidation.h"
+#import "DMObserverStatistics.h"
 
 #import <objc/message.h>
 
@@ -24,97 +25,277 @@
 #endif
 
 
-static char DMAutoInvalidatorAssociationKey, DMObserverOwnerAssociationKey;
+static char DMAutoInvalidatorAssociationKey, DMObserverInvalidatorAssociationKey;
+
+
+/* Registry locking is sharded by address so that unrelated owners (and unrelated invalidators) don't contend.
+ * A shard's mutex serializes creation of an owner's invalidator, and mutation of any invalidator's observer set
+ * whose address hashes to that shard. Shard mutexes are never nested. */
+#define DMInvalidatorShardCount  64 // must be a power of two
+static dispatch_semaphore_t invalidatorShardMutexes[DMInvalidatorShardCount];
+
+static inline dispatch_semaphore_t shardMutexForAddress(const void *address)
+{
+    const uintptr_t bits = (uintptr_t)address;
+    return invalidatorShardMutexes[((bits >> 4) ^ (bits >> 12)) & (DMInvalidatorShardCount - 1)];
+}
+
+
+/* Counting filter over owner addresses: a zero count means no owner whose address hashes to that slot has an
+ * invalidator. This lets the swizzled -dealloc skip the runtime's association table (and its global lock) for
+ * instances that never had observers attached, which is most of them, with a single atomic load. It also makes
+ * the check at the 2nd+ patched level of a hierarchy free, as the first level will have decremented it. */
+#define DMOwnerPresenceFilterSize  4096 // must be a power of two
+static uint32_t ownerPresenceCounts[DMOwnerPresenceFilterSize];
+
+static inline uint32_t *ownerPresenceCountForAddress(const void *address)
+{
+    const uintptr_t bits = (uintptr_t)address;
+    return &ownerPresenceCounts[((bits >> 4) ^ (bits >> 16)) & (DMOwnerPresenceFilterSize - 1)];
+}
+
+
+/* Read-mostly set of classes which have had early-invalidate dealloc added. Lookups are lock-free (this is
+ * hit on every attach); insertion happens at most once per class, under swizzledClassesMutex. Classes are never
+ * unloaded in practice, so entries are never removed. If the table fills, we fall back to a locked set. */
+#define DMSwizzledClassCacheSize  1024 // must be a power of two
+static uintptr_t swizzledClassCache[DMSwizzledClassCacheSize];
+static NSUInteger swizzledClassCacheCount;
+static NSMutableSet *swizzledClassOverflow;
+static dispatch_semaphore_t swizzledClassesMutex;
+
+static inline NSUInteger swizzledClassCacheIndex(uintptr_t classBits)
+{ return ((classBits >> 3) ^ (classBits >> 11)) & (DMSwizzledClassCacheSize - 1); }
+
+static BOOL swizzledClassCacheContainsClass(Class cls)
+{
+    const uintptr_t classBits = (uintptr_t)(__bridge void *)cls;
+    for (NSUInteger i = swizzledClassCacheIndex(classBits), probes = 0; probes < DMSwizzledClassCacheSize; i = (i + 1) & (DMSwizzledClassCacheSize - 1), probes++) {
+        const uintptr_t entry = __atomic_load_n(&swizzledClassCache[i], __ATOMIC_ACQUIRE);
+        if (entry == classBits)
+            return YES;
+        if (!entry)
+            return NO;
+    }
+    return NO;
+}
+
+static BOOL swizzledClassCacheAddClass(Class cls) // call with swizzledClassesMutex held; returns NO if full
+{
+    if (swizzledClassCacheCount >= DMSwizzledClassCacheSize * 3 / 4)
+        return NO;
+    const uintptr_t classBits = (uintptr_t)(__bridge void *)cls;
+    NSUInteger i = swizzledClassCacheIndex(classBits);
+    while (swizzledClassCache[i])
+        i = (i + 1) & (DMSwizzledClassCacheSize - 1);
+    __atomic_store_n(&swizzledClassCache[i], classBits, __ATOMIC_RELEASE);
+    swizzledClassCacheCount++;
+    return YES;
+}
+
+
+static inline struct DMObserverInvalidatorLink *invalidatorLinkOfObserver(id<DMAutoInvalidation> observer) // NULL if the observer doesn't have one
+{ return [observer respondsToSelector:@selector(observerInvalidatorLink)] ? [observer observerInvalidatorLink] : NULL; }
+
+static inline struct DMObserverInvalidatorLink *invalidatorLinkOfObserverPointer(void *observerPointer)
+{ return [(__bridge id<DMAutoInvalidation>)observerPointer observerInvalidatorLink]; }
+
 
 @implementation DMObserverInvalidator {
-    NSMutableSet *_observers;
+    void *_firstLinkedObserver; // observers with an invalidator link, retained; guarded by shardMutexForAddress(self)
+    NSMutableSet *_observers; // other observers; created when needed; guarded by shardMutexForAddress(self)
+    const void *_ownerAddress;
+    __unsafe_unretained Class _ownerClass; // for statistics
 }
 
 #pragma mark NSObject
 
-- (void)dealloc;
++ (void)initialize;
 {
-    // Take a local copy of this, since observers could remove themselves from this set when invalidated (mutating it while we're enumerating)
-    NSSet *observersToInvalidate = _observers;
-    _observers = nil;
-    for (id<DMAutoInvalidation> observer in observersToInvalidate)
-        [observer invalidate];
+    if (self != [DMObserverInvalidator class])
+        return;
+    for (NSUInteger i = 0; i < DMInvalidatorShardCount; i++)
+        invalidatorShardMutexes[i] = dispatch_semaphore_create(1);
+    swizzledClassOverflow = [NSMutableSet set];
+    swizzledClassesMutex = dispatch_semaphore_create(1);
 }
 
-- (id)init;
+- (void)dealloc;
 {
-    if (!(self = [super init]))
-        return nil;
-    _observers = [NSMutableSet set];
-    return self;
-}
+    // Take the observers out, since they could remove themselves when invalidated (mutating what we're enumerating)
+    NSMutableArray *const observersToInvalidate = [NSMutableArray array];
+    dispatch_semaphore_t const mutex = shardMutexForAddress((__bridge void *)self);
+    dispatch_semaphore_wait(mutex, DISPATCH_TIME_FOREVER); {
+        for (void *observerPointer = _firstLinkedObserver; observerPointer; ) {
+            struct DMObserverInvalidatorLink *const link = invalidatorLinkOfObserverPointer(observerPointer);
+            void *const nextObserverPointer = link->nextObserver;
+            *link = (struct DMObserverInvalidatorLink){NULL, NULL, NULL}; // so +observerDidInvalidate: leaves it alone
+            [observersToInvalidate addObject:(__bridge_transfer id)observerPointer];
+            observerPointer = nextObserverPointer;
+        }
+        _firstLinkedObserver = NULL;
+        if (_observers)
+            [observersToInvalidate addObjectsFromArray:_observers.allObjects];
+        _observers = nil;
+    } dispatch_semaphore_signal(mutex);
+
+    if (_ownerAddress)
+        __atomic_sub_fetch(ownerPresenceCountForAddress(_ownerAddress), 1, __ATOMIC_RELEASE);
+
+    if (!observersToInvalidate.count)
+        return;
+
+    /* Group by class, so observers that support bulk invalidation can skip per-observer bookkeeping (which would
+     * only come back here to mutate a set that's being thrown away) and batch their own teardown work. */
+    NSMapTable *const observersByClass = [[NSMapTable alloc] initWithKeyOptions:(NSPointerFunctionsOpaqueMemory | NSPointerFunctionsOpaquePersonality) valueOptions:NSPointerFunctionsStrongMemory capacity:1];
+    for (id<DMAutoInvalidation> observer in observersToInvalidate) {
+        const void *const observerClass = (__bridge void *)[observer class];
+        NSMutableArray *classObservers = [observersByClass objectForKey:(__bridge id)observerClass];
+        if (!classObservers)
+            [observersByClass setObject:(classObservers = [NSMutableArray array]) forKey:(__bridge id)observerClass];
+        [classObservers addObject:observer];
+    }
 
+    for (id observerClassAsKey in observersByClass) {
+        NSArray *const classObservers = [observersByClass objectForKey:observerClassAsKey];
+        Class const observerClass = [classObservers[0] class];
+        if (DMObserverStatisticsEnabled) {
+            DMObserverStatisticsRecordEvents(DMObserverStatisticsEventInvalidate, observerClass, _ownerClass, classObservers.count);
+            DMObserverStatisticsRecordEvents(DMObserverStatisticsEventOwnerDeallocTeardown, observerClass, _ownerClass, classObservers.count);
+        }
+        if ([observerClass respondsToSelector:@selector(invalidateObserversForDeallocatingOwner:)])
+            [(id)observerClass invalidateObserversForDeallocatingOwner:classObservers];
+        else
+            for (id<DMAutoInvalidation> observer in classObservers)
+                [observer invalidate];
+    }
+}
 
 #pragma mark API
 
 + (void)attachObserver:(id<DMAutoInvalidation>)observer toOwner:(id)owner;
 {
     NSParameterAssert(observer && owner);
-    static dispatch_once_t onceToken;
-    static dispatch_semaphore_t invalidatorAssociationMutex;
-    static NSMutableSet *classesWithEarlyInvalidateOnDealloc;
-    static dispatch_semaphore_t earlyInvalidateMutex;
-    dispatch_once(&onceToken, ^{
-        invalidatorAssociationMutex = dispatch_semaphore_create(1);
-        classesWithEarlyInvalidateOnDealloc = [NSMutableSet set];
-        earlyInvalidateMutex = dispatch_semaphore_create(1);
-    });
 
     // Tie the observer to the owner
     DMObserverInvalidator *invalidator = objc_getAssociatedObject(owner, &DMAutoInvalidatorAssociationKey);
     if (!invalidator) {
         // Protect against a race creating the associated set. Don't @synchronize on the owner, because someone else could be doing that and we'll deadlock.
-        dispatch_semaphore_wait(invalidatorAssociationMutex, DISPATCH_TIME_FOREVER); {
+        dispatch_semaphore_t const ownerMutex = shardMutexForAddress((__bridge void *)owner);
+        dispatch_semaphore_wait(ownerMutex, DISPATCH_TIME_FOREVER); {
             invalidator = objc_getAssociatedObject(owner, &DMAutoInvalidatorAssociationKey);
             if (!invalidator) {
                 invalidator = [[self alloc] init];
+                invalidator->_ownerAddress = (__bridge void *)owner;
+                invalidator->_ownerClass = [owner class];
+                __atomic_add_fetch(ownerPresenceCountForAddress(invalidator->_ownerAddress), 1, __ATOMIC_RELEASE); // Before the association is visible
                 objc_setAssociatedObject(owner, &DMAutoInvalidatorAssociationKey, invalidator, OBJC_ASSOCIATION_RETAIN_NONATOMIC);
             }
-        } dispatch_semaphore_signal(invalidatorAssociationMutex);
-    }
-    
-    @synchronized (invalidator) {
-        [invalidator->_observers addObject:observer];
+        } dispatch_semaphore_signal(ownerMutex);
     }
-    
-    // Add a non-retained reference from the observer back to the owner for explicit tear-down
-    objc_setAssociatedObject(observer, &DMObserverOwnerAssociationKey, owner, OBJC_ASSOCIATION_ASSIGN);
+
+    struct DMObserverInvalidatorLink *const link = invalidatorLinkOfObserver(observer);
+    dispatch_semaphore_t const invalidatorMutex = shardMutexForAddress((__bridge void *)invalidator);
+    dispatch_semaphore_wait(invalidatorMutex, DISPATCH_TIME_FOREVER); {
+        if (link) {
+            NSAssert(!link->invalidator, @"%@ is already attached to an owner", observer);
+            void *const observerPointer = (__bridge_retained void *)observer;
+            link->invalidator = (__bridge void *)invalidator;
+            link->previousObserver = NULL;
+            link->nextObserver = invalidator->_firstLinkedObserver;
+            if (link->nextObserver)
+                invalidatorLinkOfObserverPointer(link->nextObserver)->previousObserver = observerPointer;
+            invalidator->_firstLinkedObserver = observerPointer;
+        } else {
+            if (!invalidator->_observers)
+                invalidator->_observers = [NSMutableSet set];
+            [invalidator->_observers addObject:observer];
+        }
+    } dispatch_semaphore_signal(invalidatorMutex);
+
+    DMObserverStatisticsRecordEvent(DMObserverStatisticsEventAttach, observer, invalidator->_ownerClass);
+
+    // Add a non-retained reference from the observer back to the invalidator for explicit tear-down (the link has one already)
+    if (!link)
+        objc_setAssociatedObject(observer, &DMObserverInvalidatorAssociationKey, invalidator, OBJC_ASSOCIATION_ASSIGN);
 
     // Set up the owner's class to invalidate its observers before its own dealloc code runs
     Class ownerClass = [owner class];
-    dispatch_semaphore_wait(invalidatorAssociationMutex, DISPATCH_TIME_FOREVER);
-    if (![classesWithEarlyInvalidateOnDealloc containsObject:ownerClass]) {
-        [self addEarlyInvalidateOnDeallocToClass:ownerClass];
-        [classesWithEarlyInvalidateOnDealloc addObject:ownerClass];
+    if (!swizzledClassCacheContainsClass(ownerClass)) {
+        dispatch_semaphore_wait(swizzledClassesMutex, DISPATCH_TIME_FOREVER);
+        if (!swizzledClassCacheContainsClass(ownerClass) && ![swizzledClassOverflow containsObject:ownerClass]) {
+            [self addEarlyInvalidateOnDeallocToClass:ownerClass];
+            if (!swizzledClassCacheAddClass(ownerClass))
+                [swizzledClassOverflow addObject:ownerClass];
+        }
+        dispatch_semaphore_signal(swizzledClassesMutex);
     }
-    dispatch_semaphore_signal(invalidatorAssociationMutex);
 }
 
 + (void)observerDidInvalidate:(id<DMAutoInvalidation>)observer;
 {
     if (!observer)
         return;
-    id owner = objc_getAssociatedObject(observer, &DMObserverOwnerAssociationKey);
-    if (!owner)
+    struct DMObserverInvalidatorLink *const link = invalidatorLinkOfObserver(observer);
+    if (link) {
+        [self _unlinkObserver:observer link:link];
         return;
-    objc_setAssociatedObject(observer, &DMObserverOwnerAssociationKey, nil, OBJC_ASSOCIATION_ASSIGN);
-    DMObserverInvalidator *invalidator = objc_getAssociatedObject(owner, &DMAutoInvalidatorAssociationKey);
+    }
+
+    __unsafe_unretained DMObserverInvalidator *const invalidator = objc_getAssociatedObject(observer, &DMObserverInvalidatorAssociationKey);
     if (!invalidator)
-        return; // If we're receiving this because the owner deallocated, its associations will already have been cleared by this point
-    
-    @synchronized (invalidator) {
+        return;
+    objc_setAssociatedObject(observer, &DMObserverInvalidatorAssociationKey, nil, OBJC_ASSOCIATION_ASSIGN);
+
+    // If we're receiving this because the owner deallocated, the invalidator will have already emptied its set by this point
+    dispatch_semaphore_t const mutex = shardMutexForAddress((__bridge void *)invalidator);
+    BOOL detached = NO;
+    Class ownerClass = Nil;
+    dispatch_semaphore_wait(mutex, DISPATCH_TIME_FOREVER); {
+        if (DMObserverStatisticsEnabled) {
+            detached = [invalidator->_observers containsObject:observer];
+            ownerClass = invalidator->_ownerClass;
+        }
         [invalidator->_observers removeObject:observer];
-    }
+    } dispatch_semaphore_signal(mutex);
+    if (detached) // else counted by the invalidator's -dealloc
+        DMObserverStatisticsRecordEvent(DMObserverStatisticsEventInvalidate, observer, ownerClass);
 }
 
 
 #pragma mark Private
 
++ (void)_unlinkObserver:(id<DMAutoInvalidation>)observer link:(struct DMObserverInvalidatorLink *)link;
+{
+    __unsafe_unretained DMObserverInvalidator *const invalidator = (__bridge id)__atomic_load_n(&link->invalidator, __ATOMIC_ACQUIRE);
+    if (!invalidator)
+        return;
+
+    // The invalidator's -dealloc clears links under the same lock, so if the link still points to it, it's still around
+    BOOL detached = NO;
+    Class ownerClass = Nil;
+    dispatch_semaphore_t const mutex = shardMutexForAddress((__bridge void *)invalidator);
+    dispatch_semaphore_wait(mutex, DISPATCH_TIME_FOREVER); {
+        if (link->invalidator == (__bridge void *)invalidator) {
+            if (link->previousObserver)
+                invalidatorLinkOfObserverPointer(link->previousObserver)->nextObserver = link->nextObserver;
+            else
+                invalidator->_firstLinkedObserver = link->nextObserver;
+            if (link->nextObserver)
+                invalidatorLinkOfObserverPointer(link->nextObserver)->previousObserver = link->previousObserver;
+            *link = (struct DMObserverInvalidatorLink){NULL, NULL, NULL};
+            detached = YES;
+            ownerClass = invalidator->_ownerClass;
+        }
+    } dispatch_semaphore_signal(mutex);
+
+    if (!detached)
+        return;
+    DMObserverStatisticsRecordEvent(DMObserverStatisticsEventInvalidate, observer, ownerClass);
+    (void)(__bridge_transfer id)(__bridge void *)observer; // the list's reference
+}
+
+
 // objc headers in 10.7 aren't properly compatible with ARC, grr. (10.8 is fine.)
 #if (MAC_OS_X_VERSION_10_7 >= MAC_OS_X_VERSION_MAX_ALLOWED)
 
@@ -164,7 +345,8 @@ struct objc_super_ARCFIXED {
 #endif
         // We can run this multiple times per object (once per class to which we've added early-notify dealloc) so it must be idempotent.
         // Shouldn't need to lock; this is during -dealloc, so no-one else should be touching the receiver.
-        objc_setAssociatedObject(receiver, &DMAutoInvalidatorAssociationKey, nil, OBJC_ASSOCIATION_RETAIN_NONATOMIC); // Cause the invalidator instance (if any) to be released
+        if (__atomic_load_n(ownerPresenceCountForAddress((__bridge void *)receiver), __ATOMIC_ACQUIRE))
+            objc_setAssociatedObject(receiver, &DMAutoInvalidatorAssociationKey, nil, OBJC_ASSOCIATION_RETAIN_NONATOMIC); // Cause the invalidator instance (if any) to be released
 
         // Proceed with dealloc
         if (originalDeallocIMP) {
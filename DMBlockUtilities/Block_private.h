@@ -12,15 +12,25 @@
 #ifndef _BLOCK_PRIVATE_H_
 #define _BLOCK_PRIVATE_H_
 
+#if __APPLE__
 #include <Availability.h>
 #include <AvailabilityMacros.h>
 #include <TargetConditionals.h>
+#endif
 
 #include <stdbool.h>
 #include <stdio.h>
 
 #include <Block.h>
 
+// Elsewhere (e.g. libobjc2 or compiler-rt's BlocksRuntime) the ABI is the same, but these macros aren't defined
+#ifndef BLOCK_EXPORT
+#define BLOCK_EXPORT extern
+#endif
+#ifndef __OSX_AVAILABLE_STARTING
+#define __OSX_AVAILABLE_STARTING(_mac, _iphone)
+#endif
+
 #if __cplusplus
 extern "C" {
 #endif
@@ -36,7 +46,8 @@ enum {
     BLOCK_IS_GC =             (1 << 27),
     BLOCK_IS_GLOBAL =         (1 << 28),
     BLOCK_USE_STRET =         (1 << 29), // undefined if !BLOCK_HAS_SIGNATURE
-    BLOCK_HAS_SIGNATURE  =    (1 << 30)
+    BLOCK_HAS_SIGNATURE  =    (1 << 30),
+    BLOCK_HAS_EXTENDED_LAYOUT=(1 << 31)  // descriptor's layout is the extended layout below, not a GC layout
 };
 
 // revised new layout
@@ -88,6 +99,41 @@ struct Block_byref_header {
     int size;
 };
 
+// Values for Block_byref->flags to describe __block variables
+enum {
+    // Byref refcount must use the same bits as Block_layout's refcount.
+    // BLOCK_DEALLOCATING =      (0x0001),
+    // BLOCK_REFCOUNT_MASK =     (0xfffe),
+
+    BLOCK_BYREF_LAYOUT_MASK =       (0xf << 28),
+    BLOCK_BYREF_LAYOUT_EXTENDED =   (  1 << 28), // layout string follows the copy/dispose helpers
+    BLOCK_BYREF_LAYOUT_NON_OBJECT = (  2 << 28),
+    BLOCK_BYREF_LAYOUT_STRONG =     (  3 << 28),
+    BLOCK_BYREF_LAYOUT_WEAK =       (  4 << 28),
+    BLOCK_BYREF_LAYOUT_UNRETAINED = (  5 << 28),
+
+    BLOCK_BYREF_IS_GC =             (  1 << 27),
+
+    BLOCK_BYREF_HAS_COPY_DISPOSE =  (  1 << 25),
+    BLOCK_BYREF_NEEDS_FREE =        (  1 << 24),
+};
+
+
+// Extended layout encoding (descriptor's layout field when BLOCK_HAS_EXTENDED_LAYOUT is set)
+//
+// A value below 0x1000 is an inline layout 0x0XYZ: X strong pointers, then Y byref pointers, then Z weak pointers,
+// starting immediately after the block header. Otherwise it points to a string of bytes 0xPN, terminated by 0x00:
+// opcode P, applied to N+1 units, starting immediately after the block header.
+enum {
+    BLOCK_LAYOUT_ESCAPE = 0,             // N=0 halt, rest is non-pointer. N!=0 reserved.
+    BLOCK_LAYOUT_NON_OBJECT_BYTES = 1,   // N bytes non-objects
+    BLOCK_LAYOUT_NON_OBJECT_WORDS = 2,   // N words non-objects
+    BLOCK_LAYOUT_STRONG           = 3,   // N words strong pointers
+    BLOCK_LAYOUT_BYREF            = 4,   // N words byref pointers
+    BLOCK_LAYOUT_WEAK             = 5,   // N words weak pointers
+    BLOCK_LAYOUT_UNRETAINED       = 6,   // N words unretained pointers
+};
+
 
 // Runtime support functions used by compiler when generating copy/dispose helpers
 
@@ -26,33 +26,190 @@
 #endif
 
 
+#ifndef NS_BLOCK_ASSERTIONS
+/* Where one block literal keeps the captures that can retain objects, as offsets from the start of the block.
+ * Every block sharing a descriptor (stack block, heap copies) has the same layout, so we build it once per
+ * descriptor and keep it for the life of the process. */
+typedef struct {
+    BOOL capturesAreTyped; // NO if the compiler didn't describe the layout and we fell back to every word; don't dereference them
+    uint32_t strongCount;
+    uint32_t byrefCount;
+    uint32_t offsets[]; // strongCount strong pointer offsets, then byrefCount __block variable offsets
+} DMBlockCaptureLayout;
+
+enum { DMBlockCaptureMaxDepth = 8 }; // Strong __block variables can refer back to the block holding them
+
+static NSMapTable *captureLayoutsByDescriptor; // descriptor -> DMBlockCaptureLayout *, both opaque
+static dispatch_semaphore_t captureLayoutsMutex;
+
+static const DMBlockCaptureLayout *captureLayoutForBlock(const struct Block_layout *block);
+static BOOL blockCapturesObject(const struct Block_layout *block, uintptr_t object, unsigned depth);
+#endif
+
+
 @implementation DMBlockUtilities
 
+#pragma mark NSObject
+
+#ifndef NS_BLOCK_ASSERTIONS
++ (void)initialize;
+{
+    if (self != [DMBlockUtilities class])
+        return;
+    const NSPointerFunctionsOptions opaqueOptions = (NSPointerFunctionsOpaqueMemory | NSPointerFunctionsOpaquePersonality);
+    captureLayoutsByDescriptor = [[NSMapTable alloc] initWithKeyOptions:opaqueOptions valueOptions:opaqueOptions capacity:0];
+    captureLayoutsMutex = dispatch_semaphore_create(1);
+}
+#endif
+
+
+#pragma mark API
+
 + (BOOL)isObject:(id)object implicitlyRetainedByBlock:(id)block;
 {
     if (!block || !object)
         return NO;
 
 #ifndef NS_BLOCK_ASSERTIONS
-    const struct Block_layout *blockAsLayout = (__bridge void *)block;
-    const ptrdiff_t blockSize = blockAsLayout->descriptor->size;
-
-    // We only pick out pointers that are all word-aligned
-    uintptr_t curCapturedValueAddr = (uintptr_t)blockAsLayout + blockSize;
-    if (curCapturedValueAddr % sizeof(id))
-        curCapturedValueAddr += sizeof(id) - (curCapturedValueAddr % sizeof(id)); // Move forward to aligned address (past size, but we walk back before dereferencing)
-    while ((curCapturedValueAddr -= sizeof(id)) >= (uintptr_t)(blockAsLayout + 1)) // +1 adds sizeof(struct Block_layout), remember
-        if (*(uintptr_t *)curCapturedValueAddr == (uintptr_t)object)
-            return YES;
+    return blockCapturesObject((__bridge void *)block, (uintptr_t)object, 0);
 #else
     NSLog(@"%s Warning: Retained object detection disabled without assertions; this method will always return NO", __func__);
-#endif
     return NO;
+#endif
 }
 
 @end
 
 
+#ifndef NS_BLOCK_ASSERTIONS
+static BOOL pointerIsBlock(uintptr_t pointer)
+{
+    // Tagged pointers (low bits on x86_64, high bit on arm64) aren't addresses
+    if (!pointer || (pointer & (sizeof(void *) - 1)) || (intptr_t)pointer < 0)
+        return NO;
+    const void *const isa = ((const struct Block_layout *)pointer)->isa;
+    return (isa == _NSConcreteStackBlock || isa == _NSConcreteMallocBlock || isa == _NSConcreteGlobalBlock);
+}
+
+static BOOL capturedValueRetainsObject(uintptr_t capturedValue, uintptr_t object, unsigned depth)
+{
+    if (capturedValue == object)
+        return YES;
+    return (depth < DMBlockCaptureMaxDepth && pointerIsBlock(capturedValue) && blockCapturesObject((const struct Block_layout *)capturedValue, object, depth + 1));
+}
+
+static BOOL blockCapturesObject(const struct Block_layout *block, uintptr_t object, unsigned depth)
+{
+    const DMBlockCaptureLayout *const layout = captureLayoutForBlock(block);
+    const char *const blockBytes = (const char *)block;
+
+    for (uint32_t i = 0; i < layout->strongCount; i++) {
+        const uintptr_t capturedValue = *(const uintptr_t *)(blockBytes + layout->offsets[i]);
+        if (layout->capturesAreTyped ? capturedValueRetainsObject(capturedValue, object, depth) : (capturedValue == object))
+            return YES;
+    }
+
+    for (uint32_t i = layout->strongCount; i < layout->strongCount + layout->byrefCount; i++) {
+        // The captured pointer may still refer to the stack copy of the variable; forwarding always points to the live one
+        const struct Block_byref *const byref = (*(struct Block_byref *const *)(blockBytes + layout->offsets[i]))->forwarding;
+        if ((byref->flags & BLOCK_BYREF_LAYOUT_MASK) != BLOCK_BYREF_LAYOUT_STRONG)
+            continue; // __weak, __unsafe_unretained, and MRR __block variables don't retain
+        const size_t variableOffset = sizeof(struct Block_byref_header) + ((byref->flags & BLOCK_BYREF_HAS_COPY_DISPOSE) ? 2 * sizeof(void *) : 0);
+        if (capturedValueRetainsObject(*(const uintptr_t *)((const char *)byref + variableOffset), object, depth))
+            return YES;
+    }
+    return NO;
+}
+
+static const char *extendedLayoutForBlock(const struct Block_layout *block, BOOL *outHasExtendedLayout)
+{
+    *outHasExtendedLayout = ((block->flags & BLOCK_HAS_EXTENDED_LAYOUT) && (block->flags & BLOCK_HAS_SIGNATURE));
+    if (!*outHasExtendedLayout)
+        return NULL;
+    const char *descriptorBytes = (const char *)block->descriptor + sizeof(struct Block_descriptor_1);
+    if (block->flags & BLOCK_HAS_COPY_DISPOSE)
+        descriptorBytes += sizeof(struct Block_descriptor_2);
+    return ((const struct Block_descriptor_3 *)descriptorBytes)->layout;
+}
+
+static DMBlockCaptureLayout *newCaptureLayoutForBlock(const struct Block_layout *block)
+{
+    const size_t blockSize = block->descriptor->size;
+    const size_t maxSlotCount = blockSize / sizeof(id);
+    uint32_t strongOffsets[maxSlotCount + 1], byrefOffsets[maxSlotCount + 1];
+    uint32_t strongCount = 0, byrefCount = 0;
+
+    BOOL capturesAreTyped;
+    const char *const extendedLayout = extendedLayoutForBlock(block, &capturesAreTyped);
+    uintptr_t offset = sizeof(struct Block_layout);
+    if (capturesAreTyped && (uintptr_t)extendedLayout < 0x1000) {
+        const uintptr_t inlineLayout = (uintptr_t)extendedLayout;
+        for (uintptr_t n = (inlineLayout >> 8) & 0xf; n; n--, offset += sizeof(id))
+            strongOffsets[strongCount++] = (uint32_t)offset;
+        for (uintptr_t n = (inlineLayout >> 4) & 0xf; n; n--, offset += sizeof(id))
+            byrefOffsets[byrefCount++] = (uint32_t)offset;
+        // Weak captures follow; they don't retain
+    } else if (capturesAreTyped) {
+        for (const unsigned char *instruction = (const unsigned char *)extendedLayout; *instruction && capturesAreTyped; instruction++) {
+            const unsigned count = (*instruction & 0xf) + 1;
+            switch (*instruction >> 4) {
+                case BLOCK_LAYOUT_NON_OBJECT_BYTES:
+                    offset += count;
+                    break;
+                case BLOCK_LAYOUT_NON_OBJECT_WORDS:
+                case BLOCK_LAYOUT_WEAK:
+                case BLOCK_LAYOUT_UNRETAINED:
+                    offset += count * sizeof(id);
+                    break;
+                case BLOCK_LAYOUT_STRONG:
+                case BLOCK_LAYOUT_BYREF:
+                    offset = (offset + sizeof(id) - 1) & ~(uintptr_t)(sizeof(id) - 1);
+                    for (unsigned n = 0; n < count && offset + sizeof(id) <= blockSize; n++, offset += sizeof(id)) {
+                        if ((*instruction >> 4) == BLOCK_LAYOUT_STRONG)
+                            strongOffsets[strongCount++] = (uint32_t)offset;
+                        else
+                            byrefOffsets[byrefCount++] = (uint32_t)offset;
+                    }
+                    break;
+                default: // Reserved escape or an opcode newer than us; don't trust any of it
+                    capturesAreTyped = NO;
+                    break;
+            }
+        }
+    }
+
+    if (!capturesAreTyped) {
+        // No layout from the compiler, so consider every word-aligned captured value, whatever its type
+        strongCount = byrefCount = 0;
+        for (offset = sizeof(struct Block_layout); offset + sizeof(id) <= blockSize; offset += sizeof(id))
+            strongOffsets[strongCount++] = (uint32_t)offset;
+    }
+
+    DMBlockCaptureLayout *const layout = malloc(sizeof(DMBlockCaptureLayout) + (strongCount + byrefCount) * sizeof(uint32_t));
+    layout->capturesAreTyped = capturesAreTyped;
+    layout->strongCount = strongCount;
+    layout->byrefCount = byrefCount;
+    memcpy(layout->offsets, strongOffsets, strongCount * sizeof(uint32_t));
+    memcpy(layout->offsets + strongCount, byrefOffsets, byrefCount * sizeof(uint32_t));
+    return layout;
+}
+
+static const DMBlockCaptureLayout *captureLayoutForBlock(const struct Block_layout *block)
+{
+    const void *const descriptor = block->descriptor;
+    DMBlockCaptureLayout *layout;
+    dispatch_semaphore_wait(captureLayoutsMutex, DISPATCH_TIME_FOREVER); {
+        layout = NSMapGet(captureLayoutsByDescriptor, descriptor);
+        if (!layout) {
+            layout = newCaptureLayoutForBlock(block);
+            NSMapInsertKnownAbsent(captureLayoutsByDescriptor, descriptor, layout);
+        }
+    } dispatch_semaphore_signal(captureLayoutsMutex);
+    return layout;
+}
+#endif
+
+
 void DMBlockRetainCycleDetected(NSString *msg)
 {
     NSLog(@"WARNING: Retain cycle detected! %@ Break on DMBlockRetainCycleDetected to debug.", msg);
@@ -24,5 +24,7 @@
 - (void)testBlockIvarCapturesSelf;
 - (void)testByReferenceCapture;
 - (void)testPointerAndNonWordCapture;
+- (void)testNestedBlockCapture;
+- (void)testIntegerMatchingObjectAddress;
 
 @end
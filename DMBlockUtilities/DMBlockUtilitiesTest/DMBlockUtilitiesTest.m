@@ -93,4 +93,31 @@
     STAssertFalse([DMBlockUtilities isObject:self implicitlyRetainedByBlock:blk], @"False positive of object capture");
 }
 
+- (void)testNestedBlockCapture;
+{
+    id capturedObject = [NSArray arrayWithObject:@"Deep"];
+
+    dispatch_block_t innerBlk = ^{
+        NSLog(@"Hey, look what I captured: %@", capturedObject);
+    };
+    dispatch_block_t outerBlk = ^{
+        innerBlk();
+    };
+
+    STAssertTrue([DMBlockUtilities isObject:capturedObject implicitlyRetainedByBlock:outerBlk], @"Capture of object by nested block not detected");
+    STAssertFalse([DMBlockUtilities isObject:self implicitlyRetainedByBlock:outerBlk], @"False positive of object capture");
+}
+
+- (void)testIntegerMatchingObjectAddress;
+{
+    id object = [NSArray arrayWithObject:@"Just an address"];
+    uintptr_t objectAddress = (uintptr_t)object;
+
+    dispatch_block_t blk = ^{
+        NSLog(@"Hey, look what I captured: %lx", (unsigned long)objectAddress);
+    };
+
+    STAssertFalse([DMBlockUtilities isObject:object implicitlyRetainedByBlock:blk], @"Integer capture shouldn't be considered an object capture");
+}
+
 @end
@@ -0,0 +1,61 @@
+//
+//  DMEventRing.h
+//  DMAutoInvalidation
+//
+//  Created by agent on 2026-10-17.
+//  Copyright (c) 2026 Delicious Monster Software.
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+
+
+/* What to do with an event appended to a full ring:
+ *
+ * DMEventOverflowDropOldest
+ *      Discard the oldest pending event to make room.
+ *
+ * DMEventOverflowMergeNewest
+ *      Replace the newest pending event with the incoming one, so the consumer still sees the latest event.
+ *
+ * DMEventOverflowBlockPoster
+ *      Wait until the consumer makes room. If the appending thread isn't allowed to block (because it's the
+ *      consumer), falls back to DMEventOverflowDropOldest.
+ *
+ * Dropped and merged events are both counted as overflow. */
+typedef NS_ENUM(NSInteger, DMEventOverflowPolicy) {
+    DMEventOverflowDropOldest,
+    DMEventOverflowMergeNewest,
+    DMEventOverflowBlockPoster,
+};
+
+
+/* DMEventRing is a fixed-capacity FIFO of retained objects. Any number of threads may append; a single consumer
+ * drains. Storage is allocated once, up front, so neither appending nor draining allocates. */
+@interface DMEventRing : NSObject
+
+- (id)initWithCapacity:(NSUInteger)capacity overflowPolicy:(DMEventOverflowPolicy)overflowPolicy;
+
+@property (readonly, nonatomic) NSUInteger capacity;
+@property (readonly, nonatomic) DMEventOverflowPolicy overflowPolicy;
+
+/* Returns NO (and discards the event) if the ring has been cancelled. *outShouldWakeConsumer is set to YES for the
+ * first event appended after the consumer found the ring empty, so the caller can schedule one drain per burst. */
+- (BOOL)appendEvent:(id)event mayBlock:(BOOL)mayBlock shouldWakeConsumer:(BOOL *)outShouldWakeConsumer __attribute__((nonnull(1)));
+
+/* Moves up to maxCount events, oldest first, into the caller's buffer (overwriting its contents) and returns the
+ * number moved. *outOverflowCount (if non-NULL) is set to the number of events dropped or merged since the last
+ * drain. Returning zero marks the consumer as idle. */
+- (NSUInteger)drainEvents:(__strong id *)events maxCount:(NSUInteger)maxCount overflowCount:(NSUInteger *)outOverflowCount __attribute__((nonnull(1)));
+
+- (void)cancel; // Releases pending events and unblocks waiting posters; later appends are discarded
+
+@end
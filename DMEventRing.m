@@ -0,0 +1,164 @@
+//
+//  DMEventRing.m
+//  DMAutoInvalidation
+//
+//  Created by agent on 2026-10-17.
+//  Copyright (c) 2026 Delicious Monster Software.
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#import "DMEventRing.h"
+
+#if !__has_feature(objc_arc)
+#error This file must be compiled with Automatic Reference Counting (ARC).
+#endif
+
+
+@implementation DMEventRing {
+    dispatch_semaphore_t _mutex; // guards the following
+    void **_slots; // +1 references
+    NSUInteger _head, _count;
+    NSUInteger _overflowCount;
+    BOOL _consumerIdle;
+    BOOL _cancelled;
+
+    dispatch_semaphore_t _spaceAvailable;
+    NSUInteger _waitingPosterCount;
+}
+
+@synthesize capacity = _capacity;
+@synthesize overflowPolicy = _overflowPolicy;
+
+#pragma mark NSObject
+
+- (void)dealloc;
+{
+    [self cancel];
+    free(_slots);
+}
+
+- (id)init;
+{ NSAssert(NO, @"Bad initializer; use -initWithCapacity:overflowPolicy:"); return nil; }
+
+
+#pragma mark API
+
+- (id)initWithCapacity:(NSUInteger)capacity overflowPolicy:(DMEventOverflowPolicy)overflowPolicy;
+{
+    NSParameterAssert(capacity > 0);
+    if (!(self = [super init]))
+        return nil;
+    _capacity = capacity;
+    _overflowPolicy = overflowPolicy;
+    _slots = calloc(capacity, sizeof(void *));
+    if (!_slots)
+        return nil;
+    _mutex = dispatch_semaphore_create(1);
+    _spaceAvailable = dispatch_semaphore_create(0);
+    _consumerIdle = YES;
+    return self;
+}
+
+- (BOOL)appendEvent:(id)event mayBlock:(BOOL)mayBlock shouldWakeConsumer:(BOOL *)outShouldWakeConsumer;
+{
+    NSParameterAssert(event);
+    void *evictedEvent = NULL; // Release outside the lock; dealloc could do anything
+    BOOL appended = NO, shouldWakeConsumer = NO;
+
+    dispatch_semaphore_wait(_mutex, DISPATCH_TIME_FOREVER);
+    while (!_cancelled && _count == _capacity && _overflowPolicy == DMEventOverflowBlockPoster && mayBlock) {
+        _waitingPosterCount++;
+        dispatch_semaphore_signal(_mutex);
+        dispatch_semaphore_wait(_spaceAvailable, DISPATCH_TIME_FOREVER);
+        dispatch_semaphore_wait(_mutex, DISPATCH_TIME_FOREVER);
+    }
+
+    if (!_cancelled) {
+        if (_count < _capacity) {
+            _slots[(_head + _count) % _capacity] = (__bridge_retained void *)event;
+            _count++;
+        } else if (_overflowPolicy == DMEventOverflowMergeNewest) {
+            const NSUInteger newest = (_head + _count - 1) % _capacity;
+            evictedEvent = _slots[newest];
+            _slots[newest] = (__bridge_retained void *)event;
+            _overflowCount++;
+        } else {
+            evictedEvent = _slots[_head];
+            _slots[_head] = (__bridge_retained void *)event;
+            _head = (_head + 1) % _capacity;
+            _overflowCount++;
+        }
+        appended = YES;
+        shouldWakeConsumer = _consumerIdle;
+        _consumerIdle = NO;
+    }
+    dispatch_semaphore_signal(_mutex);
+
+    if (evictedEvent)
+        (void)(__bridge_transfer id)evictedEvent;
+    if (outShouldWakeConsumer)
+        *outShouldWakeConsumer = shouldWakeConsumer;
+    return appended;
+}
+
+- (NSUInteger)drainEvents:(__strong id *)events maxCount:(NSUInteger)maxCount overflowCount:(NSUInteger *)outOverflowCount;
+{
+    NSParameterAssert(events);
+    NSUInteger drainedCount, overflowCount, postersToWake;
+
+    dispatch_semaphore_wait(_mutex, DISPATCH_TIME_FOREVER); {
+        drainedCount = MIN(maxCount, _count);
+        for (NSUInteger i = 0; i < drainedCount; i++) {
+            events[i] = (__bridge_transfer id)_slots[_head];
+            _slots[_head] = NULL;
+            _head = (_head + 1) % _capacity;
+        }
+        _count -= drainedCount;
+        if (!drainedCount)
+            _consumerIdle = YES;
+
+        overflowCount = _overflowCount;
+        _overflowCount = 0;
+
+        postersToWake = drainedCount ? _waitingPosterCount : 0;
+        _waitingPosterCount -= postersToWake;
+    } dispatch_semaphore_signal(_mutex);
+
+    while (postersToWake--)
+        dispatch_semaphore_signal(_spaceAvailable);
+    if (outOverflowCount)
+        *outOverflowCount = overflowCount;
+    return drainedCount;
+}
+
+- (void)cancel;
+{
+    NSUInteger postersToWake, releasedHead, releasedCount;
+
+    dispatch_semaphore_wait(_mutex, DISPATCH_TIME_FOREVER); {
+        _cancelled = YES;
+        // Nothing touches the slots once we're cancelled, so the events can be released outside the lock
+        releasedHead = _head, releasedCount = _count;
+        _head = _count = 0;
+        postersToWake = _waitingPosterCount;
+        _waitingPosterCount = 0;
+    } dispatch_semaphore_signal(_mutex);
+
+    while (postersToWake--)
+        dispatch_semaphore_signal(_spaceAvailable);
+    for (NSUInteger i = 0; i < releasedCount; i++) {
+        const NSUInteger slot = (releasedHead + i) % _capacity;
+        (void)(__bridge_transfer id)_slots[slot];
+        _slots[slot] = NULL;
+    }
+}
+
+@end
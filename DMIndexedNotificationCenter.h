@@ -0,0 +1,36 @@
+//
+//  DMIndexedNotificationCenter.h
+//  DMAutoInvalidation
+//
+//  Created by agent on 2026-10-17.
+//  Copyright (c) 2026 Delicious Monster Software.
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+
+
+/* A notification center for many registrations. Registrations are kept in buckets by (name, sender), with names
+ * interned, so posting looks at four buckets (exact, any sender, any name, anything) and costs time in proportion
+ * to the observers it notifies rather than all those registered. Posting only holds the lock while it takes the
+ * buckets, which are immutable (copied when registrations change), and calls observers without it.
+ *
+ * Selector observers are called through an IMP looked up when they register, so an observer whose class changes
+ * its implementation of the selector afterwards should register again. Like NSNotificationCenter, observers
+ * aren't retained; they're referenced weakly, so one deallocating during a post isn't called, and must support weak
+ * references. The registrations of one that deallocates without removing itself are dropped by the next post that
+ * reaches them. Use one where a DMNotificationObserver takes a notification center. */
+@interface DMIndexedNotificationCenter : NSNotificationCenter
+
+/* Same as -removeObserver: for each, but each bucket is rebuilt once. */
+- (void)removeObservers:(NSArray *)observers;
+
+@end
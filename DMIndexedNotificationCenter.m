@@ -0,0 +1,271 @@
+//
+//  DMIndexedNotificationCenter.m
+//  DMAutoInvalidation
+//
+//  Created by agent on 2026-10-17.
+//  Copyright (c) 2026 Delicious Monster Software.
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#import "DMIndexedNotificationCenter.h"
+
+#if !__has_feature(objc_arc)
+#error This file must be compiled with Automatic Reference Counting (ARC).
+#endif
+
+
+/* One observer's interest in one (name, sender). Block registrations are their own observer (and the token handed back). */
+@interface DMIndexedNotificationRegistration : NSObject {
+@package
+    __weak id _observer; // nil once it starts deallocating, even if it hasn't removed itself yet
+    SEL _selector;
+    IMP _implementation;
+    void (^_block)(NSNotification *notification);
+    NSOperationQueue *_queue;
+    NSString *_name; // interned; nil for any name
+    __unsafe_unretained id _sender; // nil for any sender
+    BOOL _removed; // set under the center's lock, read without it
+}
+@end
+
+@implementation DMIndexedNotificationRegistration
+@end
+
+
+@interface DMIndexedNotificationCenter ()
+- (void)_addRegistration:(DMIndexedNotificationRegistration *)registration name:(NSString *)name sender:(id)sender;
+- (void)_removeRegistrationsOfObservers:(NSArray *)observers name:(NSString *)name sender:(id)sender;
+- (void)_removeRegistrations:(NSArray *)registrations;
+- (NSArray *)_bucketForName:(NSString *)internedName sender:(id)sender;
+- (void)_setBucket:(NSArray *)bucket forName:(NSString *)internedName sender:(id)sender;
+@end
+
+
+static const char anySender; // sender key of registrations for any sender
+
+static inline const void *senderKey(id sender)
+{ return sender ? (__bridge const void *)sender : &anySender; }
+
+static BOOL deliverNotification(DMIndexedNotificationRegistration *registration, NSNotification *notification) // Returns NO if the observer went away without removing itself
+{
+    if (__atomic_load_n(&registration->_removed, __ATOMIC_ACQUIRE))
+        return YES; // removed after the post took its buckets
+
+    if (!registration->_block) {
+        id const observer = registration->_observer; // keeps it alive for the call
+        if (!observer)
+            return NO;
+        ((void (*)(id, SEL, NSNotification *))registration->_implementation)(observer, registration->_selector, notification);
+    } else if (!registration->_queue || [NSOperationQueue currentQueue] == registration->_queue)
+        registration->_block(notification);
+    else {
+        void (^const block)(NSNotification *) = registration->_block;
+        [registration->_queue addOperations:@[[NSBlockOperation blockOperationWithBlock:^{ block(notification); }]] waitUntilFinished:YES]; // Posting is synchronous, as with NSNotificationCenter
+    }
+    return YES;
+}
+
+
+@implementation DMIndexedNotificationCenter {
+    dispatch_semaphore_t _mutex;
+    NSMutableSet *_internedNames; // never shrinks; there are only so many notification names
+    NSMapTable *_bucketsByName; // interned name -> sender key -> immutable NSArray of registrations
+    NSMapTable *_bucketsForAnyName; // sender key -> immutable NSArray of registrations
+    NSMapTable *_registrationsByObserver; // weak keys, so an observer that deallocates without removing itself doesn't pass its registrations on to the next object at its address
+}
+
+#pragma mark NSObject
+
+- (id)init;
+{
+    if (!(self = [super init]))
+        return nil;
+    _mutex = dispatch_semaphore_create(1);
+    _internedNames = [NSMutableSet new];
+    _bucketsByName = [[NSMapTable alloc] initWithKeyOptions:(NSPointerFunctionsStrongMemory | NSPointerFunctionsObjectPointerPersonality) valueOptions:NSPointerFunctionsStrongMemory capacity:0];
+    _bucketsForAnyName = [[NSMapTable alloc] initWithKeyOptions:(NSPointerFunctionsOpaqueMemory | NSPointerFunctionsOpaquePersonality) valueOptions:NSPointerFunctionsStrongMemory capacity:0];
+    _registrationsByObserver = [[NSMapTable alloc] initWithKeyOptions:(NSPointerFunctionsWeakMemory | NSPointerFunctionsObjectPointerPersonality) valueOptions:NSPointerFunctionsStrongMemory capacity:0];
+    return self;
+}
+
+
+#pragma mark NSNotificationCenter
+
+- (void)addObserver:(id)observer selector:(SEL)selector name:(NSString *)name object:(id)sender;
+{
+    NSParameterAssert(observer && selector);
+    DMIndexedNotificationRegistration *const registration = [DMIndexedNotificationRegistration new];
+    registration->_observer = observer;
+    registration->_selector = selector;
+    registration->_implementation = [observer methodForSelector:selector];
+    [self _addRegistration:registration name:name sender:sender];
+}
+
+- (id)addObserverForName:(NSString *)name object:(id)sender queue:(NSOperationQueue *)queue usingBlock:(void (^)(NSNotification *notification))block;
+{
+    NSParameterAssert(block);
+    DMIndexedNotificationRegistration *const registration = [DMIndexedNotificationRegistration new];
+    registration->_observer = registration;
+    registration->_block = [block copy];
+    registration->_queue = queue;
+    [self _addRegistration:registration name:name sender:sender];
+    return registration;
+}
+
+- (void)removeObserver:(id)observer;
+{ [self removeObserver:observer name:nil object:nil]; }
+
+- (void)removeObserver:(id)observer name:(NSString *)name object:(id)sender;
+{
+    if (!observer)
+        return;
+    dispatch_semaphore_wait(_mutex, DISPATCH_TIME_FOREVER); {
+        [self _removeRegistrationsOfObservers:@[observer] name:name sender:sender];
+    } dispatch_semaphore_signal(_mutex);
+}
+
+- (void)postNotification:(NSNotification *)notification;
+{
+    NSParameterAssert(notification.name);
+    NSString *const name = notification.name;
+    id const sender = notification.object;
+
+    __strong NSArray *buckets[4] = {nil}; // exact, any sender, any name, anything
+    dispatch_semaphore_wait(_mutex, DISPATCH_TIME_FOREVER); {
+        NSString *const internedName = [_internedNames member:name];
+        NSMapTable *const bucketsBySender = internedName ? [_bucketsByName objectForKey:internedName] : nil;
+        if (sender)
+            buckets[0] = [bucketsBySender objectForKey:(__bridge id)senderKey(sender)];
+        buckets[1] = [bucketsBySender objectForKey:(__bridge id)senderKey(nil)];
+        if (sender)
+            buckets[2] = [_bucketsForAnyName objectForKey:(__bridge id)senderKey(sender)];
+        buckets[3] = [_bucketsForAnyName objectForKey:(__bridge id)senderKey(nil)];
+    } dispatch_semaphore_signal(_mutex);
+
+    NSMutableArray *deadRegistrations = nil;
+    for (NSUInteger i = 0; i < sizeof(buckets) / sizeof(*buckets); i++)
+        for (DMIndexedNotificationRegistration *registration in buckets[i])
+            if (!deliverNotification(registration, notification))
+                [(deadRegistrations ? : (deadRegistrations = [NSMutableArray new])) addObject:registration];
+
+    if (deadRegistrations) {
+        dispatch_semaphore_wait(_mutex, DISPATCH_TIME_FOREVER); {
+            [self _removeRegistrations:deadRegistrations];
+        } dispatch_semaphore_signal(_mutex);
+    }
+}
+
+- (void)postNotificationName:(NSString *)name object:(id)sender;
+{ [self postNotification:[NSNotification notificationWithName:name object:sender]]; }
+
+- (void)postNotificationName:(NSString *)name object:(id)sender userInfo:(NSDictionary *)userInfo;
+{ [self postNotification:[NSNotification notificationWithName:name object:sender userInfo:userInfo]]; }
+
+
+#pragma mark API
+
+- (void)removeObservers:(NSArray *)observers;
+{
+    if (!observers.count)
+        return;
+    dispatch_semaphore_wait(_mutex, DISPATCH_TIME_FOREVER); {
+        [self _removeRegistrationsOfObservers:observers name:nil sender:nil];
+    } dispatch_semaphore_signal(_mutex);
+}
+
+
+#pragma mark Private
+
+- (void)_addRegistration:(DMIndexedNotificationRegistration *)registration name:(NSString *)name sender:(id)sender;
+{
+    registration->_sender = sender;
+    dispatch_semaphore_wait(_mutex, DISPATCH_TIME_FOREVER); {
+        if (name) {
+            NSString *internedName = [_internedNames member:name];
+            if (!internedName)
+                [_internedNames addObject:(internedName = [name copy])];
+            registration->_name = internedName;
+        }
+
+        NSArray *const bucket = [self _bucketForName:registration->_name sender:sender];
+        [self _setBucket:(bucket ? [bucket arrayByAddingObject:registration] : @[registration]) forName:registration->_name sender:sender];
+
+        NSMutableArray *registrations = [_registrationsByObserver objectForKey:registration->_observer];
+        if (!registrations)
+            [_registrationsByObserver setObject:(registrations = [NSMutableArray new]) forKey:registration->_observer];
+        [registrations addObject:registration];
+    } dispatch_semaphore_signal(_mutex);
+}
+
+- (void)_removeRegistrationsOfObservers:(NSArray *)observers name:(NSString *)name sender:(id)sender; // Call with _mutex held
+{
+    NSMutableArray *const removedRegistrations = [NSMutableArray array];
+    for (id observer in observers) {
+        NSMutableArray *const registrations = [_registrationsByObserver objectForKey:observer];
+        NSIndexSet *const removedIndexes = [registrations indexesOfObjectsPassingTest:^BOOL(DMIndexedNotificationRegistration *registration, NSUInteger idx, BOOL *stop) {
+            return (!name || [registration->_name isEqualToString:name]) && (!sender || registration->_sender == sender);
+        }];
+        if (!removedIndexes.count)
+            continue;
+
+        [removedRegistrations addObjectsFromArray:[registrations objectsAtIndexes:removedIndexes]];
+        [registrations removeObjectsAtIndexes:removedIndexes];
+        if (!registrations.count)
+            [_registrationsByObserver removeObjectForKey:observer];
+    }
+    [self _removeRegistrations:removedRegistrations];
+}
+
+- (void)_removeRegistrations:(NSArray *)registrations; // Call with _mutex held
+{
+    // Mark everything being removed first, then copy each affected bucket once
+    NSMapTable *const removedRegistrationByBucket = [[NSMapTable alloc] initWithKeyOptions:(NSPointerFunctionsStrongMemory | NSPointerFunctionsObjectPointerPersonality) valueOptions:NSPointerFunctionsStrongMemory capacity:0];
+    for (DMIndexedNotificationRegistration *registration in registrations) {
+        if (registration->_removed)
+            continue; // a dead observer's, already pruned by another post
+        __atomic_store_n(&registration->_removed, YES, __ATOMIC_RELEASE);
+        [removedRegistrationByBucket setObject:registration forKey:[self _bucketForName:registration->_name sender:registration->_sender]];
+    }
+
+    for (NSArray *bucket in removedRegistrationByBucket) {
+        DMIndexedNotificationRegistration *const removedRegistration = [removedRegistrationByBucket objectForKey:bucket];
+        NSMutableArray *const remainingRegistrations = [NSMutableArray arrayWithCapacity:bucket.count];
+        for (DMIndexedNotificationRegistration *registration in bucket)
+            if (!registration->_removed)
+                [remainingRegistrations addObject:registration];
+        [self _setBucket:[remainingRegistrations copy] forName:removedRegistration->_name sender:removedRegistration->_sender];
+    }
+}
+
+- (NSArray *)_bucketForName:(NSString *)internedName sender:(id)sender;
+{
+    NSMapTable *const bucketsBySender = internedName ? [_bucketsByName objectForKey:internedName] : _bucketsForAnyName;
+    return [bucketsBySender objectForKey:(__bridge id)senderKey(sender)];
+}
+
+- (void)_setBucket:(NSArray *)bucket forName:(NSString *)internedName sender:(id)sender;
+{
+    NSMapTable *bucketsBySender = internedName ? [_bucketsByName objectForKey:internedName] : _bucketsForAnyName;
+    if (!bucketsBySender) {
+        bucketsBySender = [[NSMapTable alloc] initWithKeyOptions:(NSPointerFunctionsOpaqueMemory | NSPointerFunctionsOpaquePersonality) valueOptions:NSPointerFunctionsStrongMemory capacity:0];
+        [_bucketsByName setObject:bucketsBySender forKey:internedName];
+    }
+
+    if (bucket.count)
+        [bucketsBySender setObject:bucket forKey:(__bridge id)senderKey(sender)];
+    else {
+        [bucketsBySender removeObjectForKey:(__bridge id)senderKey(sender)];
+        if (internedName && !bucketsBySender.count)
+            [_bucketsByName removeObjectForKey:internedName];
+    }
+}
+
+@end
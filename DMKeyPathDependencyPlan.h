@@ -0,0 +1,61 @@
+//
+//  DMKeyPathDependencyPlan.h
+//  DMAutoInvalidation
+//
+//  Created by agent on 2026-10-17.
+//  Copyright (c) 2026 Delicious Monster Software.
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+
+
+/* The parts of an entity graph that key path dependencies are worked out from. NSEntityDescription and
+ * NSPropertyDescription conform (see DMManagedObjectObserver.m); anything else modeling entities can too. */
+@protocol DMKeyPathDependencyProperty;
+
+@protocol DMKeyPathDependencyEntity <NSObject>
+- (NSString *)name;
+- (NSArray *)subentities;
+- (NSDictionary *)propertiesByName; // name -> id<DMKeyPathDependencyProperty>
+- (NSSet *)keyPathsForValuesAffectingUnmodeledKey:(NSString *)key; // for keys that aren't properties, e.g. derived values
+@end
+
+@protocol DMKeyPathDependencyProperty <NSObject>
+- (NSString *)name;
+- (id<DMKeyPathDependencyEntity>)dependencyDestinationEntity; // nil unless a relationship
+- (id<DMKeyPathDependencyProperty>)dependencyInverseProperty; // nil unless a relationship with an inverse
+@end
+
+
+/* Which modeled properties of which entities affect some key paths of a base entity, and how to get from each of those
+ * entities back to the base entity. Working this out walks the entity graph and the dependent keys of each class, so
+ * plans are compiled once per (entity, key path set) and shared for as long as the entity lives; an entity belongs to
+ * one model. Plans are immutable. */
+@interface DMKeyPathDependencyPlan : NSObject
+
++ (instancetype)planForEntity:(id<DMKeyPathDependencyEntity>)baseEntity keyPaths:(NSSet *)keyPaths; // Cached; thread-safe
+
+- (id)initWithEntity:(id<DMKeyPathDependencyEntity>)baseEntity keyPaths:(NSSet *)keyPaths; // Compiles a new plan
+
+@property (readonly, nonatomic, weak) id<DMKeyPathDependencyEntity> baseEntity; // not retained, so cached plans don't keep a model alive
+@property (readonly, nonatomic, copy) NSSet *keyPaths;
+@property (readonly, nonatomic, copy) NSSet *baseEntityNames; // the base entity and its subentities
+
+/* Entity name -> NSSet of property names; equal sets are shared. Includes the base entity and its subentities. */
+@property (readonly, nonatomic, copy) NSDictionary *entityNamesToModeledPropertyNames;
+
+/* Entity name -> key path back to the base entity, or NSNull where some relationship on the way has no inverse. */
+@property (readonly, nonatomic, copy) NSDictionary *entityNamesToInverseRelationshipKeyPaths;
+
+- (BOOL)entityNameIsKindOfBaseEntity:(NSString *)entityName;
+
+@end
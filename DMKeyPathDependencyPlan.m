@@ -0,0 +1,218 @@
+//
+//  DMKeyPathDependencyPlan.m
+//  DMAutoInvalidation
+//
+//  Created by agent on 2026-10-17.
+//  Copyright (c) 2026 Delicious Monster Software.
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#import "DMKeyPathDependencyPlan.h"
+#import "DMSafeKVC.h"
+
+#if !__has_feature(objc_arc)
+#error This file must be compiled with Automatic Reference Counting (ARC).
+#endif
+
+
+static dispatch_semaphore_t planCacheMutex;
+static NSMapTable *plansByEntity; // weak entity (by identity) -> NSMutableDictionary of key path set -> plan; guarded by planCacheMutex
+
+
+@interface DMKeyPathDependencyPlan ()
+- (NSArray *)_flattenedSubentitiesOfEntity:(id<DMKeyPathDependencyEntity>)entity;
+- (NSDictionary *)_compileEntityNamesToModeledPropertyNames;
+- (NSDictionary *)_compileEntityNamesToInverseRelationshipKeyPaths;
+- (void)_enumerateModeledPropertiesAffectingKeyPath:(NSString *)modeledOrUnmodeledKeyPath ofEntity:(id<DMKeyPathDependencyEntity>)entity usingBlock:(void (^)(id<DMKeyPathDependencyProperty> property, id<DMKeyPathDependencyEntity> entityOrSubentity))block;
+@end
+
+
+@implementation DMKeyPathDependencyPlan {
+    NSMapTable *_flattenedSubentitiesByEntity; // only while compiling
+}
+
+@synthesize baseEntity = _baseEntity;
+@synthesize keyPaths = _keyPaths;
+@synthesize baseEntityNames = _baseEntityNames;
+@synthesize entityNamesToModeledPropertyNames = _entityNamesToModeledPropertyNames;
+@synthesize entityNamesToInverseRelationshipKeyPaths = _entityNamesToInverseRelationshipKeyPaths;
+
+#pragma mark NSObject
+
++ (void)initialize;
+{
+    if (self != [DMKeyPathDependencyPlan class])
+        return;
+    planCacheMutex = dispatch_semaphore_create(1);
+    // Weak keys, so a model (and its plans) can go away once nothing else uses it; plans don't retain their entity
+    plansByEntity = [[NSMapTable alloc] initWithKeyOptions:(NSPointerFunctionsWeakMemory | NSPointerFunctionsObjectPointerPersonality) valueOptions:NSPointerFunctionsStrongMemory capacity:0];
+}
+
+- (NSString *)description;
+{ return [NSString stringWithFormat:@"<%@ %p: %@ %@>", [self class], self, _baseEntity.name, [_keyPaths.allObjects componentsJoinedByString:@", "]]; }
+
+
+#pragma mark API
+
++ (instancetype)planForEntity:(id<DMKeyPathDependencyEntity>)baseEntity keyPaths:(NSSet *)keyPaths;
+{
+    NSParameterAssert(baseEntity && keyPaths);
+    DMKeyPathDependencyPlan *plan;
+    dispatch_semaphore_wait(planCacheMutex, DISPATCH_TIME_FOREVER); {
+        plan = [[plansByEntity objectForKey:baseEntity] objectForKey:keyPaths];
+    } dispatch_semaphore_signal(planCacheMutex);
+    if (plan)
+        return plan;
+
+    // Compile outside the lock, as it calls out to model classes. If another thread got there first, use its plan so there's only ever one.
+    DMKeyPathDependencyPlan *const compiledPlan = [[self alloc] initWithEntity:baseEntity keyPaths:keyPaths];
+    dispatch_semaphore_wait(planCacheMutex, DISPATCH_TIME_FOREVER); {
+        NSMutableDictionary *plansByKeyPaths = [plansByEntity objectForKey:baseEntity];
+        if (!plansByKeyPaths)
+            [plansByEntity setObject:(plansByKeyPaths = [NSMutableDictionary dictionary]) forKey:baseEntity];
+        plan = plansByKeyPaths[compiledPlan.keyPaths];
+        if (!plan)
+            plan = plansByKeyPaths[compiledPlan.keyPaths] = compiledPlan;
+    } dispatch_semaphore_signal(planCacheMutex);
+    return plan;
+}
+
+- (id)initWithEntity:(id<DMKeyPathDependencyEntity>)baseEntity keyPaths:(NSSet *)keyPaths;
+{
+    NSParameterAssert(baseEntity && keyPaths);
+    if (!(self = [super init]))
+        return nil;
+    _baseEntity = baseEntity;
+    _keyPaths = [keyPaths copy];
+
+    _flattenedSubentitiesByEntity = [[NSMapTable alloc] initWithKeyOptions:(NSPointerFunctionsStrongMemory | NSPointerFunctionsObjectPointerPersonality) valueOptions:NSPointerFunctionsStrongMemory capacity:0];
+    _baseEntityNames = [NSSet setWithArray:[[self _flattenedSubentitiesOfEntity:baseEntity] valueForKey:@"name"]];
+    _entityNamesToModeledPropertyNames = [self _compileEntityNamesToModeledPropertyNames];
+    _entityNamesToInverseRelationshipKeyPaths = [self _compileEntityNamesToInverseRelationshipKeyPaths];
+    _flattenedSubentitiesByEntity = nil;
+    return self;
+}
+
+- (BOOL)entityNameIsKindOfBaseEntity:(NSString *)entityName;
+{ return [_baseEntityNames containsObject:entityName]; }
+
+
+#pragma mark Private
+
+- (NSArray *)_flattenedSubentitiesOfEntity:(id<DMKeyPathDependencyEntity>)entity;
+{
+    // Relationships to the same entity come up over and over while compiling
+    NSArray *entities = [_flattenedSubentitiesByEntity objectForKey:entity];
+    if (entities)
+        return entities;
+
+    NSMutableArray *const mutableEntities = [NSMutableArray arrayWithObject:entity];
+    for (id<DMKeyPathDependencyEntity> subentity in entity.subentities)
+        [mutableEntities addObjectsFromArray:[self _flattenedSubentitiesOfEntity:subentity]];
+    entities = [mutableEntities copy];
+    [_flattenedSubentitiesByEntity setObject:entities forKey:entity];
+    return entities;
+}
+
+- (NSDictionary *)_compileEntityNamesToModeledPropertyNames;
+{
+    NSMutableDictionary *const modeledPropertyNamesByEntityName = [NSMutableDictionary new];
+    void (^accumulatePropertiesByEntityBlock)(id<DMKeyPathDependencyProperty>, id<DMKeyPathDependencyEntity>) = ^(id<DMKeyPathDependencyProperty> property, id<DMKeyPathDependencyEntity> entityOrSubentity) {
+        NSMutableSet *mutableSet = modeledPropertyNamesByEntityName[entityOrSubentity.name];
+        if (!mutableSet)
+            mutableSet = modeledPropertyNamesByEntityName[entityOrSubentity.name] = [NSMutableSet new];
+        [mutableSet addObject:property.name];
+    };
+
+    for (id<DMKeyPathDependencyEntity> entity in [self _flattenedSubentitiesOfEntity:_baseEntity])
+        for (NSString *keyPath in _keyPaths)
+            [self _enumerateModeledPropertiesAffectingKeyPath:keyPath ofEntity:entity usingBlock:accumulatePropertiesByEntityBlock];
+
+    // Share set instances when used for the same keys. Typically many sets are identical (particularly if entities have sub-entities) so this uses less memory; may make for better locality when processing notification. No proven reason.
+    NSMutableSet *const keySets = [NSMutableSet new];
+    // Use new dictionary, because stupidly they can't be mutated while enumerating
+    NSMutableDictionary *const uniquedModeledPropertyNamesByEntityName = [NSMutableDictionary dictionaryWithCapacity:modeledPropertyNamesByEntityName.count];
+    [modeledPropertyNamesByEntityName enumerateKeysAndObjectsUsingBlock:^(NSString *entityName, NSSet *modeledPropertyNames, BOOL *stop) {
+        NSSet *uniquedSet = [keySets member:modeledPropertyNames];
+        if (!uniquedSet)
+            uniquedSet = [modeledPropertyNames copy], [keySets addObject:uniquedSet];
+        uniquedModeledPropertyNamesByEntityName[entityName] = uniquedSet;
+    }];
+
+    return uniquedModeledPropertyNamesByEntityName;
+}
+
+- (NSDictionary *)_compileEntityNamesToInverseRelationshipKeyPaths;
+{
+    // Resulting dictionary contains NSNull if some relationships are missing inverses, so traversal isn't possible
+    NSMutableDictionary *const inverseRelationshipPathByEntityName = [NSMutableDictionary new];
+    void (^accumulateInverseRelationshipByEntityBlock)(id<DMKeyPathDependencyProperty>, id<DMKeyPathDependencyEntity>) = ^(id<DMKeyPathDependencyProperty> property, id<DMKeyPathDependencyEntity> entityOrSubentity) {
+        id<DMKeyPathDependencyEntity> const destinationEntity = property.dependencyDestinationEntity;
+        if (!destinationEntity)
+            return;
+
+        id inverseKeyPathOrNull = [NSNull null];
+        id<DMKeyPathDependencyProperty> const inverseRelationship = property.dependencyInverseProperty;
+        if (inverseRelationship) {
+            inverseKeyPathOrNull = inverseRelationship.name;
+            if (![self entityNameIsKindOfBaseEntity:entityOrSubentity.name]) {
+                NSString *subsequentPathToBase = inverseRelationshipPathByEntityName[entityOrSubentity.name];
+                if (![subsequentPathToBase isKindOfClass:[NSNull class]] && subsequentPathToBase.length)
+                    inverseKeyPathOrNull = [inverseKeyPathOrNull stringByAppendingPathExtension:subsequentPathToBase];
+            }
+        }
+
+        for (id<DMKeyPathDependencyEntity> destinationEntityOrSubentity in [self _flattenedSubentitiesOfEntity:destinationEntity])
+            inverseRelationshipPathByEntityName[destinationEntityOrSubentity.name] = inverseKeyPathOrNull;
+    };
+
+    for (id<DMKeyPathDependencyEntity> entity in [self _flattenedSubentitiesOfEntity:_baseEntity])
+        for (NSString *keyPath in _keyPaths)
+            [self _enumerateModeledPropertiesAffectingKeyPath:keyPath ofEntity:entity usingBlock:accumulateInverseRelationshipByEntityBlock];
+
+    return [inverseRelationshipPathByEntityName copy];
+}
+
+- (void)_enumerateModeledPropertiesAffectingKeyPath:(NSString *)modeledOrUnmodeledKeyPath ofEntity:(id<DMKeyPathDependencyEntity>)entity usingBlock:(void (^)(id<DMKeyPathDependencyProperty> property, id<DMKeyPathDependencyEntity> entityOrSubentity))block;
+{
+    NSString *remainingKeyPath;
+    NSString *const firstKey = DMSplitKeyPath(modeledOrUnmodeledKeyPath, &remainingKeyPath);
+
+    id<DMKeyPathDependencyProperty> const modeledProperty = entity.propertiesByName[firstKey];
+    if (!modeledProperty) {
+        for (NSString *dependentKeyPath in [entity keyPathsForValuesAffectingUnmodeledKey:firstKey]) {
+            /* Add the remaining key path onto the dependent key. This may not be how the dependent key is actually used,
+             * but unknown keys are ignored by +keyPathsForValuesAffectingValueForKey: so we can be more promiscuous.
+             * For example, a case where it's appropriate is observing "primarySynopsis.string", where -primarySynopsis
+             * returns { self.userSynopsis ? : self.amazonSynopses.firstObject } (synopsis being a managed object), thus
+             * depending on K(userSynopsis) and K(amazonSynopses), then _also_ on K(string) of Synopsis. */
+            NSString *const dependentKeyPathWithSuffix = remainingKeyPath.length ? [dependentKeyPath stringByAppendingPathExtension:remainingKeyPath] : dependentKeyPath;
+            [self _enumerateModeledPropertiesAffectingKeyPath:dependentKeyPathWithSuffix ofEntity:entity usingBlock:block];
+        }
+
+    } else {
+        // Key is a modeled property (attribute or relationship)
+        block(modeledProperty, entity);
+
+        if (remainingKeyPath.length) {
+            id<DMKeyPathDependencyEntity> const destinationEntity = modeledProperty.dependencyDestinationEntity;
+            if (destinationEntity) {
+                for (id<DMKeyPathDependencyEntity> destinationEntityOrSubentity in [self _flattenedSubentitiesOfEntity:destinationEntity])
+                    [self _enumerateModeledPropertiesAffectingKeyPath:remainingKeyPath ofEntity:destinationEntityOrSubentity usingBlock:block];
+
+            } else {
+                // Ignore remaining key path of non-relationship (e.g. an NSDictionary); that won't post an ObjectsDidChangeNotification anyway.
+            }
+        }
+    }
+}
+
+@end
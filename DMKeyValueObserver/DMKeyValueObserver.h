@@ -16,9 +16,14 @@
 //
 
 #import <Foundation/Foundation.h>
+#import "DMEventRing.h"
 
-@class DMKeyValueObserver;
+@class DMKeyValueObserver, DMObservationStream;
 typedef void(^DMKeyValueObserverBlock)(NSDictionary *changeDict, id localSelf, DMKeyValueObserver *observer);
+typedef void(^DMKeyValueObserverChangeBlock)(id localSelf, DMKeyValueObserver *observer);
+typedef void(^DMKeyValueObserverNewValueBlock)(id newValue, id localSelf, DMKeyValueObserver *observer);
+typedef void(^DMKeyValueObserverOldAndNewValueBlock)(id oldValue, id newValue, id localSelf, DMKeyValueObserver *observer); // NSNull values are passed as nil
+typedef void(^DMCoalescedKeyValueObserverBlock)(NSUInteger changeCount, NSArray *changingObjects, id localSelf, DMKeyValueObserver *observer); // changingObjects are distinct by identity
 
 /* #defines recognized in implementation:
  *
@@ -42,6 +47,33 @@ typedef void(^DMKeyValueObserverBlock)(NSDictionary *changeDict, id localSelf, D
 + (instancetype)observerWithKeyPath:(NSString *)keyPath object:(id)observationTarget attachedToOwner:(id)owner action:(DMKeyValueObserverBlock)actionBlock;
 + (instancetype)observerWithKeyPath:(NSString *)keyPath object:(id)observationTarget attachedToOwner:(id)owner options:(NSKeyValueObservingOptions)options action:(DMKeyValueObserverBlock)actionBlock;
 
+/* Typed actions for observers that don't need the whole change dictionary; the block is called directly.
+ * Change actions register with no options, so KVO doesn't fetch or box any values. New value actions read the value
+ * from the changing object at the time of the change instead of having KVO copy it into the change dictionary, so
+ * for a change to a to-many property they're passed the whole collection, not just the inserted or replaced objects
+ * (use a change dictionary action for those). Old and new value actions need KVO to capture the old value before
+ * the change, so they request both. */
++ (instancetype)observerWithKeyPath:(NSString *)keyPath object:(id)observationTarget attachedToOwner:(id)owner changeAction:(DMKeyValueObserverChangeBlock)changeBlock;
++ (instancetype)observerWithKeyPath:(NSString *)keyPath object:(id)observationTarget attachedToOwner:(id)owner newValueAction:(DMKeyValueObserverNewValueBlock)newValueBlock;
++ (instancetype)observerWithKeyPath:(NSString *)keyPath object:(id)observationTarget attachedToOwner:(id)owner oldAndNewValueAction:(DMKeyValueObserverOldAndNewValueBlock)oldAndNewValueBlock;
++ (instancetype)observerWithKeyPath:(NSString *)keyPath objects:(NSArray *)observationTargets attachedToOwner:(id)owner changeAction:(DMKeyValueObserverChangeBlock)changeBlock;
++ (instancetype)observerWithKeyPath:(NSString *)keyPath objects:(NSArray *)observationTargets attachedToOwner:(id)owner newValueAction:(DMKeyValueObserverNewValueBlock)newValueBlock;
++ (instancetype)observerWithKeyPath:(NSString *)keyPath objects:(NSArray *)observationTargets attachedToOwner:(id)owner oldAndNewValueAction:(DMKeyValueObserverOldAndNewValueBlock)oldAndNewValueBlock;
+
+/* Coalescing observers run their action once per batch of changes instead of once per change. A batch is flushed
+ * `interval` seconds after its first change, or with an interval of zero, once the work already submitted to `queue`
+ * has drained (for the main queue, that's the end of the current run loop turn). The action runs on `queue`, or the
+ * main queue if nil. It isn't run if the observer is invalidated first. */
++ (instancetype)coalescingObserverWithKeyPath:(NSString *)keyPath objects:(NSArray *)observationTargets attachedToOwner:(id)owner interval:(NSTimeInterval)interval queue:(dispatch_queue_t)queue action:(DMCoalescedKeyValueObserverBlock)coalescedActionBlock;
+
+/* Stream observers don't run an action: each change appends the changing object to the returned stream for a
+ * consumer to drain in bulk (see DMObservationStream.h), which reads whatever values it needs when it gets to them.
+ * Pending events retain their objects. Up to `capacity` are held; beyond that, overflowPolicy applies, except that
+ * DMEventOverflowBlockPoster isn't supported: changes are reported on the changing thread, often the consumer's own
+ * and in the middle of a setter, so waiting there could deadlock. The stream is attached to the owner, and
+ * invalidating it invalidates the observer. */
++ (DMObservationStream *)streamWithKeyPath:(NSString *)keyPath objects:(NSArray *)observationTargets attachedToOwner:(id)owner capacity:(NSUInteger)capacity overflowPolicy:(DMEventOverflowPolicy)overflowPolicy;
+
 - (id)init UNAVAILABLE_ATTRIBUTE;
 - (id)initWithKeyPath:(NSString *)keyPath object:(id)observationTarget attachedToOwner:(id)owner options:(NSKeyValueObservingOptions)options action:(DMKeyValueObserverBlock)actionBlock;
 - (id)initWithKeyPath:(NSString *)keyPath objects:(NSArray *)observationTargets attachedToOwner:(id)owner options:(NSKeyValueObservingOptions)options action:(DMKeyValueObserverBlock)actionBlock;
@@ -17,7 +17,11 @@
 
 #import "DMKeyValueObserver.h"
 
+#import "DMActionCoalescer.h"
 #import "DMAutoInvalidation.h"
+#import "DMObservationStream.h"
+#import "DMObserverStatistics.h"
+#import <objc/runtime.h>
 
 #if __has_include("DMBlockUtilities.h")
 #import "DMBlockUtilities.h"
@@ -43,12 +47,26 @@
 
 /* Objects of this class are used to invalidate a key-value observer if the target object is deallocated while a
  * DMKeyValueObserver is observing it. NSObject's implementation raises an error here by default, but classes that
- * override it (such as NSArrayController) do NOT log an error -- instead, random corruption happens later. */
+ * override it (such as NSArrayController) do NOT log an error -- instead, random corruption happens later.
+ * There's one per target, shared by all the DMKeyValueObservers watching it, so that watching many targets
+ * (or one target from many observers) costs one attachment per target, not one per observer/target pair. */
 @interface DMKeyValueTargetObserver : NSObject <DMAutoInvalidation>
-- (id)initWithKeyValueObserver:(DMKeyValueObserver *)keyValueObserver target:(id)target;
++ (NSArray *)targetObserversByAddingKeyValueObserver:(DMKeyValueObserver *)keyValueObserver toTargets:(NSArray *)targets;
++ (void)removeKeyValueObserver:(DMKeyValueObserver *)keyValueObserver fromTargetObservers:(NSArray *)targetObservers;
 @end
 
+/* Which kind of block an observer's action is, so typed actions are called directly rather than through a wrapper. */
+typedef NS_ENUM(uint8_t, DMKeyValueObserverActionKind) {
+    DMKeyValueObserverChangeDictionaryAction,
+    DMKeyValueObserverChangeAction,
+    DMKeyValueObserverNewValueAction,
+    DMKeyValueObserverOldAndNewValueAction,
+};
+
 @interface DMKeyValueObserver () <DMAutoInvalidation>
+- (id)_initWithKeyPath:(NSString *)keyPath objects:(NSArray *)observationTargets attachedToOwner:(id)owner options:(NSKeyValueObservingOptions)options action:(id)actionBlock actionKind:(DMKeyValueObserverActionKind)actionKind eventRing:(DMEventRing *)eventRing;
+- (void)_performWithOwner:(void (^)(id owner))block;
+- (BOOL)_markInvalidated;
 #pragma mark Protected: DMKeyValueTargetObserver support
 - (void)targetWillDeallocate:(__unsafe_unretained id)deallocatingTarget;
 @end
@@ -64,7 +82,11 @@ static char DMKeyValueObserverContext;
 
     NSArray *_targetObservers;
     __unsafe_unretained id _unsafeOwner;
-    DMKeyValueObserverBlock _actionBlock;
+    struct DMObserverInvalidatorLink _invalidatorLink;
+    id _actionBlock; // of the type given by _actionKind
+    DMKeyValueObserverActionKind _actionKind;
+    DMEventRing *_eventRing; // stream observers only, instead of an action
+    DMActionCoalescer *_coalescer; // coalescing observers only
 }
 
 @synthesize changingObject = _changingObject;
@@ -107,16 +129,14 @@ static char DMKeyValueObserverContext;
 
 - (void)invalidate;
 {
-    if (_invalidated)
+    if (![self _markInvalidated])
         return;
-    _invalidated = YES;
 
     /* We may be getting invalidated because our owner is deallocating.
      * If so, calling -allObjects on the NSHashTable will retain/autorelease the owner, and the deferred release will crash.
      * Wrap in our own pool so the -release is fired before the object is finished deallocating. */
     @autoreleasepool {
-        for (DMKeyValueTargetObserver *targetObserver in _targetObservers)
-            [targetObserver invalidate];
+        [DMKeyValueTargetObserver removeKeyValueObserver:self fromTargetObservers:_targetObservers];
         _targetObservers = nil;
 
         if (_unsafeSingleTarget) {
@@ -127,6 +147,9 @@ static char DMKeyValueObserverContext;
             [remainingObjects removeObserver:self fromObjectsAtIndexes:[NSIndexSet indexSetWithIndexesInRange:(NSRange){0, remainingObjects.count}] forKeyPath:_keyPath context:&DMKeyValueObserverContext];
         }
 
+        [_eventRing cancel];
+        [_coalescer cancel];
+        _coalescer = nil;
         _keyPath = nil;
         _unsafeOwner = nil;
         _actionBlock = nil;
@@ -134,6 +157,51 @@ static char DMKeyValueObserverContext;
     }
 }
 
+- (struct DMObserverInvalidatorLink *)observerInvalidatorLink;
+{ return &_invalidatorLink; }
+
++ (void)invalidateObserversForDeallocatingOwner:(NSArray *)observers;
+{
+    @autoreleasepool { // See comment in -invalidate
+        // Group removals by target, so each target's observation info is walked while it's hot
+        NSMapTable *const observersByTarget = [[NSMapTable alloc] initWithKeyOptions:(NSPointerFunctionsOpaqueMemory | NSPointerFunctionsObjectPointerPersonality) valueOptions:NSPointerFunctionsStrongMemory capacity:observers.count];
+        void (^addObserverForTarget)(DMKeyValueObserver *, __unsafe_unretained id) = ^(DMKeyValueObserver *observer, __unsafe_unretained id target) {
+            NSMutableArray *targetObservers = [observersByTarget objectForKey:target];
+            if (!targetObservers)
+                [observersByTarget setObject:(targetObservers = [NSMutableArray array]) forKey:target];
+            [targetObservers addObject:observer];
+        };
+
+        for (DMKeyValueObserver *observer in observers) {
+            if (![observer _markInvalidated])
+                continue;
+
+            [DMKeyValueTargetObserver removeKeyValueObserver:observer fromTargetObservers:observer->_targetObservers];
+            observer->_targetObservers = nil;
+
+            if (observer->_unsafeSingleTarget)
+                addObserverForTarget(observer, observer->_unsafeSingleTarget);
+            else
+                for (__unsafe_unretained id target in observer->_targetsAsUnsafePointers)
+                    addObserverForTarget(observer, target);
+            observer->_targetsAsUnsafePointers = nil;
+        }
+
+        for (__unsafe_unretained id target in observersByTarget)
+            for (DMKeyValueObserver *observer in [observersByTarget objectForKey:target])
+                [target removeObserver:observer forKeyPath:observer->_keyPath context:&DMKeyValueObserverContext];
+
+        for (DMKeyValueObserver *observer in observers) {
+            [observer->_eventRing cancel];
+            [observer->_coalescer cancel];
+            observer->_coalescer = nil;
+            observer->_keyPath = nil;
+            observer->_unsafeOwner = nil;
+            observer->_actionBlock = nil;
+        }
+    }
+}
+
 
 #pragma mark API
 
@@ -143,20 +211,128 @@ static char DMKeyValueObserverContext;
 + (instancetype)observerWithKeyPath:(NSString *)keyPath object:(id)observationTarget attachedToOwner:(id)owner options:(NSKeyValueObservingOptions)options action:(DMKeyValueObserverBlock)actionBlock;
 { return [[self alloc] initWithKeyPath:keyPath object:observationTarget attachedToOwner:owner options:options action:actionBlock]; }
 
++ (instancetype)observerWithKeyPath:(NSString *)keyPath object:(id)observationTarget attachedToOwner:(id)owner changeAction:(DMKeyValueObserverChangeBlock)changeBlock;
+{ return [self observerWithKeyPath:keyPath objects:@[observationTarget] attachedToOwner:owner changeAction:changeBlock]; }
+
++ (instancetype)observerWithKeyPath:(NSString *)keyPath object:(id)observationTarget attachedToOwner:(id)owner newValueAction:(DMKeyValueObserverNewValueBlock)newValueBlock;
+{ return [self observerWithKeyPath:keyPath objects:@[observationTarget] attachedToOwner:owner newValueAction:newValueBlock]; }
+
++ (instancetype)observerWithKeyPath:(NSString *)keyPath object:(id)observationTarget attachedToOwner:(id)owner oldAndNewValueAction:(DMKeyValueObserverOldAndNewValueBlock)oldAndNewValueBlock;
+{ return [self observerWithKeyPath:keyPath objects:@[observationTarget] attachedToOwner:owner oldAndNewValueAction:oldAndNewValueBlock]; }
+
++ (instancetype)observerWithKeyPath:(NSString *)keyPath objects:(NSArray *)observationTargets attachedToOwner:(id)owner changeAction:(DMKeyValueObserverChangeBlock)changeBlock;
+{
+    NSParameterAssert(changeBlock);
+    return [[self alloc] _initWithKeyPath:keyPath objects:observationTargets attachedToOwner:owner options:0 action:changeBlock actionKind:DMKeyValueObserverChangeAction eventRing:nil];
+}
+
++ (instancetype)observerWithKeyPath:(NSString *)keyPath objects:(NSArray *)observationTargets attachedToOwner:(id)owner newValueAction:(DMKeyValueObserverNewValueBlock)newValueBlock;
+{
+    NSParameterAssert(newValueBlock);
+    return [[self alloc] _initWithKeyPath:keyPath objects:observationTargets attachedToOwner:owner options:0 action:newValueBlock actionKind:DMKeyValueObserverNewValueAction eventRing:nil];
+}
+
++ (instancetype)observerWithKeyPath:(NSString *)keyPath objects:(NSArray *)observationTargets attachedToOwner:(id)owner oldAndNewValueAction:(DMKeyValueObserverOldAndNewValueBlock)oldAndNewValueBlock;
+{
+    NSParameterAssert(oldAndNewValueBlock);
+    return [[self alloc] _initWithKeyPath:keyPath objects:observationTargets attachedToOwner:owner options:(NSKeyValueObservingOptionOld | NSKeyValueObservingOptionNew) action:oldAndNewValueBlock actionKind:DMKeyValueObserverOldAndNewValueAction eventRing:nil];
+}
+
++ (instancetype)coalescingObserverWithKeyPath:(NSString *)keyPath objects:(NSArray *)observationTargets attachedToOwner:(id)owner interval:(NSTimeInterval)interval queue:(dispatch_queue_t)queue action:(DMCoalescedKeyValueObserverBlock)coalescedActionBlock;
+{
+    NSParameterAssert(owner && coalescedActionBlock);
+#if HAVE_DMBLOCKUTILITIES && !defined(NS_BLOCK_ASSERTIONS)
+    if ([DMBlockUtilities isObject:owner implicitlyRetainedByBlock:coalescedActionBlock])
+        DMBlockRetainCycleDetected([NSString stringWithFormat:@"%s action captures owner; use localSelf (localOwner) parameter to fix.", __func__]);
+#endif
+
+    __block __weak DMKeyValueObserver *weakObserver = nil;
+    DMActionCoalescer *const coalescer = [[DMActionCoalescer alloc] initWithInterval:interval queue:(queue ? : dispatch_get_main_queue()) flushBlock:^(NSUInteger triggerCount, NSArray *distinctObjects) {
+        DMKeyValueObserver *const observer = weakObserver;
+        [observer _performWithOwner:^(id localOwner) {
+            coalescedActionBlock(triggerCount, distinctObjects, localOwner, observer);
+        }];
+    }];
+
+    DMKeyValueObserver *const observer = [[self alloc] initWithKeyPath:keyPath objects:observationTargets attachedToOwner:owner options:0 action:^(NSDictionary *changeDict, id localOwner, DMKeyValueObserver *observer) {
+        [coalescer addTriggerWithObject:observer.changingObject];
+    }];
+    observer->_coalescer = coalescer;
+    weakObserver = observer;
+    return observer;
+}
+
++ (DMObservationStream *)streamWithKeyPath:(NSString *)keyPath objects:(NSArray *)observationTargets attachedToOwner:(id)owner capacity:(NSUInteger)capacity overflowPolicy:(DMEventOverflowPolicy)overflowPolicy;
+{
+    NSParameterAssert(owner && capacity);
+    NSParameterAssert(overflowPolicy != DMEventOverflowBlockPoster);
+    DMEventRing *const eventRing = [[DMEventRing alloc] initWithCapacity:capacity overflowPolicy:overflowPolicy];
+    DMKeyValueObserver *const observer = [[self alloc] _initWithKeyPath:keyPath objects:observationTargets attachedToOwner:owner options:0 action:nil actionKind:DMKeyValueObserverChangeDictionaryAction eventRing:eventRing];
+    if (!observer)
+        return nil;
+    DMObservationStream *const stream = [[DMObservationStream alloc] initWithEventRing:eventRing attachedToOwner:owner];
+    [stream addSourceObserver:observer];
+    return stream;
+}
+
 - (id)initWithKeyPath:(NSString *)keyPath object:(id)observationTarget attachedToOwner:(id)owner options:(NSKeyValueObservingOptions)options action:(DMKeyValueObserverBlock)actionBlock;
 {
     return [self initWithKeyPath:keyPath objects:@[observationTarget] attachedToOwner:owner options:options action:actionBlock];
 }
 
 - (id)initWithKeyPath:(NSString *)keyPath objects:(NSArray *)observationTargets attachedToOwner:(id)owner options:(NSKeyValueObservingOptions)options action:(DMKeyValueObserverBlock)actionBlock;
+{
+    NSParameterAssert(actionBlock);
+    return [self _initWithKeyPath:keyPath objects:observationTargets attachedToOwner:owner options:options action:actionBlock actionKind:DMKeyValueObserverChangeDictionaryAction eventRing:nil];
+}
+
+- (void)fireActionWithObject:(id)object changeDictionary:(NSDictionary *)changeDict;
+{
+    if (_invalidated)
+        return;
+    if (_eventRing) {
+        [_eventRing appendEvent:object mayBlock:NO shouldWakeConsumer:NULL]; // never wait in someone else's setter
+        return;
+    }
+
+    // If our owner has deallocated, we should be invalidated at this point. Since we're not, our owner must still be alive.
+    id actionBlock = _actionBlock; // Use a local reference, as the actionBock could call -invalidate on us
+    _changingObject = object;
+    const DMObserverStatisticsFire fire = DMObserverStatisticsFireWillBegin(_unsafeOwner);
+    switch (_actionKind) {
+        case DMKeyValueObserverChangeDictionaryAction:
+            ((DMKeyValueObserverBlock)actionBlock)(changeDict, _unsafeOwner, self);
+            break;
+        case DMKeyValueObserverChangeAction:
+            ((DMKeyValueObserverChangeBlock)actionBlock)(_unsafeOwner, self);
+            break;
+        case DMKeyValueObserverNewValueAction:
+            ((DMKeyValueObserverNewValueBlock)actionBlock)([object valueForKeyPath:_keyPath], _unsafeOwner, self);
+            break;
+        case DMKeyValueObserverOldAndNewValueAction: {
+            id oldValue = changeDict[NSKeyValueChangeOldKey], newValue = changeDict[NSKeyValueChangeNewKey];
+            ((DMKeyValueObserverOldAndNewValueBlock)actionBlock)((oldValue == [NSNull null] ? nil : oldValue), (newValue == [NSNull null] ? nil : newValue), _unsafeOwner, self);
+            break;
+        }
+    }
+    DMObserverStatisticsFireDidEnd(self, fire);
+    _changingObject = nil;
+}
+
+
+#pragma mark Private
+
+- (id)_initWithKeyPath:(NSString *)keyPath objects:(NSArray *)observationTargets attachedToOwner:(id)owner options:(NSKeyValueObservingOptions)options action:(id)actionBlock actionKind:(DMKeyValueObserverActionKind)actionKind eventRing:(DMEventRing *)eventRing;
 {
     // Possible future: We might want to support a nil owner for global-type things
-    NSParameterAssert(keyPath && observationTargets && owner && actionBlock);
+    NSParameterAssert(keyPath && observationTargets && owner && (actionBlock || eventRing));
     if (!(self = [super init]))
         return nil;
     
     _keyPath = [keyPath copy];
     _actionBlock = [actionBlock copy];
+    _actionKind = actionKind;
+    _eventRing = eventRing;
     _unsafeOwner = owner;
 
     const NSUInteger targetCount = observationTargets.count;
@@ -177,33 +353,52 @@ static char DMKeyValueObserverContext;
     [DMObserverInvalidator attachObserver:self toOwner:owner];
 
 #if HAVE_DMBLOCKUTILITIES && !defined(NS_BLOCK_ASSERTIONS)
-    if ([DMBlockUtilities isObject:owner implicitlyRetainedByBlock:actionBlock])
+    if (actionBlock && [DMBlockUtilities isObject:owner implicitlyRetainedByBlock:actionBlock])
         DMBlockRetainCycleDetected([NSString stringWithFormat:@"%s action captures owner; use localSelf (localOwner) parameter to fix.", __func__]);
 #endif
 
 #if DMKVO_INVALIDATE_ON_TARGET_DEALLOC || !defined(NS_BLOCK_ASSERTIONS)
-    NSMutableArray *targetObservers = [NSMutableArray arrayWithCapacity:observationTargets.count];
     // Typical KVO rules say our clients should call -invalidate on us before the target deallocates. We'll watch the target so we can recover if they didn't.
-    for (id observationTarget in observationTargets)
-        if (observationTarget != owner)
-            [targetObservers addObject:[[DMKeyValueTargetObserver alloc] initWithKeyValueObserver:self target:observationTarget]];
-    if (targetObservers.count)
-        _targetObservers = targetObservers;
+    NSArray *targetsOtherThanOwner = observationTargets;
+    if ([observationTargets indexOfObjectIdenticalTo:owner] != NSNotFound) {
+        NSMutableArray *const mutableTargets = [observationTargets mutableCopy];
+        [mutableTargets removeObjectIdenticalTo:owner];
+        targetsOtherThanOwner = mutableTargets;
+    }
+    if (targetsOtherThanOwner.count)
+        _targetObservers = [DMKeyValueTargetObserver targetObserversByAddingKeyValueObserver:self toTargets:targetsOtherThanOwner];
 #endif
     
     return self;
 }
 
-- (void)fireActionWithObject:(id)object changeDictionary:(NSDictionary *)changeDict;
+- (void)_performWithOwner:(void (^)(id owner))block; // For actions run away from the changing thread (such as coalesced flushes): runs block unless invalidated, and invalidation waits for it
 {
-    if (_invalidated)
-        return;
+    @synchronized (self) {
+        if (_invalidated)
+            return;
+        // If our owner has deallocated, we should be invalidated at this point. Since we're not, our owner must still be alive.
+        const DMObserverStatisticsFire fire = DMObserverStatisticsFireWillBegin(_unsafeOwner);
+        block(_unsafeOwner);
+        DMObserverStatisticsFireDidEnd(self, fire);
+    }
+}
 
-    // If our owner has deallocated, we should be invalidated at this point. Since we're not, our owner must still be alive.
-    DMKeyValueObserverBlock actionBlock = [_actionBlock copy]; // Use a local reference, as the actionBock could call -invalidate on us
-    _changingObject = object;
-    actionBlock(changeDict, _unsafeOwner, self);
-    _changingObject = nil;
+- (BOOL)_markInvalidated; // Returns NO if already invalidated
+{
+    if (!_coalescer) { // Actions only run on the thread making the change, which KVO's rules already serialize against invalidation
+        if (_invalidated)
+            return NO;
+        _invalidated = YES;
+        return YES;
+    }
+
+    @synchronized (self) {
+        if (_invalidated)
+            return NO;
+        _invalidated = YES;
+        return YES;
+    }
 }
 
 
@@ -235,8 +430,8 @@ static char DMKeyValueObserverContext;
         NSLog(@"(suppress log with NS_BLOCK_ASSERTIONS or DMKVO_LOG_ON_TARGET_DEALLOC)"), printedSuppression = 1;
 #    endif
     BOOL trace = NO;
-    if (trace) // Set this to YES in the debugger and step in to see the location of the observer in the source code. Note that this calls the block that otherwise would NOT be run.
-        _actionBlock(nil, _unsafeOwner, self);
+    if (trace && _actionBlock && _actionKind == DMKeyValueObserverChangeDictionaryAction) // Set this to YES in the debugger and step in to see the location of the observer in the source code. Note that this calls the block that otherwise would NOT be run.
+        ((DMKeyValueObserverBlock)_actionBlock)(nil, _unsafeOwner, self);
 
     if (!_targetsAsUnsafePointers.count)
         [self invalidate];
@@ -249,31 +444,110 @@ static char DMKeyValueObserverContext;
 @end
 
 
+static char DMKeyValueTargetObserverAssociationKey;
+
+
+/* A target observer's state and its target's association are guarded by a mutex sharded by target address, so
+ * observers of unrelated targets don't contend (as with the invalidator's registry). Shard mutexes are never nested. */
+#define DMTargetObserverShardCount  64 // must be a power of two
+static dispatch_semaphore_t targetObserverShardMutexes[DMTargetObserverShardCount];
+
+static inline dispatch_semaphore_t targetObserverMutexForAddress(const void *address)
+{
+    const uintptr_t bits = (uintptr_t)address;
+    return targetObserverShardMutexes[((bits >> 4) ^ (bits >> 12)) & (DMTargetObserverShardCount - 1)];
+}
+
+
 @implementation DMKeyValueTargetObserver {
-    __unsafe_unretained DMKeyValueObserver *_unsafeKeyValueObserver;
     __unsafe_unretained id _unsafeTarget;
+    const void *_targetAddress; // picks the shard; kept after invalidation
+    NSHashTable *_unsafeKeyValueObservers;
     BOOL _invalidated;
 }
 
-- (id)initWithKeyValueObserver:(DMKeyValueObserver *)keyValueObserver target:(id)target;
++ (void)initialize;
 {
-    NSParameterAssert(keyValueObserver && target);
-    if (!(self = [super init]))
-        return nil;
-    _unsafeKeyValueObserver = keyValueObserver;
-    _unsafeTarget = target;
-    [DMObserverInvalidator attachObserver:self toOwner:target];
-    return self;
+    if (self != [DMKeyValueTargetObserver class])
+        return;
+    for (NSUInteger i = 0; i < DMTargetObserverShardCount; i++)
+        targetObserverShardMutexes[i] = dispatch_semaphore_create(1);
 }
 
-- (void)invalidate;
++ (NSArray *)targetObserversByAddingKeyValueObserver:(DMKeyValueObserver *)keyValueObserver toTargets:(NSArray *)targets;
 {
-    if (_invalidated)
+    NSParameterAssert(keyValueObserver && targets);
+    NSMutableArray *const targetObservers = [NSMutableArray arrayWithCapacity:targets.count];
+
+    for (id target in targets) {
+        DMKeyValueTargetObserver *targetObserver;
+        dispatch_semaphore_t const mutex = targetObserverMutexForAddress((__bridge void *)target);
+        dispatch_semaphore_wait(mutex, DISPATCH_TIME_FOREVER); {
+            targetObserver = objc_getAssociatedObject(target, &DMKeyValueTargetObserverAssociationKey);
+            if (!targetObserver) {
+                targetObserver = [[self alloc] init];
+                targetObserver->_unsafeTarget = target;
+                targetObserver->_targetAddress = (__bridge void *)target;
+                targetObserver->_unsafeKeyValueObservers = [[NSHashTable alloc] initWithOptions:(NSPointerFunctionsOpaqueMemory | NSPointerFunctionsObjectPointerPersonality) capacity:1];
+                // Attach before it's published, so it can't be detached (when its last observer goes) before it's attached
+                [DMObserverInvalidator attachObserver:targetObserver toOwner:target];
+                objc_setAssociatedObject(target, &DMKeyValueTargetObserverAssociationKey, targetObserver, OBJC_ASSOCIATION_ASSIGN); // The target's invalidator retains it
+            }
+            [targetObserver->_unsafeKeyValueObservers addObject:keyValueObserver];
+        } dispatch_semaphore_signal(mutex);
+        [targetObservers addObject:targetObserver];
+    }
+    return targetObservers;
+}
+
++ (void)removeKeyValueObserver:(DMKeyValueObserver *)keyValueObserver fromTargetObservers:(NSArray *)targetObservers;
+{
+    if (!targetObservers.count)
         return;
-    _invalidated = YES;
+    NSMutableArray *const unusedTargetObservers = [NSMutableArray array];
+
+    for (DMKeyValueTargetObserver *targetObserver in targetObservers) {
+        dispatch_semaphore_t const mutex = targetObserverMutexForAddress(targetObserver->_targetAddress);
+        dispatch_semaphore_wait(mutex, DISPATCH_TIME_FOREVER); {
+            if (!targetObserver->_invalidated) {
+                [targetObserver->_unsafeKeyValueObservers removeObject:keyValueObserver];
+                if (!targetObserver->_unsafeKeyValueObservers.count) {
+                    // Nobody else is watching this target; stop watching for it to deallocate
+                    targetObserver->_invalidated = YES;
+                    targetObserver->_unsafeKeyValueObservers = nil;
+                    objc_setAssociatedObject(targetObserver->_unsafeTarget, &DMKeyValueTargetObserverAssociationKey, nil, OBJC_ASSOCIATION_ASSIGN);
+                    targetObserver->_unsafeTarget = nil;
+                    [unusedTargetObservers addObject:targetObserver];
+                }
+            }
+        } dispatch_semaphore_signal(mutex);
+    }
+
+    for (DMKeyValueTargetObserver *targetObserver in unusedTargetObservers)
+        [DMObserverInvalidator observerDidInvalidate:targetObserver];
+}
+
+- (void)invalidate; // Sent when the target is deallocating
+{
+    NSArray *keyValueObservers;
+    __unsafe_unretained id deallocatingTarget;
+    dispatch_semaphore_t const mutex = targetObserverMutexForAddress(_targetAddress);
+    dispatch_semaphore_wait(mutex, DISPATCH_TIME_FOREVER); {
+        if (_invalidated) {
+            dispatch_semaphore_signal(mutex);
+            return;
+        }
+        _invalidated = YES;
+        keyValueObservers = _unsafeKeyValueObservers.allObjects;
+        _unsafeKeyValueObservers = nil;
+        objc_setAssociatedObject(_unsafeTarget, &DMKeyValueTargetObserverAssociationKey, nil, OBJC_ASSOCIATION_ASSIGN);
+        deallocatingTarget = _unsafeTarget;
+        _unsafeTarget = nil;
+    } dispatch_semaphore_signal(mutex);
+
     [DMObserverInvalidator observerDidInvalidate:self];
-    [_unsafeKeyValueObserver targetWillDeallocate:_unsafeTarget];
-    _unsafeTarget = nil;
+    for (DMKeyValueObserver *keyValueObserver in keyValueObservers)
+        [keyValueObserver targetWillDeallocate:deallocatingTarget];
 }
 
 @end
@@ -24,5 +24,25 @@
 - (void)testPrematureTargetDeallocation;
 - (void)testSelfObservation;
 - (void)testObservingBatch;
+- (void)testSharedTarget;
+- (void)testTypedActions;
+- (void)testRelationshipTraversal;
+- (void)testStatistics;
+- (void)testStream;
+- (void)testNotificationStream;
+- (void)testCoalescing;
+- (void)testDependencyPlan;
+- (void)testManagedObjectObserverSharing;
+- (void)testIndexedNotificationCenter;
+- (void)testIndexedNotificationCenterRemovalDuringPost;
+- (void)testIndexedNotificationCenterPruning;
+- (void)testInvalidatorListDetach;
+- (void)testInvalidatorMixedTracking;
+- (void)testInvalidatorRacingOwnerDealloc;
+- (void)testConcurrentDelivery;
+- (void)testQueuedDelivery;
+- (void)testFilesystemBatchAction;
+- (void)testFilesystemWatchSharing;
+- (void)testManagedObjectObserverInvalidatedMidPost;
 
 @end
@@ -18,7 +18,17 @@
 #import <AppKit/AppKit.h>
 #import "DMKeyValueObserverTest.h"
 
+#import "DMAutoInvalidation.h"
+#import "DMIndexedNotificationCenter.h"
+#import "DMKeyPathDependencyPlan.h"
 #import "DMKeyValueObserver.h"
+#import "DMManagedObjectObserver.h"
+#import "DMNotificationObserver.h"
+#import "DMObservationStream.h"
+#import "DMObserverStatistics.h"
+#import "DMRelationshipTraversal.h"
+#import "LIFilesystemEventObserver.h"
+#import "LIFilesystemWatchManager.h"
 
 
 @interface MyClass : NSObject
@@ -30,6 +40,88 @@
 @synthesize nestedObj, leafValue;
 @end
 
+
+// Stand-ins for NSEntityDescription and NSPropertyDescription
+@interface DMTestEntity : NSObject <DMKeyPathDependencyEntity>
+@property (nonatomic, copy) NSString *name;
+@property (nonatomic, copy) NSArray *subentities;
+@property (nonatomic, copy) NSDictionary *propertiesByName;
+@property (nonatomic, copy) NSDictionary *dependentKeyPathsByKey;
+@end
+
+@implementation DMTestEntity
+@synthesize name, subentities, propertiesByName, dependentKeyPathsByKey;
+- (NSSet *)keyPathsForValuesAffectingUnmodeledKey:(NSString *)key;
+{ return self.dependentKeyPathsByKey[key]; }
+@end
+
+@interface DMTestProperty : NSObject <DMKeyPathDependencyProperty>
+@property (nonatomic, copy) NSString *name;
+@property (nonatomic, weak) DMTestEntity *dependencyDestinationEntity;
+@property (nonatomic, weak) DMTestProperty *dependencyInverseProperty;
+@end
+
+@implementation DMTestProperty
+@synthesize name, dependencyDestinationEntity, dependencyInverseProperty;
+@end
+
+
+@interface DMTestNotificationRecorder : NSObject
+@property (nonatomic, readonly) NSMutableArray *notifications;
+- (void)recordNotification:(NSNotification *)notification;
+@end
+
+@implementation DMTestNotificationRecorder
+@synthesize notifications;
+- (id)init;
+{
+    if (!(self = [super init]))
+        return nil;
+    notifications = [NSMutableArray array];
+    return self;
+}
+- (void)recordNotification:(NSNotification *)notification;
+{ [notifications addObject:notification]; }
+@end
+
+
+// Counts every -invalidate, so being invalidated twice shows up (real observers ignore repeats)
+@interface DMTestSetTrackedObserver : NSObject <DMAutoInvalidation>
+@property (readonly, nonatomic) NSUInteger invalidationCount;
+@end
+
+@implementation DMTestSetTrackedObserver {
+    NSUInteger _invalidationCount;
+}
+- (NSUInteger)invalidationCount;
+{ return __atomic_load_n(&_invalidationCount, __ATOMIC_ACQUIRE); }
+- (void)invalidate;
+{
+    __atomic_add_fetch(&_invalidationCount, 1, __ATOMIC_RELEASE);
+    [DMObserverInvalidator observerDidInvalidate:self];
+}
+@end
+
+@interface DMTestLinkedObserver : DMTestSetTrackedObserver
+@end
+
+@implementation DMTestLinkedObserver {
+    struct DMObserverInvalidatorLink _invalidatorLink;
+}
+- (struct DMObserverInvalidatorLink *)observerInvalidatorLink;
+{ return &_invalidatorLink; }
+@end
+
+
+// Filesystem events arrive asynchronously on the main queue, so spin the run loop until they're in
+static BOOL DMTestRunMainRunLoopUntil(NSTimeInterval timeout, BOOL (^condition)(void))
+{
+    NSDate *const deadline = [NSDate dateWithTimeIntervalSinceNow:timeout];
+    while (!condition() && deadline.timeIntervalSinceNow > 0)
+        [[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.1]];
+    return condition();
+}
+
 @implementation DMKeyValueObserverTest
 
 - (void)testOwnerTearDown;
@@ -199,4 +291,761 @@
     STAssertEquals(callCount, 2UL, @"Releasing owner should trigger invalidation of observer");
 }
 
+- (void)testSharedTarget;
+{
+    NSMutableDictionary *mdict = [NSMutableDictionary dictionary];
+    NSObject *dummyOwner1 = [NSObject new], *dummyOwner2 = [NSObject new];
+
+    __block NSUInteger callCount1 = 0, callCount2 = 0;
+    DMKeyValueObserver *observer1 = [DMKeyValueObserver observerWithKeyPath:@"name" object:mdict attachedToOwner:dummyOwner1 action:^(NSDictionary *changeDict, id localOwner, DMKeyValueObserver *observer) {
+        callCount1++;
+    }];
+    DMKeyValueObserver *observer2 = [DMKeyValueObserver observerWithKeyPath:@"name" object:mdict attachedToOwner:dummyOwner2 action:^(NSDictionary *changeDict, id localOwner, DMKeyValueObserver *observer) {
+        callCount2++;
+    }];
+    STAssertNotNil(observer1, nil);
+    STAssertNotNil(observer2, nil);
+
+    [mdict setObject:@"Steve" forKey:@"name"];
+    STAssertEquals(callCount1, 1UL, nil);
+    STAssertEquals(callCount2, 1UL, nil);
+
+    [observer1 invalidate];
+    [mdict setObject:@"Bob" forKey:@"name"];
+    STAssertEquals(callCount1, 1UL, nil);
+    STAssertEquals(callCount2, 2UL, @"Invalidating one observer of a target shouldn't affect another");
+
+    NSLog(@"Expect logged message:");
+    mdict = nil; // Should log (once, for observer2)
+
+    // Shouldn't crash:
+    dummyOwner1 = nil;
+    dummyOwner2 = nil;
+}
+
+- (void)testTypedActions;
+{
+    NSMutableDictionary *mdict = [NSMutableDictionary dictionaryWithObject:@"Steve" forKey:@"name"];
+    NSObject *dummyOwner = [NSObject new];
+
+    __block NSUInteger changeCount = 0;
+    __block id lastNewValue = nil, lastOldValue = nil, lastPairedNewValue = nil;
+    [DMKeyValueObserver observerWithKeyPath:@"name" objects:@[mdict] attachedToOwner:dummyOwner changeAction:^(id localOwner, DMKeyValueObserver *observer) {
+        changeCount++;
+    }];
+    [DMKeyValueObserver observerWithKeyPath:@"name" object:mdict attachedToOwner:dummyOwner newValueAction:^(id newValue, id localOwner, DMKeyValueObserver *observer) {
+        lastNewValue = newValue;
+    }];
+    [DMKeyValueObserver observerWithKeyPath:@"name" objects:@[mdict] attachedToOwner:dummyOwner oldAndNewValueAction:^(id oldValue, id newValue, id localOwner, DMKeyValueObserver *observer) {
+        lastOldValue = oldValue;
+        lastPairedNewValue = newValue;
+    }];
+
+    [mdict setObject:@"Bob" forKey:@"name"];
+    STAssertEquals(changeCount, 1UL, nil);
+    STAssertEqualObjects(lastNewValue, @"Bob", nil);
+    STAssertEqualObjects(lastOldValue, @"Steve", nil);
+    STAssertEqualObjects(lastPairedNewValue, @"Bob", nil);
+
+    [mdict removeObjectForKey:@"name"];
+    STAssertNil(lastNewValue, nil);
+    STAssertEqualObjects(lastOldValue, @"Bob", nil);
+    STAssertNil(lastPairedNewValue, @"NSNull should be passed as nil");
+
+    dummyOwner = nil;
+    [mdict setObject:@"Eric" forKey:@"name"];
+    STAssertEquals(changeCount, 2UL, @"Releasing owner should invalidate typed observers");
+}
+
+- (void)testRelationshipTraversal;
+{
+    // Children share parents, parents share the root; stands in for a managed object graph
+    MyClass *root = [MyClass new];
+    MyClass *parent1 = [MyClass new], *parent2 = [MyClass new];
+    parent1.nestedObj = parent2.nestedObj = root;
+    NSMutableArray *children = [NSMutableArray array];
+    for (NSUInteger i = 0; i < 4; i++) {
+        MyClass *child = [MyClass new];
+        child.nestedObj = (i % 2) ? parent1 : parent2;
+        [children addObject:child];
+    }
+    MyClass *orphan = [MyClass new];
+
+    NSMutableArray *prefetchedCounts = [NSMutableArray array];
+    DMRelationshipTraversal *traversal = [[DMRelationshipTraversal alloc] initWithKeyPath:@"nestedObj.nestedObj" prefetchBlock:^(NSString *key, NSSet *objects) {
+        STAssertEqualObjects(key, @"nestedObj", nil);
+        [prefetchedCounts addObject:@(objects.count)];
+    }];
+
+    STAssertEqualObjects([traversal destinationsOfObjects:children], [NSSet setWithObject:root], nil);
+    STAssertEqualObjects(prefetchedCounts, (@[@4, @2]), @"Each level should be read in one batch, shared parents once");
+
+    [prefetchedCounts removeAllObjects];
+    STAssertEqualObjects([traversal destinationsOfObjects:@[children[0], orphan]], [NSSet setWithObject:root], nil);
+    STAssertEqualObjects(prefetchedCounts, (@[@1]), @"Only objects not read before should be read");
+}
+
+- (void)testStatistics;
+{
+    [DMObserverStatistics reset];
+    [DMObserverStatistics setEnabled:YES];
+
+    NSMutableDictionary *mdict = [NSMutableDictionary dictionary];
+    NSObject *dummyOwner = [NSObject new];
+    [DMKeyValueObserver observerWithKeyPath:@"name" object:mdict attachedToOwner:dummyOwner action:^(NSDictionary *changeDict, id localOwner, DMKeyValueObserver *observer) { }];
+    [mdict setObject:@"Steve" forKey:@"name"];
+    [mdict setObject:@"Bob" forKey:@"name"];
+    dummyOwner = nil;
+
+    [DMObserverStatistics setEnabled:NO];
+    [mdict setObject:@"Eric" forKey:@"name"];
+
+    NSDictionary *stats = nil;
+    for (NSDictionary *observerStats in [DMObserverStatistics snapshot][@"observers"])
+        if ([observerStats[@"observerClass"] isEqual:@"DMKeyValueObserver"] && [observerStats[@"ownerClass"] isEqual:@"NSObject"])
+            stats = observerStats;
+    STAssertEqualObjects(stats[@"attached"], @1, nil);
+    STAssertEqualObjects(stats[@"fired"], @2, nil);
+    STAssertEqualObjects(stats[@"invalidated"], @1, nil);
+    STAssertEqualObjects(stats[@"ownerDeallocTeardowns"], @1, nil);
+    STAssertEqualObjects(stats[@"live"], @0, nil);
+    STAssertEqualObjects([stats[@"fireLatencyHistogram"] valueForKeyPath:@"@sum.self"], @2, nil);
+}
+
+- (void)testStream;
+{
+    NSMutableDictionary *mdict1 = [NSMutableDictionary dictionary];
+    NSMutableDictionary *mdict2 = [NSMutableDictionary dictionary];
+    NSObject *dummyOwner = [NSObject new];
+
+    DMObservationStream *stream = [DMKeyValueObserver streamWithKeyPath:@"name" objects:@[mdict1, mdict2] attachedToOwner:dummyOwner capacity:2 overflowPolicy:DMEventOverflowDropOldest];
+    STAssertNotNil(stream, nil);
+    [mdict1 setObject:@"Steve" forKey:@"name"];
+    [mdict2 setObject:@"Bob" forKey:@"name"];
+    [mdict1 setObject:@"Eric" forKey:@"name"];
+
+    __strong id events[4];
+    NSUInteger overflowCount = 0;
+    STAssertEquals([stream drainEvents:events maxCount:4 overflowCount:&overflowCount], 2UL, nil);
+    STAssertEquals(overflowCount, 1UL, nil);
+    STAssertTrue(events[0] == mdict2, @"oldest event should be dropped");
+    STAssertTrue(events[1] == mdict1, nil);
+    events[0] = events[1] = nil;
+
+    dummyOwner = nil;
+    [mdict1 setObject:@"Steve" forKey:@"name"];
+    STAssertEquals([stream drainEvents:events maxCount:4 overflowCount:NULL], 0UL, @"stream should be invalidated with its owner");
+}
+
+- (void)testNotificationStream;
+{
+    NSNotificationCenter *center = [NSNotificationCenter new];
+    NSObject *sender = [NSObject new];
+    NSObject *dummyOwner = [NSObject new];
+
+    DMObservationStream *stream = [DMNotificationObserver streamForName:@"DMTestNotification" object:sender attachedToOwner:dummyOwner notificationCenter:center capacity:2 overflowPolicy:DMEventOverflowMergeNewest];
+    STAssertNotNil(stream, nil);
+    STAssertEquals(stream.capacity, 2UL, nil);
+    [center postNotificationName:@"DMTestNotification" object:sender userInfo:@{@"index": @1}];
+    [center postNotificationName:@"DMTestNotification" object:nil userInfo:@{@"index": @2}];
+    [center postNotificationName:@"DMTestNotification" object:sender userInfo:@{@"index": @3}];
+    [center postNotificationName:@"DMTestNotification" object:sender userInfo:@{@"index": @4}];
+
+    __strong id events[4];
+    NSUInteger overflowCount = 0;
+    STAssertEquals([stream drainEvents:events maxCount:4 overflowCount:&overflowCount], 2UL, nil);
+    STAssertEquals(overflowCount, 1UL, nil);
+    STAssertEqualObjects([events[0] userInfo][@"index"], @1, nil);
+    STAssertEqualObjects([events[1] userInfo][@"index"], @4, @"newest pending event should be replaced");
+    events[0] = events[1] = nil;
+
+    dummyOwner = nil;
+    [center postNotificationName:@"DMTestNotification" object:sender];
+    STAssertEquals([stream drainEvents:events maxCount:4 overflowCount:NULL], 0UL, @"stream should be invalidated with its owner");
+}
+
+- (void)testCoalescing;
+{
+    NSMutableDictionary *mdict1 = [NSMutableDictionary dictionary];
+    NSMutableDictionary *mdict2 = [NSMutableDictionary dictionary];
+    NSObject *dummyOwner = [NSObject new];
+
+    __block NSUInteger callCount = 0, lastChangeCount = 0, lastObjectCount = 0;
+    DMKeyValueObserver *observer = [DMKeyValueObserver coalescingObserverWithKeyPath:@"name" objects:@[mdict1, mdict2] attachedToOwner:dummyOwner interval:0 queue:nil action:^(NSUInteger changeCount, NSArray *changingObjects, id localOwner, DMKeyValueObserver *observer) {
+        callCount++;
+        lastChangeCount = changeCount;
+        lastObjectCount = changingObjects.count;
+    }];
+    STAssertNotNil(observer, nil);
+
+    [mdict1 setObject:@"Steve" forKey:@"name"];
+    [mdict1 setObject:@"Bob" forKey:@"name"];
+    [mdict2 setObject:@"Eric" forKey:@"name"];
+    STAssertEquals(callCount, 0UL, @"Coalesced action shouldn't run until the main queue drains");
+
+    [[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.1]];
+    STAssertEquals(callCount, 1UL, nil);
+    STAssertEquals(lastChangeCount, 3UL, nil);
+    STAssertEquals(lastObjectCount, 2UL, @"Each changing object should be reported once");
+
+    [mdict1 setObject:@"Tim" forKey:@"name"];
+    dummyOwner = nil;
+    [[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.1]];
+    STAssertEquals(callCount, 1UL, @"Releasing owner should drop the pending batch");
+
+    __weak id weakPendingObject = nil;
+    NSObject *otherOwner = [NSObject new];
+    @autoreleasepool {
+        NSMutableDictionary *mdict3 = [NSMutableDictionary dictionary];
+        weakPendingObject = mdict3;
+        observer = [DMKeyValueObserver coalescingObserverWithKeyPath:@"name" objects:@[mdict3] attachedToOwner:otherOwner interval:0 queue:nil action:^(NSUInteger changeCount, NSArray *changingObjects, id localOwner, DMKeyValueObserver *observer) {
+            callCount++;
+        }];
+        [mdict3 setObject:@"Steve" forKey:@"name"];
+        [observer invalidate];
+    }
+    STAssertNil(weakPendingObject, @"Invalidating should release the pending batch without waiting for the flush");
+    [[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.1]];
+    STAssertEquals(callCount, 1UL, nil);
+}
+
+- (void)testDependencyPlan;
+{
+    DMTestEntity *book = [DMTestEntity new], *novel = [DMTestEntity new], *person = [DMTestEntity new], *company = [DMTestEntity new];
+    book.name = @"Book", novel.name = @"Novel", person.name = @"Person", company.name = @"Company";
+    NSMutableDictionary *properties = [NSMutableDictionary dictionary];
+    for (NSString *propertyName in @[@"title", @"author", @"publisher", @"name", @"books"]) {
+        DMTestProperty *property = [DMTestProperty new];
+        property.name = propertyName;
+        properties[propertyName] = property;
+    }
+    [properties[@"author"] setDependencyDestinationEntity:person];
+    [properties[@"author"] setDependencyInverseProperty:properties[@"books"]];
+    [properties[@"books"] setDependencyDestinationEntity:book];
+    [properties[@"books"] setDependencyInverseProperty:properties[@"author"]];
+    [properties[@"publisher"] setDependencyDestinationEntity:company]; // no inverse
+
+    book.subentities = @[novel];
+    book.propertiesByName = novel.propertiesByName = [properties dictionaryWithValuesForKeys:@[@"title", @"author", @"publisher"]];
+    book.dependentKeyPathsByKey = novel.dependentKeyPathsByKey = @{@"displayName": [NSSet setWithObjects:@"title", @"author.name", nil]};
+    person.propertiesByName = [properties dictionaryWithValuesForKeys:@[@"name", @"books"]];
+    company.propertiesByName = [properties dictionaryWithValuesForKeys:@[@"name"]];
+
+    NSSet *keyPaths = [NSSet setWithObjects:@"displayName", @"publisher.name", nil];
+    DMKeyPathDependencyPlan *plan = [DMKeyPathDependencyPlan planForEntity:book keyPaths:keyPaths];
+    STAssertEqualObjects(plan.baseEntityNames, ([NSSet setWithObjects:@"Book", @"Novel", nil]), nil);
+    STAssertTrue([plan entityNameIsKindOfBaseEntity:@"Novel"], nil);
+    STAssertFalse([plan entityNameIsKindOfBaseEntity:@"Person"], nil);
+
+    NSDictionary *propertyNames = plan.entityNamesToModeledPropertyNames;
+    STAssertEqualObjects(propertyNames[@"Book"], ([NSSet setWithObjects:@"title", @"author", @"publisher", nil]), @"Dependent keys should be followed to modeled properties");
+    STAssertEqualObjects(propertyNames[@"Person"], [NSSet setWithObject:@"name"], nil);
+    STAssertTrue(propertyNames[@"Novel"] == propertyNames[@"Book"], @"Equal sets should be shared");
+    STAssertTrue(propertyNames[@"Company"] == propertyNames[@"Person"], @"Equal sets should be shared");
+
+    NSDictionary *inversePaths = plan.entityNamesToInverseRelationshipKeyPaths;
+    STAssertEqualObjects(inversePaths[@"Person"], @"books", nil);
+    STAssertEqualObjects(inversePaths[@"Company"], [NSNull null], @"A relationship without an inverse can't be traversed");
+
+    STAssertTrue([DMKeyPathDependencyPlan planForEntity:book keyPaths:[keyPaths mutableCopy]] == plan, @"Plans should be cached");
+    STAssertTrue([DMKeyPathDependencyPlan planForEntity:novel keyPaths:keyPaths] != plan, nil);
+
+    __weak DMTestEntity *weakEntity = nil;
+    @autoreleasepool {
+        DMTestEntity *ephemeralEntity = [DMTestEntity new];
+        ephemeralEntity.name = @"Ephemeral";
+        weakEntity = ephemeralEntity;
+        [DMKeyPathDependencyPlan planForEntity:ephemeralEntity keyPaths:keyPaths];
+    }
+    STAssertNil(weakEntity, @"The plan cache shouldn't keep entities alive");
+}
+
+- (void)testManagedObjectObserverSharing;
+{
+    NSAttributeDescription *nameAttribute = [NSAttributeDescription new];
+    nameAttribute.name = @"name";
+    nameAttribute.attributeType = NSStringAttributeType;
+    nameAttribute.optional = YES;
+    NSEntityDescription *itemEntity = [NSEntityDescription new];
+    itemEntity.name = @"Item";
+    itemEntity.managedObjectClassName = NSStringFromClass([NSManagedObject class]);
+    itemEntity.properties = @[nameAttribute];
+    NSManagedObjectModel *model = [NSManagedObjectModel new];
+    model.entities = @[itemEntity];
+
+    NSPersistentStoreCoordinator *coordinator = [[NSPersistentStoreCoordinator alloc] initWithManagedObjectModel:model];
+    STAssertNotNil([coordinator addPersistentStoreWithType:NSInMemoryStoreType configuration:nil URL:nil options:nil error:NULL], nil);
+    NSManagedObjectContext *moc = [NSManagedObjectContext new];
+    moc.persistentStoreCoordinator = coordinator;
+    NSManagedObject *item = [NSEntityDescription insertNewObjectForEntityForName:@"Item" inManagedObjectContext:moc];
+    STAssertTrue([moc save:NULL], nil);
+
+    NSObject *dummyOwner = [NSObject new];
+    NSMutableArray *observers = [NSMutableArray array], *affectedObjectSets = [NSMutableArray array];
+    for (NSUInteger i = 0; i < 4; i++)
+        [observers addObject:[[DMManagedObjectObserver alloc] initWithManagedObjectContext:moc baseEntity:itemEntity interestedKeyPaths:[NSSet setWithObject:@"name"] attachedToOwner:dummyOwner action:^(BOOL someObjectsInvalidated, NSSet *affectedObjectsOfBaseEntity, NSNotification *notification, id localSelf, DMManagedObjectObserver *observer) {
+            [affectedObjectSets addObject:affectedObjectsOfBaseEntity];
+        }]];
+
+    [item setValue:@"Steve" forKey:@"name"];
+    [moc processPendingChanges];
+    STAssertEquals(affectedObjectSets.count, 4UL, nil);
+    STAssertEqualObjects(affectedObjectSets[0], [NSSet setWithObject:item], nil);
+    for (NSSet *affectedObjects in affectedObjectSets)
+        STAssertTrue(affectedObjects == affectedObjectSets[0], @"Changes should be routed once for all observers of the context");
+
+    // Invalidated observers mustn't still be counted as waiting for the routed changes
+    [observers[0] invalidate];
+    [observers[3] invalidate];
+    [affectedObjectSets removeAllObjects];
+    [item setValue:@"Bob" forKey:@"name"];
+    [moc processPendingChanges];
+    STAssertEquals(affectedObjectSets.count, 2UL, nil);
+    STAssertEqualObjects(affectedObjectSets[0], [NSSet setWithObject:item], nil);
+    STAssertTrue(affectedObjectSets[1] == affectedObjectSets[0], nil);
+
+    [affectedObjectSets removeAllObjects];
+    [observers addObject:[[DMManagedObjectObserver alloc] initWithManagedObjectContext:moc baseEntity:itemEntity interestedKeyPaths:[NSSet setWithObject:@"name"] attachedToOwner:dummyOwner action:^(BOOL someObjectsInvalidated, NSSet *affectedObjectsOfBaseEntity, NSNotification *notification, id localSelf, DMManagedObjectObserver *observer) {
+        [affectedObjectSets addObject:affectedObjectsOfBaseEntity];
+    }]];
+    [item setValue:@"Eric" forKey:@"name"];
+    [moc processPendingChanges];
+    STAssertEquals(affectedObjectSets.count, 3UL, nil);
+    for (NSSet *affectedObjects in affectedObjectSets)
+        STAssertEqualObjects(affectedObjects, [NSSet setWithObject:item], nil);
+}
+
+- (void)testIndexedNotificationCenter;
+{
+    DMIndexedNotificationCenter *center = [DMIndexedNotificationCenter new];
+    NSObject *sender1 = [NSObject new], *sender2 = [NSObject new];
+    DMTestNotificationRecorder *exact = [DMTestNotificationRecorder new], *anySender = [DMTestNotificationRecorder new];
+    DMTestNotificationRecorder *anyName = [DMTestNotificationRecorder new], *anything = [DMTestNotificationRecorder new];
+    [center addObserver:exact selector:@selector(recordNotification:) name:@"A" object:sender1];
+    [center addObserver:anySender selector:@selector(recordNotification:) name:@"A" object:nil];
+    [center addObserver:anyName selector:@selector(recordNotification:) name:nil object:sender1];
+    [center addObserver:anything selector:@selector(recordNotification:) name:nil object:nil];
+
+    [center postNotificationName:@"A" object:sender1];
+    [center postNotificationName:@"A" object:sender2];
+    [center postNotificationName:@"B" object:sender1];
+    [center postNotificationName:[@"A" mutableCopy] object:nil];
+    STAssertEqualObjects([exact.notifications valueForKey:@"name"], (@[@"A"]), nil);
+    STAssertEqualObjects([anySender.notifications valueForKey:@"name"], (@[@"A", @"A", @"A"]), nil);
+    STAssertEqualObjects([anyName.notifications valueForKey:@"name"], (@[@"A", @"B"]), nil);
+    STAssertEquals(anything.notifications.count, 4UL, nil);
+    STAssertTrue([exact.notifications[0] object] == sender1, nil);
+
+    // Removing by name and sender only takes matching registrations
+    DMTestNotificationRecorder *recorder = [DMTestNotificationRecorder new];
+    [center addObserver:recorder selector:@selector(recordNotification:) name:@"A" object:sender1];
+    [center addObserver:recorder selector:@selector(recordNotification:) name:@"A" object:sender2];
+    [center addObserver:recorder selector:@selector(recordNotification:) name:@"B" object:sender1];
+    [center removeObserver:recorder name:@"A" object:nil];
+    [center postNotificationName:@"A" object:sender1];
+    [center postNotificationName:@"A" object:sender2];
+    [center postNotificationName:@"B" object:sender1];
+    STAssertEqualObjects([recorder.notifications valueForKey:@"name"], (@[@"B"]), nil);
+    [center removeObserver:recorder name:nil object:sender1];
+    [center postNotificationName:@"B" object:sender1];
+    STAssertEquals(recorder.notifications.count, 1UL, nil);
+
+    [center removeObservers:@[exact, anyName, anything]];
+    [exact.notifications removeAllObjects], [anySender.notifications removeAllObjects], [anyName.notifications removeAllObjects], [anything.notifications removeAllObjects];
+    [center postNotificationName:@"A" object:sender1];
+    STAssertEquals(exact.notifications.count + anyName.notifications.count + anything.notifications.count, 0UL, nil);
+    STAssertEquals(anySender.notifications.count, 1UL, @"Observers not removed should still be notified");
+
+    __block NSUInteger blockCallCount = 0;
+    id token = [center addObserverForName:@"A" object:nil queue:nil usingBlock:^(NSNotification *notification) {
+        blockCallCount++;
+    }];
+    [center postNotificationName:@"A" object:sender1];
+    [center removeObserver:token];
+    [center postNotificationName:@"A" object:sender1];
+    STAssertEquals(blockCallCount, 1UL, nil);
+}
+
+- (void)testIndexedNotificationCenterRemovalDuringPost;
+{
+    DMIndexedNotificationCenter *center = [DMIndexedNotificationCenter new];
+    __weak DMIndexedNotificationCenter *weakCenter = center;
+    __block DMTestNotificationRecorder *removedRecorder = [DMTestNotificationRecorder new];
+    __block DMTestNotificationRecorder *releasedRecorder = [DMTestNotificationRecorder new];
+    __weak DMTestNotificationRecorder *weakReleasedRecorder = releasedRecorder;
+
+    id token = [center addObserverForName:@"A" object:nil queue:nil usingBlock:^(NSNotification *notification) {
+        [weakCenter removeObserver:removedRecorder];
+        releasedRecorder = nil; // deallocates without removing itself
+    }];
+    @autoreleasepool {
+        [center addObserver:removedRecorder selector:@selector(recordNotification:) name:@"A" object:nil];
+        [center addObserver:releasedRecorder selector:@selector(recordNotification:) name:@"A" object:nil];
+    }
+
+    [center postNotificationName:@"A" object:nil];
+    STAssertEquals(removedRecorder.notifications.count, 0UL, @"An observer removed during a post shouldn't be called by it");
+    STAssertNil(weakReleasedRecorder, @"An observer deallocated during a post shouldn't be called by it");
+
+    [center removeObserver:token];
+    [center addObserver:removedRecorder selector:@selector(recordNotification:) name:@"A" object:nil];
+    [center postNotificationName:@"A" object:nil];
+    STAssertEquals(removedRecorder.notifications.count, 1UL, nil);
+}
+
+- (void)testIndexedNotificationCenterPruning;
+{
+    DMIndexedNotificationCenter *center = [DMIndexedNotificationCenter new];
+    NSMapTable *bucketsByName = [center valueForKey:@"_bucketsByName"]; // private: interned name -> buckets, dropped once empty
+    DMTestNotificationRecorder *recorder = [DMTestNotificationRecorder new];
+    __weak DMTestNotificationRecorder *weakReleasedRecorder;
+    @autoreleasepool {
+        DMTestNotificationRecorder *releasedRecorder = [DMTestNotificationRecorder new];
+        weakReleasedRecorder = releasedRecorder;
+        [center addObserver:releasedRecorder selector:@selector(recordNotification:) name:@"A" object:nil];
+        [center addObserver:releasedRecorder selector:@selector(recordNotification:) name:@"B" object:nil];
+        [center addObserver:recorder selector:@selector(recordNotification:) name:@"B" object:nil];
+    }
+    STAssertNil(weakReleasedRecorder, nil);
+    STAssertEquals(bucketsByName.count, 2UL, nil);
+
+    // Each post drops the registrations it finds of observers that deallocated without removing themselves
+    [center postNotificationName:@"A" object:nil];
+    STAssertEquals(bucketsByName.count, 1UL, @"A's only registration was the released observer's");
+    [center postNotificationName:@"B" object:nil];
+    [center postNotificationName:@"B" object:nil];
+    STAssertEquals(recorder.notifications.count, 2UL, @"Live observers in the same bucket should be kept");
+    STAssertEquals(bucketsByName.count, 1UL, nil);
+}
+
+- (void)testInvalidatorListDetach;
+{
+    NSObject *dummyOwner = [NSObject new];
+    NSMutableArray *observers = [NSMutableArray array];
+    for (NSUInteger i = 0; i < 5; i++) {
+        DMTestLinkedObserver *observer = [DMTestLinkedObserver new];
+        [DMObserverInvalidator attachObserver:observer toOwner:dummyOwner];
+        [observers addObject:observer];
+    }
+
+    // Each is linked in at the head, so the first attached ends up at the tail
+    __weak id weakHead = observers[4], weakMiddle = observers[2], weakTail = observers[0];
+    @autoreleasepool {
+        for (NSUInteger i = 5; i-- > 0; )
+            if (i % 2 == 0) {
+                DMTestLinkedObserver *observer = observers[i];
+                [observer invalidate];
+                STAssertTrue([observer observerInvalidatorLink]->invalidator == NULL, nil);
+                [observers removeObjectAtIndex:i];
+            }
+    }
+    STAssertNil(weakHead, @"Detaching should release the list's reference");
+    STAssertNil(weakMiddle, nil);
+    STAssertNil(weakTail, nil);
+
+    dummyOwner = nil;
+    for (DMTestLinkedObserver *observer in observers) {
+        STAssertEquals(observer.invalidationCount, 1UL, @"The rest of the list should still be intact");
+        STAssertTrue([observer observerInvalidatorLink]->invalidator == NULL, nil);
+    }
+}
+
+- (void)testInvalidatorMixedTracking;
+{
+    __weak id weakLinkedObserver, weakSetTrackedObserver;
+    @autoreleasepool {
+        NSObject *dummyOwner = [NSObject new];
+        NSArray *observers = @[[DMTestLinkedObserver new], [DMTestSetTrackedObserver new], [DMTestLinkedObserver new], [DMTestSetTrackedObserver new]];
+        for (DMTestSetTrackedObserver *observer in observers)
+            [DMObserverInvalidator attachObserver:observer toOwner:dummyOwner];
+
+        [observers[0] invalidate];
+        [observers[1] invalidate];
+        dummyOwner = nil;
+        for (DMTestSetTrackedObserver *observer in observers)
+            STAssertEquals(observer.invalidationCount, 1UL, @"Linked and set-tracked observers of one owner should each be invalidated once");
+        weakLinkedObserver = observers[2], weakSetTrackedObserver = observers[3];
+    }
+    STAssertNil(weakLinkedObserver, @"The owner's invalidator shouldn't keep observers alive");
+    STAssertNil(weakSetTrackedObserver, nil);
+}
+
+- (void)testInvalidatorRacingOwnerDealloc;
+{
+    const NSUInteger observerCount = 8;
+    for (NSUInteger iteration = 0; iteration < 200; iteration++) {
+        __weak id weakHead, weakTail;
+        @autoreleasepool {
+            __block NSObject *dummyOwner = [NSObject new];
+            NSMutableArray *observers = [NSMutableArray array];
+            for (NSUInteger i = 0; i < observerCount; i++) {
+                DMTestLinkedObserver *observer = [DMTestLinkedObserver new];
+                [DMObserverInvalidator attachObserver:observer toOwner:dummyOwner];
+                [observers addObject:observer];
+            }
+
+            // One thread lets go of the owner while the others invalidate its observers
+            dispatch_apply(observerCount + 1, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t i) {
+                if (i == observerCount)
+                    dummyOwner = nil;
+                else
+                    [observers[i] invalidate];
+            });
+
+            for (DMTestLinkedObserver *observer in observers) {
+                STAssertTrue(observer.invalidationCount == 1 || observer.invalidationCount == 2, @"Either or both may get to it first, but it shouldn't be missed");
+                STAssertTrue([observer observerInvalidatorLink]->invalidator == NULL, nil);
+            }
+            weakHead = observers.lastObject, weakTail = observers[0];
+        }
+        STAssertNil(weakHead, @"Each observer should be released once, whichever thread detached it");
+        STAssertNil(weakTail, nil);
+    }
+}
+
+- (void)testConcurrentDelivery;
+{
+    NSNotificationCenter *center = [NSNotificationCenter new];
+    NSObject *dummyOwner = [NSObject new];
+    dispatch_queue_t postingQueue = dispatch_queue_create("DMTestPoster", DISPATCH_QUEUE_SERIAL);
+
+    // Two posts should be in the action at once
+    __block volatile NSUInteger runningCount = 0;
+    __block volatile BOOL overlapped = NO;
+    (void)[[DMNotificationObserver alloc] initWithName:@"DMTestConcurrent" object:nil attachedToOwner:dummyOwner notificationCenter:center options:DMNotificationObserverConcurrentDelivery action:^(NSNotification *notification, id localOwner, DMNotificationObserver *observer) {
+        __atomic_add_fetch(&runningCount, 1, __ATOMIC_SEQ_CST);
+        NSDate *const deadline = [NSDate dateWithTimeIntervalSinceNow:2];
+        while (__atomic_load_n(&runningCount, __ATOMIC_SEQ_CST) < 2 && [deadline timeIntervalSinceNow] > 0)
+            usleep(1000);
+        if (__atomic_load_n(&runningCount, __ATOMIC_SEQ_CST) >= 2)
+            __atomic_store_n(&overlapped, YES, __ATOMIC_SEQ_CST);
+        __atomic_sub_fetch(&runningCount, 1, __ATOMIC_SEQ_CST);
+    }];
+    dispatch_group_t postGroup = dispatch_group_create();
+    for (NSUInteger i = 0; i < 2; i++) // private queues get a thread each, even on one core
+        dispatch_group_async(postGroup, dispatch_queue_create("DMTestConcurrentPoster", DISPATCH_QUEUE_SERIAL), ^{
+            [center postNotificationName:@"DMTestConcurrent" object:nil];
+        });
+    dispatch_group_wait(postGroup, DISPATCH_TIME_FOREVER);
+    STAssertTrue(overlapped, @"Concurrently posted notifications should be delivered concurrently");
+
+    // -invalidate from another thread waits for the running action, and no action starts after it
+    dispatch_semaphore_t actionStarted = dispatch_semaphore_create(0);
+    __block volatile BOOL actionFinished = NO;
+    __block volatile NSUInteger callCount = 0;
+    DMNotificationObserver *slowObserver = [[DMNotificationObserver alloc] initWithName:@"DMTestSlow" object:nil attachedToOwner:dummyOwner notificationCenter:center options:DMNotificationObserverConcurrentDelivery action:^(NSNotification *notification, id localOwner, DMNotificationObserver *observer) {
+        __atomic_add_fetch(&callCount, 1, __ATOMIC_SEQ_CST);
+        dispatch_semaphore_signal(actionStarted);
+        usleep(100000);
+        __atomic_store_n(&actionFinished, YES, __ATOMIC_SEQ_CST);
+    }];
+    dispatch_async(postingQueue, ^{
+        [center postNotificationName:@"DMTestSlow" object:nil];
+    });
+    STAssertEquals(dispatch_semaphore_wait(actionStarted, dispatch_time(DISPATCH_TIME_NOW, 2 * NSEC_PER_SEC)), 0L, nil);
+    [slowObserver invalidate];
+    STAssertTrue(__atomic_load_n(&actionFinished, __ATOMIC_SEQ_CST), @"-invalidate should wait for an action running on another thread");
+    [center postNotificationName:@"DMTestSlow" object:nil];
+    STAssertEquals((NSUInteger)callCount, 1UL, nil);
+
+    // -invalidate from within the action doesn't wait for itself
+    (void)[[DMNotificationObserver alloc] initWithName:@"DMTestSelfInvalidating" object:nil attachedToOwner:dummyOwner notificationCenter:center options:DMNotificationObserverConcurrentDelivery action:^(NSNotification *notification, id localOwner, DMNotificationObserver *observer) {
+        [observer invalidate];
+    }];
+    dispatch_semaphore_t postReturned = dispatch_semaphore_create(0);
+    dispatch_async(postingQueue, ^{
+        [center postNotificationName:@"DMTestSelfInvalidating" object:nil];
+        dispatch_semaphore_signal(postReturned);
+    });
+    STAssertEquals(dispatch_semaphore_wait(postReturned, dispatch_time(DISPATCH_TIME_NOW, 2 * NSEC_PER_SEC)), 0L, @"-invalidate from within the action shouldn't deadlock");
+}
+
+- (void)testQueuedDelivery;
+{
+    NSNotificationCenter *center = [NSNotificationCenter new];
+    NSObject *dummyOwner = [NSObject new];
+    static const char deliveryQueueKey;
+    dispatch_queue_t deliveryQueue = dispatch_queue_create("DMTestDelivery", DISPATCH_QUEUE_SERIAL);
+    dispatch_queue_set_specific(deliveryQueue, &deliveryQueueKey, (void *)&deliveryQueueKey, NULL);
+
+    // Delivered on the given queue, in order
+    NSMutableArray *deliveredIndexes = [NSMutableArray array];
+    __block BOOL allOnDeliveryQueue = YES;
+    DMNotificationObserver *observer = [[DMNotificationObserver alloc] initWithName:@"DMTestQueued" object:nil attachedToOwner:dummyOwner notificationCenter:center deliveryQueue:deliveryQueue maxPendingNotifications:2 overflowPolicy:DMEventOverflowDropOldest action:^(NSNotification *notification, id localOwner, DMNotificationObserver *observer) {
+        allOnDeliveryQueue = allOnDeliveryQueue && dispatch_get_specific(&deliveryQueueKey) == (void *)&deliveryQueueKey;
+        [deliveredIndexes addObject:notification.userInfo[@"index"]];
+    }];
+    [center postNotificationName:@"DMTestQueued" object:nil userInfo:@{@"index": @1}];
+    dispatch_sync(deliveryQueue, ^{ });
+    STAssertEqualObjects(deliveredIndexes, (@[@1]), nil);
+    STAssertTrue(allOnDeliveryQueue, nil);
+
+    // With the queue held up, only the newest two of five are delivered
+    [deliveredIndexes removeAllObjects];
+    dispatch_suspend(deliveryQueue);
+    for (NSUInteger i = 1; i <= 5; i++)
+        [center postNotificationName:@"DMTestQueued" object:nil userInfo:@{@"index": @(i)}];
+    dispatch_resume(deliveryQueue);
+    dispatch_sync(deliveryQueue, ^{ });
+    STAssertEqualObjects(deliveredIndexes, (@[@4, @5]), @"DropOldest should drop the three oldest");
+    [observer invalidate];
+
+    // MergeNewest keeps the oldest and replaces the newest
+    [deliveredIndexes removeAllObjects];
+    observer = [[DMNotificationObserver alloc] initWithName:@"DMTestQueued" object:nil attachedToOwner:dummyOwner notificationCenter:center deliveryQueue:deliveryQueue maxPendingNotifications:2 overflowPolicy:DMEventOverflowMergeNewest action:^(NSNotification *notification, id localOwner, DMNotificationObserver *observer) {
+        [deliveredIndexes addObject:notification.userInfo[@"index"]];
+    }];
+    dispatch_suspend(deliveryQueue);
+    for (NSUInteger i = 1; i <= 5; i++)
+        [center postNotificationName:@"DMTestQueued" object:nil userInfo:@{@"index": @(i)}];
+    dispatch_resume(deliveryQueue);
+    dispatch_sync(deliveryQueue, ^{ });
+    STAssertEqualObjects(deliveredIndexes, (@[@1, @5]), @"MergeNewest should merge three into the newest");
+
+    // Invalidating while a drain is pending discards what hasn't been delivered
+    [deliveredIndexes removeAllObjects];
+    dispatch_suspend(deliveryQueue);
+    [center postNotificationName:@"DMTestQueued" object:nil userInfo:@{@"index": @1}];
+    [observer invalidate];
+    dispatch_resume(deliveryQueue);
+    dispatch_sync(deliveryQueue, ^{ });
+    STAssertEquals(deliveredIndexes.count, 0UL, nil);
+
+    // Posting from the delivery queue itself falls back to dropping rather than waiting for itself
+    [deliveredIndexes removeAllObjects];
+    (void)[[DMNotificationObserver alloc] initWithName:@"DMTestQueued" object:nil attachedToOwner:dummyOwner notificationCenter:center deliveryQueue:deliveryQueue maxPendingNotifications:1 overflowPolicy:DMEventOverflowBlockPoster action:^(NSNotification *notification, id localOwner, DMNotificationObserver *observer) {
+        [deliveredIndexes addObject:notification.userInfo[@"index"]];
+        if ([notification.userInfo[@"index"] isEqual:@1])
+            for (NSUInteger i = 2; i <= 3; i++)
+                [center postNotificationName:@"DMTestQueued" object:nil userInfo:@{@"index": @(i)}];
+    }];
+    [center postNotificationName:@"DMTestQueued" object:nil userInfo:@{@"index": @1}];
+    dispatch_semaphore_t drained = dispatch_semaphore_create(0);
+    dispatch_async(deliveryQueue, ^{ dispatch_semaphore_signal(drained); });
+    STAssertEquals(dispatch_semaphore_wait(drained, dispatch_time(DISPATCH_TIME_NOW, 2 * NSEC_PER_SEC)), 0L, @"Posting from the delivery queue shouldn't block it");
+    STAssertEqualObjects(deliveredIndexes, (@[@1, @3]), nil);
+}
+
+- (void)testFilesystemBatchAction;
+{
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    NSObject *dummyOwner = [NSObject new];
+    NSString *directoryPath = [NSTemporaryDirectory() stringByAppendingPathComponent:[[NSProcessInfo processInfo] globallyUniqueString]];
+    STAssertTrue([fileManager createDirectoryAtPath:directoryPath withIntermediateDirectories:NO attributes:nil error:NULL], nil);
+
+    // NSTemporaryDirectory() is spelled through the /var symlink, but FSEvents reports /private/var
+    NSMutableArray *batches = [NSMutableArray array];
+    LIFilesystemEventObserver *observer = [[LIFilesystemEventObserver alloc] initWithDirectoryPaths:@[directoryPath] attachedToOwner:dummyOwner since:kFSEventStreamEventIdSinceNow latency:0.5 batchAction:^(NSArray *events, id localOwner, LIFilesystemEventObserver *observer) {
+        [batches addObject:events];
+    }];
+    STAssertNotNil(observer, nil);
+
+    // Created and written to within the latency
+    NSString *filePath = [directoryPath stringByAppendingPathComponent:@"file"];
+    FILE *file = fopen(filePath.fileSystemRepresentation, "w");
+    fclose(file);
+    file = fopen(filePath.fileSystemRepresentation, "a");
+    fputs("modified", file);
+    fclose(file);
+
+    STAssertTrue(DMTestRunMainRunLoopUntil(10.0, ^{ return (BOOL)(batches.count > 0); }), @"No events for %@", directoryPath);
+    DMTestRunMainRunLoopUntil(1.0, ^{ return NO; }); // Anything else would be a second batch
+    STAssertEquals(batches.count, 1UL, @"Events within the latency should be delivered as one batch");
+    NSArray *events = batches.lastObject;
+    STAssertEquals(events.count, 1UL, @"Events for one path should be coalesced: %@", events);
+    LIFilesystemEvent *event = events.lastObject;
+    STAssertEqualObjects(event.path, filePath, @"Paths should be reported the way the directory was given");
+    STAssertTrue((event.kind & LIFilesystemEventCreated) && (event.kind & LIFilesystemEventModified), @"kind: 0x%lx", (unsigned long)event.kind);
+    STAssertFalse(event.kind & (LIFilesystemEventRemoved | LIFilesystemEventIsDirectory | LIFilesystemEventMustRescan), @"kind: 0x%lx", (unsigned long)event.kind);
+
+    [observer invalidate];
+    [fileManager removeItemAtPath:directoryPath error:NULL];
+}
+
+- (void)testFilesystemWatchSharing;
+{
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    NSMapTable *pathsByEventBuffer = [[LIFilesystemWatchManager sharedManager] valueForKey:@"_pathsByEventBuffer"]; // private: one entry per registered observer
+    const NSUInteger initialRegistrationCount = pathsByEventBuffer.count;
+    NSString *outerPath = [NSTemporaryDirectory() stringByAppendingPathComponent:[[NSProcessInfo processInfo] globallyUniqueString]];
+    NSString *innerPath = [outerPath stringByAppendingPathComponent:@"inner"];
+    STAssertTrue([fileManager createDirectoryAtPath:innerPath withIntermediateDirectories:YES attributes:nil error:NULL], nil);
+
+    __block NSUInteger outerFireCount = 0, innerFireCount = 0;
+    @autoreleasepool {
+        NSObject *outerOwner = [NSObject new], *innerOwner = [NSObject new];
+        LIFilesystemEventObserver *outerObserver = [[LIFilesystemEventObserver alloc] initWithDirectoryPaths:@[outerPath] attachedToOwner:outerOwner since:kFSEventStreamEventIdSinceNow latency:0.2 batchAction:^(NSArray *events, id localOwner, LIFilesystemEventObserver *observer) {
+            outerFireCount++;
+        }];
+        (void)[[LIFilesystemEventObserver alloc] initWithDirectoryPaths:@[innerPath] attachedToOwner:innerOwner since:kFSEventStreamEventIdSinceNow latency:0.2 batchAction:^(NSArray *events, id localOwner, LIFilesystemEventObserver *observer) {
+            innerFireCount++;
+        }];
+        STAssertEquals(pathsByEventBuffer.count, initialRegistrationCount + 2, nil);
+
+        // A change in the inner directory is under both
+        [@"1" writeToFile:[innerPath stringByAppendingPathComponent:@"file1"] atomically:NO encoding:NSUTF8StringEncoding error:NULL];
+        STAssertTrue(DMTestRunMainRunLoopUntil(10.0, ^{ return (BOOL)(outerFireCount && innerFireCount); }), @"outer: %lu, inner: %lu", (unsigned long)outerFireCount, (unsigned long)innerFireCount);
+
+        // Pruning the outer registration leaves the inner one watched
+        [outerObserver invalidate];
+        STAssertEquals(pathsByEventBuffer.count, initialRegistrationCount + 1, nil);
+        const NSUInteger outerFireCountAtInvalidation = outerFireCount, innerFireCountAtInvalidation = innerFireCount;
+        [@"2" writeToFile:[innerPath stringByAppendingPathComponent:@"file2"] atomically:NO encoding:NSUTF8StringEncoding error:NULL];
+        STAssertTrue(DMTestRunMainRunLoopUntil(10.0, ^{ return (BOOL)(innerFireCount > innerFireCountAtInvalidation); }), @"The inner observer should still get events");
+        STAssertEquals(outerFireCount, outerFireCountAtInvalidation, @"The outer observer shouldn't get events once invalidated");
+
+        innerOwner = nil;
+    }
+
+    // The owner going away invalidated the inner observer, which took its buffer out of the manager
+    STAssertEquals(pathsByEventBuffer.count, initialRegistrationCount, nil);
+    [fileManager removeItemAtPath:outerPath error:NULL];
+}
+
+- (void)testManagedObjectObserverInvalidatedMidPost;
+{
+    NSAttributeDescription *nameAttribute = [NSAttributeDescription new];
+    nameAttribute.name = @"name";
+    nameAttribute.attributeType = NSStringAttributeType;
+    nameAttribute.optional = YES;
+    NSEntityDescription *itemEntity = [NSEntityDescription new];
+    itemEntity.name = @"Item";
+    itemEntity.managedObjectClassName = NSStringFromClass([NSManagedObject class]);
+    itemEntity.properties = @[nameAttribute];
+    NSManagedObjectModel *model = [NSManagedObjectModel new];
+    model.entities = @[itemEntity];
+    NSPersistentStoreCoordinator *coordinator = [[NSPersistentStoreCoordinator alloc] initWithManagedObjectModel:model];
+    STAssertNotNil([coordinator addPersistentStoreWithType:NSInMemoryStoreType configuration:nil URL:nil options:nil error:NULL], nil);
+
+    __weak NSManagedObjectContext *weakMoc;
+    @autoreleasepool {
+        NSManagedObjectContext *moc = [NSManagedObjectContext new];
+        moc.persistentStoreCoordinator = coordinator;
+        weakMoc = moc;
+        NSManagedObject *item = [NSEntityDescription insertNewObjectForEntityForName:@"Item" inManagedObjectContext:moc];
+        STAssertTrue([moc save:NULL], nil);
+
+        // Whichever observer gets the notification first invalidates the other before it picks up the routed changes
+        NSObject *dummyOwner = [NSObject new];
+        NSMutableArray *observers = [NSMutableArray array];
+        __weak NSMutableArray *weakObservers = observers;
+        __block NSUInteger fireCount = 0;
+        for (NSUInteger i = 0; i < 2; i++)
+            [observers addObject:[[DMManagedObjectObserver alloc] initWithManagedObjectContext:moc baseEntity:itemEntity interestedKeyPaths:[NSSet setWithObject:@"name"] attachedToOwner:dummyOwner action:^(BOOL someObjectsInvalidated, NSSet *affectedObjectsOfBaseEntity, NSNotification *notification, id localSelf, DMManagedObjectObserver *observer) {
+                fireCount++;
+                for (DMManagedObjectObserver *otherObserver in weakObservers)
+                    if (otherObserver != observer)
+                        [otherObserver invalidate];
+            }]];
+
+        [item setValue:@"Steve" forKey:@"name"];
+        [moc processPendingChanges];
+        STAssertEquals(fireCount, 1UL, nil);
+        [observers makeObjectsPerformSelector:@selector(invalidate)];
+    }
+
+    // The routed changes hold the notification, which holds the context, which holds the dispatcher
+    STAssertNil(weakMoc, @"Routed changes left waiting for an invalidated observer keep the context alive");
+}
+
 @end
@@ -25,6 +25,8 @@
 typedef void(^DMManagedObjectsDidChangeBlock)(BOOL someObjectsInvalidated, NSSet *affectedObjectsOfBaseEntity, NSNotification *notification, id localSelf, DMManagedObjectObserver *observer); // ‘localSelf’ param is actually the owner, which is almost always used as ‘self’
 
 
+/* Observers of the same context share the work of each change notification: the change set is walked once for all
+ * of them, so adding observers costs little more than their own actions. */
 @interface DMManagedObjectObserver : DMNotificationObserver
 
 - (id)initWithManagedObjectContext:(NSManagedObjectContext *)moc
@@ -17,240 +17,429 @@
 
 #import "DMManagedObjectObserver.h"
 // <dmclean.filter: lines.sort.uniq>
-#import "DMSafeKVC.h"
+#import "DMKeyPathDependencyPlan.h"
+#import "DMRelationshipTraversal.h"
+#import <objc/runtime.h>
 
 
-static NSSet *flattenSubentities(NSEntityDescription *entity)
-{
-    // There's -[NSEntityDescription _collectSubentities], which is cached in NSEntityDescription._flattenedSubentities, but that's all private.
-    NSMutableSet *const entities = [NSMutableSet new];
-    [entities addObject:entity];
-    for (NSEntityDescription *subentity in entity.subentities)
-        [entities unionSet:flattenSubentities(subentity)];
-    return entities;
-}
+@interface DMNotificationObserver (DMManagedObjectObserverPrivate)
+- (void)_discardObservationState; // called once, when invalidated
+@end
+
+
+@interface NSEntityDescription (DMKeyPathDependencyEntity) <DMKeyPathDependencyEntity>
+@end
+
+@implementation NSEntityDescription (DMKeyPathDependencyEntity)
+
+- (NSSet *)keyPathsForValuesAffectingUnmodeledKey:(NSString *)key;
+{ return [NSClassFromString(self.managedObjectClassName) keyPathsForValuesAffectingValueForKey:key]; }
+
+@end
+
+@interface NSPropertyDescription (DMKeyPathDependencyProperty) <DMKeyPathDependencyProperty>
+@end
+
+@implementation NSPropertyDescription (DMKeyPathDependencyProperty)
+
+- (id<DMKeyPathDependencyEntity>)dependencyDestinationEntity;
+{ return nil; }
+
+- (id<DMKeyPathDependencyProperty>)dependencyInverseProperty;
+{ return nil; }
+
+@end
+
+@interface NSRelationshipDescription (DMKeyPathDependencyProperty)
+@end
 
-static NSSet *relationshipAsSet(id relationshipValue)
+@implementation NSRelationshipDescription (DMKeyPathDependencyProperty)
+
+- (id<DMKeyPathDependencyEntity>)dependencyDestinationEntity;
+{ return self.destinationEntity; }
+
+- (id<DMKeyPathDependencyProperty>)dependencyInverseProperty;
+{ return self.inverseRelationship; }
+
+@end
+
+
+static DMRelationshipPrefetchBlock prefetchBlockForManagedObjectContext(NSManagedObjectContext *moc)
 {
-    if (!relationshipValue)
-        return [NSSet set];
-    else if ([relationshipValue isKindOfClass:[NSSet class]])
-        return relationshipValue;
-    else if ([relationshipValue isKindOfClass:[NSOrderedSet class]])
-        return ((NSOrderedSet *)relationshipValue).set;
-    else
-        return [NSSet setWithObject:relationshipValue]; // assume to-one
+    return ^(NSString *key, NSSet *managedObjects) {
+        // Fill the row cache for the objects and the relationship with one fetch per entity, rather than a fault per object
+        NSMutableDictionary *const objectIDsByEntityName = [NSMutableDictionary new];
+        for (NSManagedObject *managedObject in managedObjects) {
+            if (managedObject.objectID.isTemporaryID || !(managedObject.isFault || [managedObject hasFaultForRelationshipNamed:key]))
+                continue;
+            NSMutableArray *objectIDs = objectIDsByEntityName[managedObject.entity.name];
+            if (!objectIDs)
+                objectIDsByEntityName[managedObject.entity.name] = objectIDs = [NSMutableArray new];
+            [objectIDs addObject:managedObject.objectID];
+        }
+
+        [objectIDsByEntityName enumerateKeysAndObjectsUsingBlock:^(NSString *entityName, NSArray *objectIDs, BOOL *stop) {
+            if (objectIDs.count < 2)
+                return; // firing the fault is one fetch anyway
+            NSFetchRequest *const fetchRequest = [NSFetchRequest fetchRequestWithEntityName:entityName];
+            fetchRequest.predicate = [NSPredicate predicateWithFormat:@"SELF IN %@", objectIDs];
+            fetchRequest.includesSubentities = NO;
+            fetchRequest.includesPendingChanges = NO; // we're in the middle of processing them
+            fetchRequest.returnsObjectsAsFaults = NO;
+            fetchRequest.relationshipKeyPathsForPrefetching = @[key];
+            [moc executeFetchRequest:fetchRequest error:NULL]; // on failure, the objects just fault one by one
+        }];
+    };
 }
 
 
-@implementation DMManagedObjectObserver
+/* Which dependency plans each change in an objects-did-change notification matters to, indexed by entity name and
+ * property name so each changed object is only looked at once however many plans there are. Immutable. */
+@interface DMManagedObjectChangeIndex : NSObject
+- (id)initWithDependencyPlans:(NSArray *)plans;
+- (void)routeChangesInNotification:(NSNotification *)objectsDidChangeNotification affectedObjectsByPlan:(NSMapTable *)affectedObjectsByPlan plansWithInvalidatedObjects:(NSHashTable *)plansWithInvalidatedObjects;
+@end
+
+@interface DMManagedObjectChangeIndex ()
+- (void)_addChangedObject:(NSManagedObject *)changedObject toPlans:(id<NSFastEnumeration>)plans affectedObjectsByPlan:(NSMapTable *)affectedObjectsByPlan changedObjectsByPlanAndInverseKeyPath:(NSMapTable *)changedObjectsByPlanAndInverseKeyPath;
+@end
+
+
+/* One per managed object context, shared by all its observers. The first observer to get an objects-did-change
+ * notification has the dispatcher route the whole change set for every observer's plan; the rest pick up their
+ * plan's result. So each changed object's changed keys are worked out once per notification, not once per observer. */
+@interface DMManagedObjectChangeDispatcher : NSObject
++ (instancetype)dispatcherForManagedObjectContext:(NSManagedObjectContext *)moc;
+- (void)addObserver:(id)observer dependencyPlan:(DMKeyPathDependencyPlan *)plan;
+- (void)removeObserver:(id)observer dependencyPlan:(DMKeyPathDependencyPlan *)plan;
+- (NSSet *)affectedObjectsOfBaseEntityForObserver:(id)observer dependencyPlan:(DMKeyPathDependencyPlan *)plan notification:(NSNotification *)objectsDidChangeNotification someObjectsInvalidated:(BOOL *)outSomeObjectsInvalidated;
+@end
+
+@interface DMManagedObjectChangeDispatcher ()
+- (void)_discardRoutedChanges; // with _mutex held
+@end
+
+
+static void addPlanToIndex(NSMutableDictionary *index, NSString *key, DMKeyPathDependencyPlan *plan)
 {
-    NSEntityDescription *_baseEntity;
-    NSDictionary *_entityNamesToModeledPropertyNamesAffectingKeyPaths;
-    NSDictionary *_entityNamesToInverseRelationshipKeyPaths;
+    NSMutableArray *plans = index[key];
+    if (!plans)
+        index[key] = plans = [NSMutableArray new];
+    [plans addObject:plan];
 }
 
 
-#pragma mark DMNotificationObserver
+@implementation DMManagedObjectChangeIndex {
+    NSArray *_dependencyPlans;
+    NSDictionary *_plansByEntityName; // plans with modeled properties of the entity
+    NSDictionary *_plansByEntityAndPropertyName; // entity name -> property name -> plans
+    NSDictionary *_plansByBaseEntityName; // plans whose base entity is the entity or a superentity
+}
 
-- (id)initWithName:(NSString *)notificationName object:(id)notificationSender attachedToOwner:(id)owner notificationCenter:(NSNotificationCenter *)notificationCenter action:(DMNotificationActionBlock)actionBlock; // Designated initializer
+- (id)initWithDependencyPlans:(NSArray *)plans;
 {
-    if (!(self = [super initWithName:notificationName object:notificationSender attachedToOwner:owner notificationCenter:notificationCenter action:actionBlock]))
+    if (!(self = [super init]))
         return nil;
+    _dependencyPlans = [plans copy];
+
+    NSMutableDictionary *const plansByEntityName = [NSMutableDictionary new];
+    NSMutableDictionary *const plansByEntityAndPropertyName = [NSMutableDictionary new];
+    NSMutableDictionary *const plansByBaseEntityName = [NSMutableDictionary new];
+    for (DMKeyPathDependencyPlan *plan in _dependencyPlans) {
+        [plan.entityNamesToModeledPropertyNames enumerateKeysAndObjectsUsingBlock:^(NSString *entityName, NSSet *propertyNames, BOOL *stop) {
+            addPlanToIndex(plansByEntityName, entityName, plan);
+            NSMutableDictionary *plansByPropertyName = plansByEntityAndPropertyName[entityName];
+            if (!plansByPropertyName)
+                plansByEntityAndPropertyName[entityName] = plansByPropertyName = [NSMutableDictionary new];
+            for (NSString *propertyName in propertyNames)
+                addPlanToIndex(plansByPropertyName, propertyName, plan);
+        }];
+        for (NSString *entityName in plan.baseEntityNames)
+            addPlanToIndex(plansByBaseEntityName, entityName, plan);
+    }
+    _plansByEntityName = plansByEntityName;
+    _plansByEntityAndPropertyName = plansByEntityAndPropertyName;
+    _plansByBaseEntityName = plansByBaseEntityName;
     return self;
 }
 
+- (void)routeChangesInNotification:(NSNotification *)objectsDidChangeNotification affectedObjectsByPlan:(NSMapTable *)affectedObjectsByPlan plansWithInvalidatedObjects:(NSHashTable *)plansWithInvalidatedObjects;
+{
+    NSDictionary *const userInfo = objectsDidChangeNotification.userInfo;
+    for (DMKeyPathDependencyPlan *plan in _dependencyPlans)
+        [affectedObjectsByPlan setObject:[NSMutableSet new] forKey:plan];
 
-#pragma mark API
+    if (userInfo[NSInvalidatedAllObjectsKey]) {
+        for (DMKeyPathDependencyPlan *plan in _dependencyPlans)
+            [plansWithInvalidatedObjects addObject:plan];
+        return;
+    }
 
-- (id)initWithManagedObjectContext:(NSManagedObjectContext *)moc baseEntity:(NSEntityDescription *)baseEntity interestedKeyPaths:(NSSet *)keyPaths attachedToOwner:(id)owner action:(DMManagedObjectsDidChangeBlock)mocActionBlock;
+    for (NSManagedObject *managedObject in userInfo[NSInvalidatedObjectsKey])
+        for (DMKeyPathDependencyPlan *plan in _plansByEntityName[managedObject.entity.name])
+            [plansWithInvalidatedObjects addObject:plan];
+
+    NSMapTable *const changedObjectsByPlanAndInverseKeyPath = [[NSMapTable alloc] initWithKeyOptions:(NSPointerFunctionsStrongMemory | NSPointerFunctionsObjectPointerPersonality) valueOptions:NSPointerFunctionsStrongMemory capacity:0];
+    NSHashTable *const affectedPlans = [NSHashTable hashTableWithOptions:(NSPointerFunctionsStrongMemory | NSPointerFunctionsObjectPointerPersonality)];
+    for (NSManagedObject *changedObject in userInfo[NSUpdatedObjectsKey]) {
+        NSDictionary *const plansByPropertyName = _plansByEntityAndPropertyName[changedObject.entity.name];
+        if (!plansByPropertyName)
+            continue;
+        [affectedPlans removeAllObjects];
+        for (NSString *changedKey in changedObject.changedValuesForCurrentEvent)
+            for (DMKeyPathDependencyPlan *plan in plansByPropertyName[changedKey])
+                [affectedPlans addObject:plan];
+        [self _addChangedObject:changedObject toPlans:affectedPlans affectedObjectsByPlan:affectedObjectsByPlan changedObjectsByPlanAndInverseKeyPath:changedObjectsByPlanAndInverseKeyPath];
+    }
+
+    for (NSManagedObject *changedObject in userInfo[NSRefreshedObjectsKey]) // treat all refreshed objects as changed
+        [self _addChangedObject:changedObject toPlans:_plansByEntityName[changedObject.entity.name] affectedObjectsByPlan:affectedObjectsByPlan changedObjectsByPlanAndInverseKeyPath:changedObjectsByPlanAndInverseKeyPath];
+
+    for (NSString *changeKey in @[NSInsertedObjectsKey, NSDeletedObjectsKey])
+        for (NSManagedObject *changedObject in userInfo[changeKey])
+            for (DMKeyPathDependencyPlan *plan in _plansByBaseEntityName[changedObject.entity.name])
+                [[affectedObjectsByPlan objectForKey:plan] addObject:changedObject];
+
+    // Follow the relationships back to the base entity from all of a plan's changed objects together. Plans with the
+    // same way back share a traversal, so objects they have in common are only read once.
+    NSMutableDictionary *const traversalsByInverseKeyPath = [NSMutableDictionary new];
+    const DMRelationshipPrefetchBlock prefetchBlock = prefetchBlockForManagedObjectContext(objectsDidChangeNotification.object);
+    for (DMKeyPathDependencyPlan *plan in changedObjectsByPlanAndInverseKeyPath)
+        [[changedObjectsByPlanAndInverseKeyPath objectForKey:plan] enumerateKeysAndObjectsUsingBlock:^(NSString *inverseKeyPath, NSSet *changedObjects, BOOL *stop) {
+            DMRelationshipTraversal *traversal = traversalsByInverseKeyPath[inverseKeyPath];
+            if (!traversal)
+                traversalsByInverseKeyPath[inverseKeyPath] = traversal = [[DMRelationshipTraversal alloc] initWithKeyPath:inverseKeyPath prefetchBlock:prefetchBlock];
+            [[affectedObjectsByPlan objectForKey:plan] unionSet:[traversal destinationsOfObjects:changedObjects]];
+        }];
+}
+
+- (void)_addChangedObject:(NSManagedObject *)changedObject toPlans:(id<NSFastEnumeration>)plans affectedObjectsByPlan:(NSMapTable *)affectedObjectsByPlan changedObjectsByPlanAndInverseKeyPath:(NSMapTable *)changedObjectsByPlanAndInverseKeyPath;
 {
-    NSParameterAssert(moc && baseEntity && owner && mocActionBlock);
-    DMNotificationActionBlock actionBlock = ^(NSNotification *notification, id localOwner, DMNotificationObserver *observer) {
-        [(DMManagedObjectObserver *)observer _fireManagedObjectsDidChangeAction:mocActionBlock owner:localOwner notification:notification];
-    };
+    NSString *const entityName = changedObject.entity.name;
+    for (DMKeyPathDependencyPlan *plan in plans) {
+        if ([plan entityNameIsKindOfBaseEntity:entityName]) {
+            [[affectedObjectsByPlan objectForKey:plan] addObject:changedObject];
+            continue;
+        }
 
-    if (!(self = [self initWithName:NSManagedObjectContextObjectsDidChangeNotification object:moc attachedToOwner:owner notificationCenter:[NSNotificationCenter defaultCenter] action:actionBlock]))
-        return nil;
-    _baseEntity = baseEntity;
-    _entityNamesToModeledPropertyNamesAffectingKeyPaths = [[self class] entityNamesToModeledPropertyNamesAffectingKeyPaths:keyPaths ofEntity:baseEntity];
-    _entityNamesToInverseRelationshipKeyPaths = [[self class] entityNamesToInverseRelationshipKeyPathsAffectedByKeyPaths:keyPaths ofEntity:baseEntity];
+        NSString *const inverseKeyPath = plan.entityNamesToInverseRelationshipKeyPaths[entityName];
+        if (![inverseKeyPath isKindOfClass:[NSString class]])
+            continue; // no inverse; warned about when the observer was created
+        NSMutableDictionary *changedObjectsByInverseKeyPath = [changedObjectsByPlanAndInverseKeyPath objectForKey:plan];
+        if (!changedObjectsByInverseKeyPath)
+            [changedObjectsByPlanAndInverseKeyPath setObject:(changedObjectsByInverseKeyPath = [NSMutableDictionary new]) forKey:plan];
+        NSMutableSet *changedObjects = changedObjectsByInverseKeyPath[inverseKeyPath];
+        if (!changedObjects)
+            changedObjectsByInverseKeyPath[inverseKeyPath] = changedObjects = [NSMutableSet new];
+        [changedObjects addObject:changedObject];
+    }
+}
 
-    if (!_entityNamesToModeledPropertyNamesAffectingKeyPaths.count)
-        return nil;
+@end
 
-    [_entityNamesToInverseRelationshipKeyPaths enumerateKeysAndObjectsUsingBlock:^(NSString *entityName, id inverseKeyPathOrNull, BOOL *stop) {
-        if ([inverseKeyPathOrNull isKindOfClass:[NSNull class]]) {
-            NSLog(@"%s *** WARNING: No inverse relationship from entity %@ to %@, will not be able to notify about which %@ instances are affected by change in some of the given key paths: %@", __func__, entityName, _baseEntity.name, _baseEntity.name, keyPaths);
-        }
-    }];
+
+static dispatch_semaphore_t changeDispatcherCreationMutex;
+static const void *const changeDispatcherKey = &changeDispatcherKey;
+
+@implementation DMManagedObjectChangeDispatcher {
+    dispatch_semaphore_t _mutex;
+    NSCountedSet *_dependencyPlans; // counted per observer; plans don't override -isEqual:
+    NSHashTable *_observers; // unretained; observers remove themselves when invalidated
+    DMManagedObjectChangeIndex *_index; // nil until needed after the plans change
+    NSNotification *_routedNotification; // kept until each observer it was routed for has picked up its result or gone away
+    NSHashTable *_observersPendingPickup; // unretained
+    NSMapTable *_affectedObjectsByPlan;
+    NSHashTable *_plansWithInvalidatedObjects;
+}
+
+#pragma mark NSObject
+
++ (void)initialize;
+{
+    if (self != [DMManagedObjectChangeDispatcher class])
+        return;
+    changeDispatcherCreationMutex = dispatch_semaphore_create(1);
+}
+
+- (id)init;
+{
+    if (!(self = [super init]))
+        return nil;
+    _mutex = dispatch_semaphore_create(1);
+    _dependencyPlans = [NSCountedSet new];
+    _observers = [NSHashTable hashTableWithOptions:(NSPointerFunctionsOpaqueMemory | NSPointerFunctionsOpaquePersonality)];
     return self;
 }
 
-+ (NSDictionary *)entityNamesToModeledPropertyNamesAffectingKeyPaths:(NSSet *)modeledOrUnmodeledKeyPaths ofEntity:(NSEntityDescription *)baseEntity;
+
+#pragma mark API
+
++ (instancetype)dispatcherForManagedObjectContext:(NSManagedObjectContext *)moc;
 {
-    NSMutableDictionary *const modeledPropertyNamesByEntityName = [NSMutableDictionary new];
-    void (^accumulatePropertiesByEntityBlock)(NSPropertyDescription *, NSEntityDescription *) = ^(NSPropertyDescription *property, NSEntityDescription *entityOrSubentity) {
-        NSMutableSet *mutableSet = modeledPropertyNamesByEntityName[entityOrSubentity.name];
-        if (!mutableSet)
-            mutableSet = modeledPropertyNamesByEntityName[entityOrSubentity.name] = [NSMutableSet new];
-        [mutableSet addObject:property.name];
-    };
+    NSParameterAssert(moc);
+    DMManagedObjectChangeDispatcher *dispatcher;
+    dispatch_semaphore_wait(changeDispatcherCreationMutex, DISPATCH_TIME_FOREVER); {
+        dispatcher = objc_getAssociatedObject(moc, changeDispatcherKey);
+        if (!dispatcher)
+            objc_setAssociatedObject(moc, changeDispatcherKey, (dispatcher = [self new]), OBJC_ASSOCIATION_RETAIN_NONATOMIC);
+    } dispatch_semaphore_signal(changeDispatcherCreationMutex);
+    return dispatcher;
+}
 
-    for (NSEntityDescription *entity in flattenSubentities(baseEntity))
-        for (NSString *keyPath in modeledOrUnmodeledKeyPaths)
-            [self _enumerateModeledPropertyNamesAffectingKeyPath:keyPath ofEntity:entity usingBlock:accumulatePropertiesByEntityBlock];
-
-    // Share set instances when used for the same keys. Typically many sets are identical (particularly if entities have sub-entities) so this uses less memory; may make for better locality when processing notification. No proven reason.
-    NSMutableSet *const keySets = [NSMutableSet new];
-    // Use new dictionary, because stupidly they can't be mutated while enumerating
-    NSMutableDictionary *const uniquedModeledPropertyNamesByEntityName = [NSMutableDictionary dictionaryWithCapacity:modeledPropertyNamesByEntityName.count];
-    [modeledPropertyNamesByEntityName enumerateKeysAndObjectsUsingBlock:^(NSString *entityName, NSSet *modeledPropertyNames, BOOL *stop) {
-        NSSet *uniquedSet = [keySets member:modeledPropertyNames];
-        if (!uniquedSet)
-            uniquedSet = [modeledPropertyNames copy], [keySets addObject:uniquedSet];
-        uniquedModeledPropertyNamesByEntityName[entityName] = uniquedSet;
-    }];
+- (void)addObserver:(id)observer dependencyPlan:(DMKeyPathDependencyPlan *)plan;
+{
+    NSParameterAssert(observer && plan);
+    dispatch_semaphore_wait(_mutex, DISPATCH_TIME_FOREVER); {
+        if (![_dependencyPlans countForObject:plan])
+            _index = nil;
+        [_dependencyPlans addObject:plan];
+        [_observers addObject:observer];
+    } dispatch_semaphore_signal(_mutex);
+}
 
-    return modeledPropertyNamesByEntityName;
+- (void)removeObserver:(id)observer dependencyPlan:(DMKeyPathDependencyPlan *)plan;
+{
+    NSParameterAssert(observer && plan);
+    dispatch_semaphore_wait(_mutex, DISPATCH_TIME_FOREVER); {
+        [_dependencyPlans removeObject:plan];
+        [_observers removeObject:observer];
+        if (![_dependencyPlans countForObject:plan])
+            _index = nil;
+
+        // Invalidated mid-post, it won't pick up its result; don't keep the routed changes (and through the notification, the context) waiting for it
+        [_observersPendingPickup removeObject:observer];
+        if (_routedNotification && !_observersPendingPickup.count)
+            [self _discardRoutedChanges];
+    } dispatch_semaphore_signal(_mutex);
 }
 
-+ (NSDictionary *)entityNamesToInverseRelationshipKeyPathsAffectedByKeyPaths:(NSSet *)modeledOrUnmodeledKeyPaths ofEntity:(NSEntityDescription *)baseEntity;
+- (NSSet *)affectedObjectsOfBaseEntityForObserver:(id)observer dependencyPlan:(DMKeyPathDependencyPlan *)plan notification:(NSNotification *)objectsDidChangeNotification someObjectsInvalidated:(BOOL *)outSomeObjectsInvalidated;
 {
-    // Resulting dictionary contains NSNull if some relationships are missing inverses, so traversal isn't possible
-    NSMutableDictionary *const inverseRelationshipPathByEntityName = [NSMutableDictionary new];
-    void (^accumulateInverseRelationshipByEntityBlock)(NSPropertyDescription *, NSEntityDescription *) = ^(NSPropertyDescription *property, NSEntityDescription *entityOrSubentity) {
-        if (![property isKindOfClass:[NSRelationshipDescription class]])
-            return;
-
-        id inverseKeyPathOrNull = [NSNull null];
-        NSRelationshipDescription *const relationship = (id)property;
-        NSRelationshipDescription *const inverseRelationship = relationship.inverseRelationship;
-        if (inverseRelationship) {
-            inverseKeyPathOrNull = inverseRelationship.name;
-            if (![entityOrSubentity isKindOfEntity:baseEntity]) {
-                NSString *subsequentPathToBase = inverseRelationshipPathByEntityName[entityOrSubentity.name];
-                if (![subsequentPathToBase isKindOfClass:[NSNull class]] && subsequentPathToBase.length)
-                    inverseKeyPathOrNull = [inverseKeyPathOrNull stringByAppendingPathExtension:subsequentPathToBase];
-            }
+    NSParameterAssert(observer && plan && objectsDidChangeNotification && outSomeObjectsInvalidated);
+    NSSet *affectedObjectsOfBaseEntity = nil;
+    BOOL alreadyRouted;
+    DMManagedObjectChangeIndex *index;
+    dispatch_semaphore_wait(_mutex, DISPATCH_TIME_FOREVER); {
+        alreadyRouted = (_routedNotification == objectsDidChangeNotification);
+        if (alreadyRouted && [_observersPendingPickup containsObject:observer]) {
+            [_observersPendingPickup removeObject:observer];
+            if ((affectedObjectsOfBaseEntity = [_affectedObjectsByPlan objectForKey:plan]))
+                *outSomeObjectsInvalidated = [_plansWithInvalidatedObjects containsObject:plan];
+            if (!_observersPendingPickup.count)
+                [self _discardRoutedChanges];
         }
+        if (!_index)
+            _index = [[DMManagedObjectChangeIndex alloc] initWithDependencyPlans:_dependencyPlans.allObjects];
+        index = _index;
+    } dispatch_semaphore_signal(_mutex);
+    if (affectedObjectsOfBaseEntity)
+        return affectedObjectsOfBaseEntity;
+
+    // First observer to get this notification: route it for everyone. One that joined since, or whose plan was added since, routes it just for itself. Outside the lock, as it can fire faults.
+    NSMapTable *const affectedObjectsByPlan = [[NSMapTable alloc] initWithKeyOptions:(NSPointerFunctionsStrongMemory | NSPointerFunctionsObjectPointerPersonality) valueOptions:NSPointerFunctionsStrongMemory capacity:0];
+    NSHashTable *const plansWithInvalidatedObjects = [NSHashTable hashTableWithOptions:(NSPointerFunctionsStrongMemory | NSPointerFunctionsObjectPointerPersonality)];
+    [index routeChangesInNotification:objectsDidChangeNotification affectedObjectsByPlan:affectedObjectsByPlan plansWithInvalidatedObjects:plansWithInvalidatedObjects];
+
+    if (!alreadyRouted) {
+        dispatch_semaphore_wait(_mutex, DISPATCH_TIME_FOREVER); {
+            // Replaces whatever is left of the previous notification's routing
+            NSHashTable *const observersPendingPickup = [_observers copy];
+            [observersPendingPickup removeObject:observer];
+            [self _discardRoutedChanges];
+            if (observersPendingPickup.count) {
+                _routedNotification = objectsDidChangeNotification;
+                _observersPendingPickup = observersPendingPickup;
+                _affectedObjectsByPlan = affectedObjectsByPlan;
+                _plansWithInvalidatedObjects = plansWithInvalidatedObjects;
+            }
+        } dispatch_semaphore_signal(_mutex);
+    }
+    *outSomeObjectsInvalidated = [plansWithInvalidatedObjects containsObject:plan];
+    return [affectedObjectsByPlan objectForKey:plan];
+}
 
-        for (NSEntityDescription *destinationEntity in flattenSubentities(relationship.destinationEntity))
-            inverseRelationshipPathByEntityName[destinationEntity.name] = inverseKeyPathOrNull;
-    };
 
-    for (NSEntityDescription *entity in flattenSubentities(baseEntity))
-        for (NSString *keyPath in modeledOrUnmodeledKeyPaths)
-            [self _enumerateModeledPropertyNamesAffectingKeyPath:keyPath ofEntity:entity usingBlock:accumulateInverseRelationshipByEntityBlock];
+#pragma mark Private
 
-    return inverseRelationshipPathByEntityName;
+- (void)_discardRoutedChanges;
+{
+    _routedNotification = nil;
+    _observersPendingPickup = nil;
+    _affectedObjectsByPlan = nil;
+    _plansWithInvalidatedObjects = nil;
 }
 
+@end
 
-#pragma mark Private
 
-- (void)_fireManagedObjectsDidChangeAction:(DMManagedObjectsDidChangeBlock)mocActionBlock owner:(id)owner notification:(NSNotification *)objectsDidChangeNotification;
+@implementation DMManagedObjectObserver
 {
-    NSParameterAssert([objectsDidChangeNotification.name isEqual:NSManagedObjectContextObjectsDidChangeNotification]);
-    NSDictionary *const userInfo = objectsDidChangeNotification.userInfo;
+    NSEntityDescription *_baseEntity;
+    DMKeyPathDependencyPlan *_dependencyPlan; // shared by observers of the same entity and key paths
+    DMManagedObjectChangeDispatcher *_changeDispatcher; // shared by observers of the same context
+}
 
-    NSMutableSet *const affectedObjectsOfBaseEntity = [NSMutableSet new];
-    BOOL someObjectsInvalidated = NO;
 
-    if (userInfo[NSInvalidatedAllObjectsKey]) {
-        someObjectsInvalidated = YES;
-    } else {
-        for (NSManagedObject *managedObject in userInfo[NSInvalidatedObjectsKey])
-            if (_entityNamesToModeledPropertyNamesAffectingKeyPaths[managedObject.entity.name]) {
-                someObjectsInvalidated = YES;
-                break;
-            }
+#pragma mark DMNotificationObserver
 
+- (id)initWithName:(NSString *)notificationName object:(id)notificationSender attachedToOwner:(id)owner notificationCenter:(NSNotificationCenter *)notificationCenter options:(DMNotificationObserverOptions)options action:(DMNotificationActionBlock)actionBlock; // Designated initializer
+{
+    if (!(self = [super initWithName:notificationName object:notificationSender attachedToOwner:owner notificationCenter:notificationCenter options:options action:actionBlock]))
+        return nil;
+    return self;
+}
 
-        for (NSString *changeKey in @[NSUpdatedObjectsKey, NSRefreshedObjectsKey])
-            for (NSManagedObject *changedObject in userInfo[changeKey]) {
-                NSSet *const modeledPropertyNames = _entityNamesToModeledPropertyNamesAffectingKeyPaths[changedObject.entity.name];
-                if (!modeledPropertyNames)
-                    continue;
-
-                if (changeKey == NSUpdatedObjectsKey) { // treat all refreshed objects as changeed.
-                    BOOL keyChangedAffectingBaseEntity = NO;
-                    for (NSString *changedKey in changedObject.changedValuesForCurrentEvent)
-                        if ([modeledPropertyNames containsObject:changedKey]) {
-                            keyChangedAffectingBaseEntity = YES;
-                            break;
-                        }
-
-                    if (!keyChangedAffectingBaseEntity)
-                        continue;
-                }
-
-                if ([changedObject.entity isKindOfEntity:_baseEntity]) {
-                    [affectedObjectsOfBaseEntity addObject:changedObject];
-                } else {
-                    NSString *const inverseKeyPath = _entityNamesToInverseRelationshipKeyPaths[changedObject.entity.name];
-                    [affectedObjectsOfBaseEntity unionSet:[[self class] setByTraversingRelationshipKeyPath:inverseKeyPath ofManagedObject:changedObject]];
-                }
-            }
+- (void)_discardObservationState;
+{
+    // Stop counting towards the context's observers now, not when deallocated, so others aren't left waiting on us to pick up routed changes
+    [super _discardObservationState];
+    [_changeDispatcher removeObserver:self dependencyPlan:_dependencyPlan]; // nil if init bailed out
+}
 
-        for (NSString *changeKey in @[NSInsertedObjectsKey, NSDeletedObjectsKey])
-            for (NSManagedObject *changedObject in userInfo[changeKey])
-                if ([changedObject.entity isKindOfEntity:_baseEntity])
-                    [affectedObjectsOfBaseEntity addObject:changedObject];
-    }
 
-    mocActionBlock(someObjectsInvalidated, affectedObjectsOfBaseEntity, objectsDidChangeNotification, owner, self);
-}
+#pragma mark API
 
-+ (void)_enumerateModeledPropertyNamesAffectingKeyPath:(NSString *)modeledOrUnmodeledKeyPath ofEntity:(NSEntityDescription *)entity usingBlock:(void (^)(NSPropertyDescription *, NSEntityDescription *))block;
+- (id)initWithManagedObjectContext:(NSManagedObjectContext *)moc baseEntity:(NSEntityDescription *)baseEntity interestedKeyPaths:(NSSet *)keyPaths attachedToOwner:(id)owner action:(DMManagedObjectsDidChangeBlock)mocActionBlock;
 {
-    NSString *remainingKeyPath;
-    NSString *const firstKey = DMSplitKeyPath(modeledOrUnmodeledKeyPath, &remainingKeyPath);
-
-    NSPropertyDescription *const modeledProperty = entity.propertiesByName[firstKey];
-    if (!modeledProperty) {
-        const Class managedObjectClass = NSClassFromString(entity.managedObjectClassName);
-        for (NSString *dependentKeyPath in [managedObjectClass keyPathsForValuesAffectingValueForKey:firstKey]) {
-            /* Add the remaining key path onto the dependent key. This may not be how the dependent key is actually used,
-             * but unknown keys are ignored by +keyPathsForValuesAffectingValueForKey: so we can be more promiscuous.
-             * For example, a case where it's appropriate is observing "primarySynopsis.string", where -primarySynopsis
-             * returns { self.userSynopsis ? : self.amazonSynopses.firstObject } (synopsis being a managed object), thus
-             * depending on K(userSynopsis) and K(amazonSynopses), then _also_ on K(string) of Synopsis. */
-            NSString *const dependentKeyPathWithSuffix = remainingKeyPath.length ? [dependentKeyPath stringByAppendingPathExtension:remainingKeyPath] : dependentKeyPath;
-            [self _enumerateModeledPropertyNamesAffectingKeyPath:dependentKeyPathWithSuffix ofEntity:entity usingBlock:block];
-        }
+    NSParameterAssert(moc && baseEntity && owner && mocActionBlock);
+    DMNotificationActionBlock actionBlock = ^(NSNotification *notification, id localOwner, DMNotificationObserver *observer) {
+        [(DMManagedObjectObserver *)observer _fireManagedObjectsDidChangeAction:mocActionBlock owner:localOwner notification:notification];
+    };
+
+    if (!(self = [self initWithName:NSManagedObjectContextObjectsDidChangeNotification object:moc attachedToOwner:owner notificationCenter:[NSNotificationCenter defaultCenter] action:actionBlock]))
+        return nil;
+    _baseEntity = baseEntity;
+    _dependencyPlan = [DMKeyPathDependencyPlan planForEntity:baseEntity keyPaths:keyPaths];
 
-    } else {
-        // Key is a modeled property (attribute or relationship)
-        block(modeledProperty, entity);
+    if (!_dependencyPlan.entityNamesToModeledPropertyNames.count)
+        return nil;
 
-        if (remainingKeyPath.length) {
-            if ([modeledProperty isKindOfClass:[NSRelationshipDescription class]]) {
-                NSRelationshipDescription *const relationship = (id)modeledProperty;
-                for (NSEntityDescription *destinationEntity in flattenSubentities(relationship.destinationEntity))
-                    [self _enumerateModeledPropertyNamesAffectingKeyPath:remainingKeyPath ofEntity:destinationEntity usingBlock:block];
+    _changeDispatcher = [DMManagedObjectChangeDispatcher dispatcherForManagedObjectContext:moc];
+    [_changeDispatcher addObserver:self dependencyPlan:_dependencyPlan];
 
-            } else {
-                // Ignore remaining key path of non-relationship (e.g. an NSDictionary); that won't post an ObjectsDidChangeNotification anyway.
-                //NSLog(@"%s ignoring remaining key path '%@' of attribute %@.%@", __func__, remainingKeyPath, entity.name, modeledProperty.name);
-            }
+    [_dependencyPlan.entityNamesToInverseRelationshipKeyPaths enumerateKeysAndObjectsUsingBlock:^(NSString *entityName, id inverseKeyPathOrNull, BOOL *stop) {
+        if ([inverseKeyPathOrNull isKindOfClass:[NSNull class]]) {
+            NSLog(@"%s *** WARNING: No inverse relationship from entity %@ to %@, will not be able to notify about which %@ instances are affected by change in some of the given key paths: %@", __func__, entityName, _baseEntity.name, _baseEntity.name, keyPaths);
         }
-    }
+    }];
+    return self;
 }
 
-+ (NSSet *)setByTraversingRelationshipKeyPath:(NSString *)keyPath ofManagedObject:(NSManagedObject *)managedObject;
++ (NSDictionary *)entityNamesToModeledPropertyNamesAffectingKeyPaths:(NSSet *)modeledOrUnmodeledKeyPaths ofEntity:(NSEntityDescription *)baseEntity;
+{ return [DMKeyPathDependencyPlan planForEntity:baseEntity keyPaths:modeledOrUnmodeledKeyPaths].entityNamesToModeledPropertyNames; }
+
++ (NSDictionary *)entityNamesToInverseRelationshipKeyPathsAffectedByKeyPaths:(NSSet *)modeledOrUnmodeledKeyPaths ofEntity:(NSEntityDescription *)baseEntity;
+{ return [DMKeyPathDependencyPlan planForEntity:baseEntity keyPaths:modeledOrUnmodeledKeyPaths].entityNamesToInverseRelationshipKeyPaths; }
+
+
+#pragma mark Private
+
+- (void)_fireManagedObjectsDidChangeAction:(DMManagedObjectsDidChangeBlock)mocActionBlock owner:(id)owner notification:(NSNotification *)objectsDidChangeNotification;
 {
-    NSString *remainingKeyPath;
-    NSString *const firstKey = DMSplitKeyPath(keyPath, &remainingKeyPath);
-
-    NSSet *const relationshipSet = relationshipAsSet([managedObject valueForKey:firstKey]);
-    if (remainingKeyPath) {
-        NSMutableSet *const objects = [NSMutableSet new];
-        for (NSManagedObject *relatedManagedObject in relationshipSet)
-            [objects unionSet:[self setByTraversingRelationshipKeyPath:remainingKeyPath ofManagedObject:relatedManagedObject]];
-        return objects;
-    } else
-        return relationshipSet;
+    NSParameterAssert([objectsDidChangeNotification.name isEqual:NSManagedObjectContextObjectsDidChangeNotification]);
+    BOOL someObjectsInvalidated = NO;
+    NSSet *const affectedObjectsOfBaseEntity = [_changeDispatcher affectedObjectsOfBaseEntityForObserver:self dependencyPlan:_dependencyPlan notification:objectsDidChangeNotification someObjectsInvalidated:&someObjectsInvalidated];
+    mocActionBlock(someObjectsInvalidated, (affectedObjectsOfBaseEntity ? : [NSSet set]), objectsDidChangeNotification, owner, self);
 }
 
 @end
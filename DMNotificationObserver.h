@@ -16,6 +16,9 @@
 //
 
 #import <Foundation/Foundation.h>
+#import "DMEventRing.h"
+
+@class DMObservationStream;
 
 
 /* The action block is passed the notification, the owner as a parameter (to avoid retain cycles),
@@ -24,12 +27,31 @@
 typedef void(^DMNotificationActionBlock)(NSNotification *notification, id localSelf, DMNotificationObserver *observer); // ‘localSelf’ param is actually the owner, which is almost always used as ‘self’
 
 
+/* Coalescing observers run their action once per batch of notifications instead of once per notification.
+ * The action is passed the number of notifications in the batch and their distinct (by identity) non-nil senders. */
+typedef void(^DMCoalescedNotificationActionBlock)(NSUInteger notificationCount, NSArray *senders, id localSelf, DMNotificationObserver *observer);
+
+
 /* DMNotificationObserver is thread-safe. It's safe to create and call its method from any thread. Note that
  * if you create an observer on the main thread, and another object posts a notification on a background
  * thread, the action block will be run on the posting thread. (This is normal NSNotificationCenter behavior,
  * and we might want to define the environment better if lots of our clients end up doing a dispatch_async in
  * their action block.) */
 
+/* By default an observer runs its action while holding its own lock, so actions for notifications posted on
+ * several threads run one at a time, and -invalidate waits for a running action to finish.
+ *
+ * DMNotificationObserverConcurrentDelivery
+ *      Run actions without holding any lock, so concurrently posted notifications are delivered concurrently.
+ *      The action block must then be safe to run on several threads at once. -invalidate still guarantees that
+ *      no action starts after it returns, and waits for actions already running on other threads to finish (so
+ *      the owner remains valid for as long as any action can see it). Calling -invalidate from within the
+ *      action is fine; it doesn't wait for the action that called it. */
+typedef NS_OPTIONS(NSUInteger, DMNotificationObserverOptions) {
+    DMNotificationObserverConcurrentDelivery = 1 << 0,
+};
+
+
 /* The lifetime of a DMNotificationObserver is tied to its owner. Observers are automatically invalidated when
  * its owner is deallocated. Owners don't need to explicitly keep observers in strong storage (such as ivars);
  * instead, observers attach themselves to their owner with the associated objects API. */
@@ -47,18 +69,80 @@ typedef void(^DMNotificationActionBlock)(NSNotification *notification, id localS
                          action:(DMNotificationActionBlock)actionBlock
                                 __attribute__((nonnull(3,4)));
 
+/* A batch is flushed `interval` seconds after its first notification, or with an interval of zero, once the work
+ * already submitted to `queue` has drained (for the main queue, that's the end of the current run loop turn).
+ * The action runs on `queue`, or the main queue if nil. It isn't run if the observer is invalidated first. */
++ (instancetype)coalescingObserverForName:(NSString *)notificationName
+                                   object:(id)notificationSender
+                          attachedToOwner:(id)owner
+                                 interval:(NSTimeInterval)interval
+                                    queue:(dispatch_queue_t)queue
+                                   action:(DMCoalescedNotificationActionBlock)coalescedActionBlock
+                                          __attribute__((nonnull(3,6)));
+
 - (id)initWithName:(NSString *)notificationName
             object:(id)notificationSender
    attachedToOwner:(id)owner
             action:(DMNotificationActionBlock)actionBlock
                    __attribute__((nonnull(3,4)));
 
++ (instancetype)observerForName:(NSString *)notificationName
+                         object:(id)notificationSender
+                attachedToOwner:(id)owner
+                        options:(DMNotificationObserverOptions)options
+                         action:(DMNotificationActionBlock)actionBlock
+                                __attribute__((nonnull(3,5)));
+
 - (id)initWithName:(NSString *)notificationName
             object:(id)notificationSender
    attachedToOwner:(id)owner
 notificationCenter:(NSNotificationCenter *)notificationCenter
             action:(DMNotificationActionBlock)actionBlock
-                   __attribute__((nonnull(3,4,5))); // Designated initializer
+                   __attribute__((nonnull(3,4,5)));
+
+- (id)initWithName:(NSString *)notificationName
+            object:(id)notificationSender
+   attachedToOwner:(id)owner
+notificationCenter:(NSNotificationCenter *)notificationCenter
+           options:(DMNotificationObserverOptions)options
+            action:(DMNotificationActionBlock)actionBlock
+                   __attribute__((nonnull(3,4,6))); // Designated initializer
+
+/* Queued observers run their action on the given queue rather than on the posting thread. Up to
+ * maxPendingNotifications are buffered while the queue catches up; beyond that, overflowPolicy applies (see
+ * DMEventRing.h). Pending notifications are drained in order by one block or operation per burst, rather than
+ * one per notification. Invalidation discards anything not yet delivered.
+ * Don't use DMEventOverflowBlockPoster if notifications can be posted from the delivery queue itself. */
+- (id)initWithName:(NSString *)notificationName
+                 object:(id)notificationSender
+        attachedToOwner:(id)owner
+     notificationCenter:(NSNotificationCenter *)notificationCenter
+          deliveryQueue:(dispatch_queue_t)deliveryQueue
+maxPendingNotifications:(NSUInteger)maxPendingNotifications
+         overflowPolicy:(DMEventOverflowPolicy)overflowPolicy
+                 action:(DMNotificationActionBlock)actionBlock
+                        __attribute__((nonnull(3,4,5,8)));
+
+- (id)initWithName:(NSString *)notificationName
+                 object:(id)notificationSender
+        attachedToOwner:(id)owner
+     notificationCenter:(NSNotificationCenter *)notificationCenter
+ deliveryOperationQueue:(NSOperationQueue *)deliveryOperationQueue
+maxPendingNotifications:(NSUInteger)maxPendingNotifications
+         overflowPolicy:(DMEventOverflowPolicy)overflowPolicy
+                 action:(DMNotificationActionBlock)actionBlock
+                        __attribute__((nonnull(3,4,5,8)));
+
+/* Stream observers don't run an action: notifications are appended to the returned stream for a consumer to drain
+ * in bulk (see DMObservationStream.h). Up to `capacity` are held; beyond that, overflowPolicy applies. The stream
+ * is attached to the owner, and invalidating it invalidates the observer. */
++ (DMObservationStream *)streamForName:(NSString *)notificationName
+                                object:(id)notificationSender
+                       attachedToOwner:(id)owner
+                    notificationCenter:(NSNotificationCenter *)notificationCenter
+                              capacity:(NSUInteger)capacity
+                        overflowPolicy:(DMEventOverflowPolicy)overflowPolicy
+                                       __attribute__((nonnull(3,4)));
 
 - (void)fireAction:(NSNotification *)notification;
 - (void)invalidate;
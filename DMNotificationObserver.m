@@ -17,8 +17,12 @@
 
 #import "DMNotificationObserver.h"
 
+#import "DMActionCoalescer.h"
 #import "DMAutoInvalidation.h"
 #import "DMBlockUtilities.h"
+#import "DMIndexedNotificationCenter.h"
+#import "DMObservationStream.h"
+#import "DMObserverStatistics.h"
 
 #if !__has_feature(objc_arc)
 #error This file must be compiled with Automatic Reference Counting (ARC).
@@ -26,17 +30,42 @@
 
 
 @interface DMNotificationObserver () <DMAutoInvalidation>
+- (id)_initWithName:(NSString *)notificationName object:(id)notificationSender attachedToOwner:(id)owner notificationCenter:(NSNotificationCenter *)notificationCenter options:(DMNotificationObserverOptions)options deliveryQueue:(dispatch_queue_t)deliveryQueue deliveryOperationQueue:(NSOperationQueue *)deliveryOperationQueue pendingNotifications:(DMEventRing *)pendingNotifications action:(DMNotificationActionBlock)actionBlock;
+- (void)_fireActionNow:(NSNotification *)notification;
+- (void)_enqueueNotification:(NSNotification *)notification;
+- (void)_drainPendingNotifications;
+- (void)_performWithOwner:(void (^)(id owner))block;
+- (void)_performConcurrentlyWithOwner:(void (^)(id owner))block;
+- (BOOL)_markInvalidated;
+- (void)_discardObservationState;
 @end
 
 
+/* Per-thread stack of observers currently running an action in concurrent delivery mode, so -invalidate called
+ * from within an action doesn't wait for itself to finish. */
+struct DMConcurrentFireFrame {
+    __unsafe_unretained DMNotificationObserver *observer;
+    struct DMConcurrentFireFrame *previous;
+};
+static __thread struct DMConcurrentFireFrame *currentConcurrentFireFrame;
+
+
 @implementation DMNotificationObserver {
     BOOL _invalidated;
+    DMNotificationObserverOptions _options;
+    uint32_t _concurrentFireCount; // concurrent delivery only
+    dispatch_semaphore_t _concurrentFiresDrained; // concurrent delivery only; signaled when an action finishes after invalidation
+    dispatch_queue_t _deliveryQueue; // queued delivery only (or _deliveryOperationQueue)
+    NSOperationQueue *_deliveryOperationQueue;
+    DMEventRing *_pendingNotifications; // queued delivery, or a stream's ring if there's no delivery queue
     NSNotificationCenter *_notificationCenter;
     NSString *_notificationName;
     __unsafe_unretained id _unsafeNotificationSender;
     DMNotificationActionBlock _actionBlock;
+    DMActionCoalescer *_coalescer; // coalescing observers only
     
     __unsafe_unretained id _unsafeOwner;
+    struct DMObserverInvalidatorLink _invalidatorLink;
 }
 
 #pragma mark NSObject
@@ -60,20 +89,44 @@
 
 - (void)invalidate;
 {
-    @synchronized (self) {
-        if (_invalidated)
-            return;
-        _invalidated = YES;
-    }
+    if (![self _markInvalidated])
+        return;
     [_notificationCenter removeObserver:self name:_notificationName object:_unsafeNotificationSender];
-    
-    _actionBlock = nil;
-    _notificationName = nil;
-    _unsafeNotificationSender = nil;
-    _unsafeOwner = nil;
+    [self _discardObservationState];
     [DMObserverInvalidator observerDidInvalidate:self];
 }
 
+- (struct DMObserverInvalidatorLink *)observerInvalidatorLink;
+{ return &_invalidatorLink; }
+
++ (void)invalidateObserversForDeallocatingOwner:(NSArray *)observers;
+{
+    // Owners with many observers typically register them all with the same center; group removals so each center is visited once
+    NSMapTable *const observersByCenter = [[NSMapTable alloc] initWithKeyOptions:(NSPointerFunctionsStrongMemory | NSPointerFunctionsObjectPointerPersonality) valueOptions:NSPointerFunctionsStrongMemory capacity:1];
+    for (DMNotificationObserver *observer in observers) {
+        if (![observer _markInvalidated])
+            continue;
+        NSMutableArray *centerObservers = [observersByCenter objectForKey:observer->_notificationCenter];
+        if (!centerObservers)
+            [observersByCenter setObject:(centerObservers = [NSMutableArray arrayWithCapacity:observers.count]) forKey:observer->_notificationCenter];
+        [centerObservers addObject:observer];
+    }
+
+    @autoreleasepool {
+        for (NSNotificationCenter *notificationCenter in observersByCenter) {
+            NSArray *const centerObservers = [observersByCenter objectForKey:notificationCenter];
+            const BOOL removeInBulk = [notificationCenter isKindOfClass:[DMIndexedNotificationCenter class]]; // each observer has just the one registration
+            if (removeInBulk)
+                [(DMIndexedNotificationCenter *)notificationCenter removeObservers:centerObservers];
+            for (DMNotificationObserver *observer in centerObservers) {
+                if (!removeInBulk)
+                    [notificationCenter removeObserver:observer name:observer->_notificationName object:observer->_unsafeNotificationSender];
+                [observer _discardObservationState];
+            }
+        }
+    }
+}
+
 
 #pragma mark API
 
@@ -91,17 +144,98 @@
     return [[self alloc] initWithName:notificationName object:notificationSender attachedToOwner:owner action:actionBlock];
 }
 
++ (instancetype)observerForName:(NSString *)notificationName object:(id)notificationSender attachedToOwner:(id)owner options:(DMNotificationObserverOptions)options action:(DMNotificationActionBlock)actionBlock;
+{
+    return [[self alloc] initWithName:notificationName object:notificationSender attachedToOwner:owner notificationCenter:[NSNotificationCenter defaultCenter] options:options action:actionBlock];
+}
+
++ (instancetype)coalescingObserverForName:(NSString *)notificationName object:(id)notificationSender attachedToOwner:(id)owner interval:(NSTimeInterval)interval queue:(dispatch_queue_t)queue action:(DMCoalescedNotificationActionBlock)coalescedActionBlock;
+{
+    NSParameterAssert(owner && coalescedActionBlock);
+#ifndef NS_BLOCK_ASSERTIONS
+    if ([DMBlockUtilities isObject:owner implicitlyRetainedByBlock:coalescedActionBlock])
+        DMBlockRetainCycleDetected([NSString stringWithFormat:@"%s action captures owner; use localSelf (localOwner) parameter to fix.", __func__]);
+#endif
+
+    __block __weak DMNotificationObserver *weakObserver = nil;
+    DMActionCoalescer *const coalescer = [[DMActionCoalescer alloc] initWithInterval:interval queue:(queue ? : dispatch_get_main_queue()) flushBlock:^(NSUInteger triggerCount, NSArray *distinctObjects) {
+        DMNotificationObserver *const observer = weakObserver;
+        [observer _performWithOwner:^(id localOwner) {
+            coalescedActionBlock(triggerCount, distinctObjects, localOwner, observer);
+        }];
+    }];
+
+    DMNotificationObserver *const observer = [[self alloc] initWithName:notificationName object:notificationSender attachedToOwner:owner action:^(NSNotification *notification, id localOwner, DMNotificationObserver *observer) {
+        [coalescer addTriggerWithObject:notification.object];
+    }];
+    observer->_coalescer = coalescer;
+    weakObserver = observer;
+    return observer;
+}
+
 - (id)initWithName:(NSString *)notificationName object:(id)notificationSender attachedToOwner:(id)owner action:(DMNotificationActionBlock)actionBlock;
 {
     return [self initWithName:notificationName object:notificationSender attachedToOwner:owner notificationCenter:[NSNotificationCenter defaultCenter] action:actionBlock];
 }
 
-- (id)initWithName:(NSString *)notificationName object:(id)notificationSender attachedToOwner:(id)owner notificationCenter:(NSNotificationCenter *)notificationCenter action:(DMNotificationActionBlock)actionBlock; // Designated initializer
+- (id)initWithName:(NSString *)notificationName object:(id)notificationSender attachedToOwner:(id)owner notificationCenter:(NSNotificationCenter *)notificationCenter action:(DMNotificationActionBlock)actionBlock;
+{
+    return [self initWithName:notificationName object:notificationSender attachedToOwner:owner notificationCenter:notificationCenter options:0 action:actionBlock];
+}
+
+- (id)initWithName:(NSString *)notificationName object:(id)notificationSender attachedToOwner:(id)owner notificationCenter:(NSNotificationCenter *)notificationCenter options:(DMNotificationObserverOptions)options action:(DMNotificationActionBlock)actionBlock; // Designated initializer
+{
+    return [self _initWithName:notificationName object:notificationSender attachedToOwner:owner notificationCenter:notificationCenter options:options deliveryQueue:nil deliveryOperationQueue:nil pendingNotifications:nil action:actionBlock];
+}
+
+- (id)initWithName:(NSString *)notificationName object:(id)notificationSender attachedToOwner:(id)owner notificationCenter:(NSNotificationCenter *)notificationCenter deliveryQueue:(dispatch_queue_t)deliveryQueue maxPendingNotifications:(NSUInteger)maxPendingNotifications overflowPolicy:(DMEventOverflowPolicy)overflowPolicy action:(DMNotificationActionBlock)actionBlock;
 {
-    NSParameterAssert(owner && notificationCenter && actionBlock);
+    NSParameterAssert(deliveryQueue && maxPendingNotifications);
+    DMEventRing *const pendingNotifications = [[DMEventRing alloc] initWithCapacity:maxPendingNotifications overflowPolicy:overflowPolicy];
+    return [self _initWithName:notificationName object:notificationSender attachedToOwner:owner notificationCenter:notificationCenter options:0 deliveryQueue:deliveryQueue deliveryOperationQueue:nil pendingNotifications:pendingNotifications action:actionBlock];
+}
+
+- (id)initWithName:(NSString *)notificationName object:(id)notificationSender attachedToOwner:(id)owner notificationCenter:(NSNotificationCenter *)notificationCenter deliveryOperationQueue:(NSOperationQueue *)deliveryOperationQueue maxPendingNotifications:(NSUInteger)maxPendingNotifications overflowPolicy:(DMEventOverflowPolicy)overflowPolicy action:(DMNotificationActionBlock)actionBlock;
+{
+    NSParameterAssert(deliveryOperationQueue && maxPendingNotifications);
+    DMEventRing *const pendingNotifications = [[DMEventRing alloc] initWithCapacity:maxPendingNotifications overflowPolicy:overflowPolicy];
+    return [self _initWithName:notificationName object:notificationSender attachedToOwner:owner notificationCenter:notificationCenter options:0 deliveryQueue:nil deliveryOperationQueue:deliveryOperationQueue pendingNotifications:pendingNotifications action:actionBlock];
+}
+
++ (DMObservationStream *)streamForName:(NSString *)notificationName object:(id)notificationSender attachedToOwner:(id)owner notificationCenter:(NSNotificationCenter *)notificationCenter capacity:(NSUInteger)capacity overflowPolicy:(DMEventOverflowPolicy)overflowPolicy;
+{
+    NSParameterAssert(capacity);
+    DMEventRing *const eventRing = [[DMEventRing alloc] initWithCapacity:capacity overflowPolicy:overflowPolicy];
+    DMObservationStream *const stream = [[DMObservationStream alloc] initWithEventRing:eventRing attachedToOwner:owner];
+    [stream addSourceObserver:[[self alloc] _initWithName:notificationName object:notificationSender attachedToOwner:owner notificationCenter:notificationCenter options:0 deliveryQueue:nil deliveryOperationQueue:nil pendingNotifications:eventRing action:nil]];
+    return stream;
+}
+
+- (void)fireAction:(NSNotification *)notification;
+{
+    if (_pendingNotifications)
+        [self _enqueueNotification:notification];
+    else
+        [self _fireActionNow:notification];
+}
+
+
+#pragma mark Private
+
+- (id)_initWithName:(NSString *)notificationName object:(id)notificationSender attachedToOwner:(id)owner notificationCenter:(NSNotificationCenter *)notificationCenter options:(DMNotificationObserverOptions)options deliveryQueue:(dispatch_queue_t)deliveryQueue deliveryOperationQueue:(NSOperationQueue *)deliveryOperationQueue pendingNotifications:(DMEventRing *)pendingNotifications action:(DMNotificationActionBlock)actionBlock;
+{
+    NSParameterAssert(owner && notificationCenter && (actionBlock || pendingNotifications)); // No action for streams
     if (!(self = [super init]))
         return nil;
     
+    _options = options;
+    if (_options & DMNotificationObserverConcurrentDelivery)
+        _concurrentFiresDrained = dispatch_semaphore_create(0);
+    _deliveryQueue = deliveryQueue;
+    _deliveryOperationQueue = deliveryOperationQueue;
+    _pendingNotifications = pendingNotifications;
+    if (_deliveryQueue) // Lets us tell when a notification is posted from the delivery queue (so mustn't block waiting for it)
+        dispatch_queue_set_specific(_deliveryQueue, (__bridge const void *)self, (__bridge void *)self, NULL);
     _unsafeOwner = owner;
     _notificationCenter = notificationCenter;
     _notificationName = [notificationName copy];
@@ -113,23 +247,137 @@
     [_notificationCenter addObserver:self selector:@selector(fireAction:) name:_notificationName object:notificationSender];
     
 #ifndef NS_BLOCK_ASSERTIONS
-    if ([DMBlockUtilities isObject:owner implicitlyRetainedByBlock:actionBlock])
+    if (actionBlock && [DMBlockUtilities isObject:owner implicitlyRetainedByBlock:actionBlock])
         DMBlockRetainCycleDetected([NSString stringWithFormat:@"%s action captures owner; use localSelf (localOwner) parameter to fix.", __func__]);
 #endif
 
     return self;
 }
 
-- (void)fireAction:(NSNotification *)notification;
+- (void)_fireActionNow:(NSNotification *)notification;
+{
+    [self _performWithOwner:^(id owner) {
+        DMNotificationActionBlock actionBlock = [_actionBlock copy]; // Use a local reference, as the actionBock could call -invalidate on us
+        actionBlock(notification, owner, self);
+    }];
+}
+
+static void drainPendingNotifications(void *observerAsContext)
+{
+    DMNotificationObserver *const observer = (__bridge_transfer DMNotificationObserver *)observerAsContext;
+    [observer _drainPendingNotifications];
+}
+
+- (void)_enqueueNotification:(NSNotification *)notification;
 {
+    if (!_deliveryQueue && !_deliveryOperationQueue) { // A stream; its consumer drains when it's ready
+        [_pendingNotifications appendEvent:notification mayBlock:YES shouldWakeConsumer:NULL];
+        return;
+    }
+
+    const BOOL onDeliveryQueue = (_deliveryQueue ? dispatch_get_specific((__bridge const void *)self) != NULL : [NSOperationQueue currentQueue] == _deliveryOperationQueue);
+    BOOL shouldWakeConsumer = NO;
+    if (![_pendingNotifications appendEvent:notification mayBlock:!onDeliveryQueue shouldWakeConsumer:&shouldWakeConsumer] || !shouldWakeConsumer)
+        return;
+
+    // One drain per burst. Use the function variant of dispatch_async, so scheduling doesn't allocate a block.
+    if (_deliveryQueue)
+        dispatch_async_f(_deliveryQueue, (__bridge_retained void *)self, drainPendingNotifications);
+    else
+        [_deliveryOperationQueue addOperationWithBlock:^{ [self _drainPendingNotifications]; }];
+}
+
+- (void)_drainPendingNotifications;
+{
+#define DRAIN_BATCH_SIZE  (32)
+    __strong id notifications[DRAIN_BATCH_SIZE];
+    NSUInteger count;
+    // Drain until the ring is found empty, which marks it as needing a wake-up for the next burst
+    while ((count = [_pendingNotifications drainEvents:notifications maxCount:DRAIN_BATCH_SIZE overflowCount:NULL]))
+        for (NSUInteger i = 0; i < count; i++) {
+            NSNotification *const notification = notifications[i];
+            notifications[i] = nil;
+            [self _fireActionNow:notification];
+        }
+}
+
+- (void)_performWithOwner:(void (^)(id owner))block; // Runs block unless invalidated, serialized against invalidation according to our options
+{
+    if (_options & DMNotificationObserverConcurrentDelivery) {
+        [self _performConcurrentlyWithOwner:block];
+        return;
+    }
+
     @synchronized (self) {
         if (_invalidated)
             return;
-        
+
         // If our owner has deallocated, we should be invalidated at this point. Since we're not, our owner must still be alive.
-        DMNotificationActionBlock actionBlock = [_actionBlock copy]; // Use a local reference, as the actionBock could call -invalidate on us
-        actionBlock(notification, _unsafeOwner, self);
+        const DMObserverStatisticsFire fire = DMObserverStatisticsFireWillBegin(_unsafeOwner);
+        block(_unsafeOwner);
+        DMObserverStatisticsFireDidEnd(self, fire);
+    }
+}
+
+- (void)_performConcurrentlyWithOwner:(void (^)(id owner))block;
+{
+    // Count ourselves in before checking _invalidated; invalidation does the reverse. Both are sequentially consistent, so at least one of us sees the other.
+    __atomic_add_fetch(&_concurrentFireCount, 1, __ATOMIC_SEQ_CST);
+    @try {
+        if (!__atomic_load_n(&_invalidated, __ATOMIC_SEQ_CST)) {
+            struct DMConcurrentFireFrame frame = {self, currentConcurrentFireFrame};
+            currentConcurrentFireFrame = &frame;
+            @try {
+                // Invalidation waits for us before tearing down the action block and owner, unless it's called from within this action (which holds a local reference).
+                const DMObserverStatisticsFire fire = DMObserverStatisticsFireWillBegin(_unsafeOwner);
+                block(_unsafeOwner);
+                DMObserverStatisticsFireDidEnd(self, fire);
+            } @finally { // Like @synchronized, don't leave anything behind if the action throws
+                currentConcurrentFireFrame = frame.previous;
+            }
+        }
+    } @finally {
+        __atomic_sub_fetch(&_concurrentFireCount, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&_invalidated, __ATOMIC_SEQ_CST))
+            dispatch_semaphore_signal(_concurrentFiresDrained);
     }
 }
 
+- (BOOL)_markInvalidated; // Returns NO if already invalidated
+{
+    if (_options & DMNotificationObserverConcurrentDelivery) {
+        if (__atomic_exchange_n(&_invalidated, YES, __ATOMIC_SEQ_CST))
+            return NO;
+
+        // No new actions will start now. Wait for those running on other threads; ones on this thread are further up the stack.
+        uint32_t actionsOnThisThread = 0;
+        for (struct DMConcurrentFireFrame *frame = currentConcurrentFireFrame; frame; frame = frame->previous)
+            if (frame->observer == self)
+                actionsOnThisThread++;
+        while (__atomic_load_n(&_concurrentFireCount, __ATOMIC_SEQ_CST) > actionsOnThisThread)
+            dispatch_semaphore_wait(_concurrentFiresDrained, DISPATCH_TIME_FOREVER);
+        return YES;
+    }
+
+    @synchronized (self) {
+        if (_invalidated)
+            return NO;
+        _invalidated = YES;
+        return YES;
+    }
+}
+
+- (void)_discardObservationState;
+{
+    [_pendingNotifications cancel];
+    [_coalescer cancel];
+    _coalescer = nil;
+    if (_deliveryQueue)
+        dispatch_queue_set_specific(_deliveryQueue, (__bridge const void *)self, NULL, NULL);
+    _actionBlock = nil;
+    _notificationName = nil;
+    _unsafeNotificationSender = nil;
+    _unsafeOwner = nil;
+}
+
 @end
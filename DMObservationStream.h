@@ -0,0 +1,50 @@
+//
+//  DMObservationStream.h
+//  DMAutoInvalidation
+//
+//  Created by agent on 2026-10-17.
+//  Copyright (c) 2026 Delicious Monster Software.
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+#import "DMAutoInvalidation.h"
+#import "DMEventRing.h"
+
+
+/* A DMObservationStream collects events from one or more source observers, which append to it instead of running an
+ * action, so a consumer can pull everything pending in one go (say, at the top of each work cycle) rather than being
+ * called back once per event. Get one from an observer class's stream factory, such as
+ * +[DMNotificationObserver streamForName:...] or +[DMKeyValueObserver streamWithKeyPath:...].
+ *
+ * The stream is attached to the owner like any other observer, so it's invalidated when the owner deallocates;
+ * invalidating it invalidates its source observers and discards pending events. Sources append on whichever thread
+ * the event happens; only one thread may drain at a time. With DMEventOverflowBlockPoster, events mustn't be posted
+ * from the consuming thread, as it would wait for itself (key-value streams don't offer it for that reason). */
+@interface DMObservationStream : NSObject <DMAutoInvalidation>
+
+- (id)init UNAVAILABLE_ATTRIBUTE;
+
+/* For observer classes offering a stream: sources append to the ring, and should stop once invalidated. */
+- (id)initWithEventRing:(DMEventRing *)eventRing attachedToOwner:(id)owner __attribute__((nonnull(1,2)));
+- (void)addSourceObserver:(id<DMAutoInvalidation>)sourceObserver; // Invalidated with the stream (immediately if it already is)
+
+@property (readonly, nonatomic) NSUInteger capacity;
+@property (readonly, nonatomic) DMEventOverflowPolicy overflowPolicy;
+
+/* Moves up to maxCount pending events, oldest first, into the caller's buffer and returns the number moved; doesn't
+ * allocate. *outOverflowCount (if non-NULL) is set to the number of events dropped or merged since the last drain.
+ * Returns zero once invalidated. */
+- (NSUInteger)drainEvents:(__strong id *)events maxCount:(NSUInteger)maxCount overflowCount:(NSUInteger *)outOverflowCount __attribute__((nonnull(1)));
+
+- (void)invalidate;
+
+@end
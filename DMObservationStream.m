@@ -0,0 +1,108 @@
+//
+//  DMObservationStream.m
+//  DMAutoInvalidation
+//
+//  Created by agent on 2026-10-17.
+//  Copyright (c) 2026 Delicious Monster Software.
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#import "DMObservationStream.h"
+
+#if !__has_feature(objc_arc)
+#error This file must be compiled with Automatic Reference Counting (ARC).
+#endif
+
+
+@implementation DMObservationStream {
+    DMEventRing *_eventRing;
+    dispatch_semaphore_t _mutex; // guards the following
+    BOOL _invalidated;
+    NSMutableArray *_sourceObservers;
+
+    struct DMObserverInvalidatorLink _invalidatorLink;
+}
+
+#pragma mark NSObject
+
+- (void)dealloc;
+{
+    if (_mutex) // nil if -init was called
+        [self invalidate];
+}
+
+- (id)init;
+{ NSAssert(NO, @"Bad initializer; use a stream factory of an observer class"); return nil; }
+
+
+#pragma mark <DMAutoInvalidation>
+
+- (void)invalidate;
+{
+    BOOL wasInvalidated;
+    NSArray *sourceObservers;
+    dispatch_semaphore_wait(_mutex, DISPATCH_TIME_FOREVER); {
+        wasInvalidated = _invalidated;
+        _invalidated = YES;
+        sourceObservers = _sourceObservers;
+        _sourceObservers = nil;
+    } dispatch_semaphore_signal(_mutex);
+    if (wasInvalidated)
+        return;
+
+    [_eventRing cancel];
+    for (id<DMAutoInvalidation> sourceObserver in sourceObservers)
+        [sourceObserver invalidate];
+    [DMObserverInvalidator observerDidInvalidate:self];
+}
+
+- (struct DMObserverInvalidatorLink *)observerInvalidatorLink;
+{ return &_invalidatorLink; }
+
+
+#pragma mark API
+
+- (id)initWithEventRing:(DMEventRing *)eventRing attachedToOwner:(id)owner;
+{
+    NSParameterAssert(eventRing && owner);
+    if (!(self = [super init]))
+        return nil;
+    _eventRing = eventRing;
+    _mutex = dispatch_semaphore_create(1);
+    _sourceObservers = [NSMutableArray arrayWithCapacity:1];
+    [DMObserverInvalidator attachObserver:self toOwner:owner];
+    return self;
+}
+
+- (void)addSourceObserver:(id<DMAutoInvalidation>)sourceObserver;
+{
+    NSParameterAssert(sourceObserver);
+    BOOL invalidated;
+    dispatch_semaphore_wait(_mutex, DISPATCH_TIME_FOREVER); {
+        invalidated = _invalidated;
+        if (!invalidated)
+            [_sourceObservers addObject:sourceObserver];
+    } dispatch_semaphore_signal(_mutex);
+
+    if (invalidated)
+        [sourceObserver invalidate];
+}
+
+- (NSUInteger)capacity;
+{ return _eventRing.capacity; }
+
+- (DMEventOverflowPolicy)overflowPolicy;
+{ return _eventRing.overflowPolicy; }
+
+- (NSUInteger)drainEvents:(__strong id *)events maxCount:(NSUInteger)maxCount overflowCount:(NSUInteger *)outOverflowCount;
+{ return [_eventRing drainEvents:events maxCount:maxCount overflowCount:outOverflowCount]; }
+
+@end
@@ -0,0 +1,82 @@
+//
+//  DMObserverStatistics.h
+//  DMAutoInvalidation
+//
+//  Created by agent on 2026-10-17.
+//  Copyright (c) 2026 Delicious Monster Software.
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+
+
+/* Opt-in counts of observers attached, invalidated, torn down with their owner and fired, by observer class and owner
+ * class, with a histogram of how long actions take. Each thread counts into its own table (taking only its own,
+ * uncontended, lock); a snapshot merges them. When disabled, recording is a test of a global flag. */
+@interface DMObserverStatistics : NSObject
+
++ (BOOL)isEnabled;
++ (void)setEnabled:(BOOL)enabled; // Counts recorded so far are kept
+
+/* A property list: @{@"observers": array of dictionaries, one per (observer class, owner class) with keys
+ *      observerClass, ownerClass: class names
+ *      attached, invalidated: counts while enabled; invalidated includes teardowns
+ *      ownerDeallocTeardowns: observers invalidated because their owner deallocated
+ *      live: attached - invalidated (so only meaningful if enabled before the observers were created)
+ *      fired: actions run
+ *      fireNanoseconds: total time in actions
+ *      fireLatencyHistogram: array of counts; element i counts actions taking [2^i, 2^(i+1)) ns (the last is open-ended)
+ * } */
++ (NSDictionary *)snapshot;
+
++ (void)reset;
+
+@end
+
+
+/* For observer implementations. */
+typedef NS_ENUM(NSUInteger, DMObserverStatisticsEvent) {
+    DMObserverStatisticsEventAttach,
+    DMObserverStatisticsEventInvalidate,
+    DMObserverStatisticsEventOwnerDeallocTeardown,
+    DMObserverStatisticsEventCount
+};
+
+extern BOOL DMObserverStatisticsEnabled;
+extern void DMObserverStatisticsRecordEvents(DMObserverStatisticsEvent event, Class observerClass, Class ownerClass, NSUInteger count);
+extern uint64_t DMObserverStatisticsCurrentTime(void);
+extern void DMObserverStatisticsRecordFire(Class observerClass, Class ownerClass, uint64_t startTime);
+
+static inline void DMObserverStatisticsRecordEvent(DMObserverStatisticsEvent event, id observer, Class ownerClass)
+{
+    if (__builtin_expect(DMObserverStatisticsEnabled, 0))
+        DMObserverStatisticsRecordEvents(event, [observer class], ownerClass, 1);
+}
+
+/* Bracket running an action: DMObserverStatisticsFire fire = DMObserverStatisticsFireWillBegin(owner); ...; DMObserverStatisticsFireDidEnd(self, fire);
+ * The owner's class is taken first, as the action may release the owner. */
+typedef struct {
+    uint64_t startTime; // 0 if disabled
+    __unsafe_unretained Class ownerClass;
+} DMObserverStatisticsFire;
+
+static inline DMObserverStatisticsFire DMObserverStatisticsFireWillBegin(id owner)
+{
+    if (__builtin_expect(DMObserverStatisticsEnabled, 0))
+        return (DMObserverStatisticsFire){DMObserverStatisticsCurrentTime(), [owner class]};
+    return (DMObserverStatisticsFire){0, Nil};
+}
+
+static inline void DMObserverStatisticsFireDidEnd(id observer, DMObserverStatisticsFire fire)
+{
+    if (__builtin_expect(fire.startTime != 0, 0))
+        DMObserverStatisticsRecordFire([observer class], fire.ownerClass, fire.startTime);
+}
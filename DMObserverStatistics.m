@@ -0,0 +1,240 @@
+//
+//  DMObserverStatistics.m
+//  DMAutoInvalidation
+//
+//  Created by agent on 2026-10-17.
+//  Copyright (c) 2026 Delicious Monster Software.
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#import "DMObserverStatistics.h"
+
+#import <pthread.h>
+#if __APPLE__
+#import <mach/mach_time.h>
+#else
+#import <time.h>
+#endif
+
+#if !__has_feature(objc_arc)
+#error This file must be compiled with Automatic Reference Counting (ARC).
+#endif
+
+
+#define DMLatencyBucketCount 32
+#define DMStatisticsTableSize 128 // per thread; must be a power of two. Pairs beyond this are counted under (nil, nil).
+
+struct DMStatisticsEntry {
+    __unsafe_unretained Class observerClass; // Nil if unused
+    __unsafe_unretained Class ownerClass;
+    uint64_t eventCounts[DMObserverStatisticsEventCount];
+    uint64_t fireCount;
+    uint64_t fireNanoseconds;
+    uint32_t fireLatencyHistogram[DMLatencyBucketCount];
+};
+
+struct DMStatisticsThreadRecord {
+    pthread_mutex_t mutex; // only contended by snapshots
+    struct DMStatisticsThreadRecord *next;
+    struct DMStatisticsEntry entries[DMStatisticsTableSize + 1]; // the last catches overflow
+};
+
+
+BOOL DMObserverStatisticsEnabled;
+
+static pthread_mutex_t threadRecordsMutex = PTHREAD_MUTEX_INITIALIZER;
+static struct DMStatisticsThreadRecord *threadRecords; // guarded by threadRecordsMutex
+static struct DMStatisticsThreadRecord retiredThreadsRecord = {PTHREAD_MUTEX_INITIALIZER}; // counts of exited threads, folded in
+static pthread_key_t threadRecordKey; // only for its destructor
+static pthread_once_t threadRecordKeyOnce = PTHREAD_ONCE_INIT;
+static __thread struct DMStatisticsThreadRecord *currentThreadRecord;
+
+
+static void mergeEntry(struct DMStatisticsEntry *destination, const struct DMStatisticsEntry *source)
+{
+    for (NSUInteger i = 0; i < DMObserverStatisticsEventCount; i++)
+        destination->eventCounts[i] += source->eventCounts[i];
+    destination->fireCount += source->fireCount;
+    destination->fireNanoseconds += source->fireNanoseconds;
+    for (NSUInteger i = 0; i < DMLatencyBucketCount; i++)
+        destination->fireLatencyHistogram[i] += source->fireLatencyHistogram[i];
+}
+
+static struct DMStatisticsEntry *entryForClasses(struct DMStatisticsThreadRecord *record, Class observerClass, Class ownerClass) // call with record->mutex held
+{
+    const uintptr_t hash = ((uintptr_t)(__bridge void *)observerClass ^ ((uintptr_t)(__bridge void *)ownerClass * 31)) >> 4;
+    for (NSUInteger probe = 0; probe < DMStatisticsTableSize; probe++) {
+        struct DMStatisticsEntry *const entry = &record->entries[(hash + probe) & (DMStatisticsTableSize - 1)];
+        if (!entry->observerClass) {
+            entry->observerClass = observerClass;
+            entry->ownerClass = ownerClass;
+            return entry;
+        }
+        if (entry->observerClass == observerClass && entry->ownerClass == ownerClass)
+            return entry;
+    }
+    return &record->entries[DMStatisticsTableSize];
+}
+
+static void retireThreadRecord(void *recordAsContext)
+{
+    struct DMStatisticsThreadRecord *const record = recordAsContext;
+    currentThreadRecord = NULL;
+    pthread_mutex_lock(&threadRecordsMutex); {
+        for (struct DMStatisticsThreadRecord **link = &threadRecords; *link; link = &(*link)->next)
+            if (*link == record) {
+                *link = record->next;
+                break;
+            }
+        pthread_mutex_lock(&retiredThreadsRecord.mutex);
+        for (NSUInteger i = 0; i <= DMStatisticsTableSize; i++)
+            if (record->entries[i].observerClass || i == DMStatisticsTableSize)
+                mergeEntry((i == DMStatisticsTableSize) ? &retiredThreadsRecord.entries[DMStatisticsTableSize] : entryForClasses(&retiredThreadsRecord, record->entries[i].observerClass, record->entries[i].ownerClass), &record->entries[i]);
+        pthread_mutex_unlock(&retiredThreadsRecord.mutex);
+    } pthread_mutex_unlock(&threadRecordsMutex);
+    pthread_mutex_destroy(&record->mutex);
+    free(record);
+}
+
+static void createThreadRecordKey(void)
+{ pthread_key_create(&threadRecordKey, retireThreadRecord); }
+
+static struct DMStatisticsThreadRecord *threadRecord(void)
+{
+    struct DMStatisticsThreadRecord *record = currentThreadRecord;
+    if (__builtin_expect(record != NULL, 1))
+        return record;
+
+    record = calloc(1, sizeof(*record));
+    pthread_mutex_init(&record->mutex, NULL);
+    pthread_once(&threadRecordKeyOnce, createThreadRecordKey);
+    pthread_setspecific(threadRecordKey, record);
+    pthread_mutex_lock(&threadRecordsMutex); {
+        record->next = threadRecords;
+        threadRecords = record;
+    } pthread_mutex_unlock(&threadRecordsMutex);
+    return (currentThreadRecord = record);
+}
+
+
+void DMObserverStatisticsRecordEvents(DMObserverStatisticsEvent event, Class observerClass, Class ownerClass, NSUInteger count)
+{
+    NSCParameterAssert(event < DMObserverStatisticsEventCount);
+    struct DMStatisticsThreadRecord *const record = threadRecord();
+    pthread_mutex_lock(&record->mutex); {
+        entryForClasses(record, observerClass, ownerClass)->eventCounts[event] += count;
+    } pthread_mutex_unlock(&record->mutex);
+}
+
+uint64_t DMObserverStatisticsCurrentTime(void) // nanoseconds
+{
+#if __APPLE__
+    static mach_timebase_info_data_t timebase;
+    if (!timebase.denom)
+        mach_timebase_info(&timebase);
+    return mach_absolute_time() * timebase.numer / timebase.denom;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * NSEC_PER_SEC + (uint64_t)now.tv_nsec;
+#endif
+}
+
+void DMObserverStatisticsRecordFire(Class observerClass, Class ownerClass, uint64_t startTime)
+{
+    const uint64_t nanoseconds = DMObserverStatisticsCurrentTime() - startTime;
+    NSUInteger bucket = 0;
+    while (bucket < DMLatencyBucketCount - 1 && (nanoseconds >> (bucket + 1)))
+        bucket++;
+
+    struct DMStatisticsThreadRecord *const record = threadRecord();
+    pthread_mutex_lock(&record->mutex); {
+        struct DMStatisticsEntry *const entry = entryForClasses(record, observerClass, ownerClass);
+        entry->fireCount++;
+        entry->fireNanoseconds += nanoseconds;
+        entry->fireLatencyHistogram[bucket]++;
+    } pthread_mutex_unlock(&record->mutex);
+}
+
+
+@implementation DMObserverStatistics
+
+#pragma mark API
+
++ (BOOL)isEnabled;
+{ return DMObserverStatisticsEnabled; }
+
++ (void)setEnabled:(BOOL)enabled;
+{ DMObserverStatisticsEnabled = enabled; }
+
++ (NSDictionary *)snapshot;
+{
+    // Merge by class pair; a pair can have an entry on every thread
+    NSMutableDictionary *const mergedEntriesByClassNames = [NSMutableDictionary dictionary];
+    void (^mergeRecord)(struct DMStatisticsThreadRecord *) = ^(struct DMStatisticsThreadRecord *record) {
+        pthread_mutex_lock(&record->mutex);
+        for (NSUInteger i = 0; i <= DMStatisticsTableSize; i++) {
+            const struct DMStatisticsEntry *const entry = &record->entries[i];
+            if (!entry->observerClass && i != DMStatisticsTableSize)
+                continue;
+            NSArray *const classNames = @[(entry->observerClass ? NSStringFromClass(entry->observerClass) : @"(other)"), (entry->ownerClass ? NSStringFromClass(entry->ownerClass) : @"(other)")];
+            NSMutableData *mergedEntry = mergedEntriesByClassNames[classNames];
+            if (!mergedEntry)
+                mergedEntriesByClassNames[classNames] = mergedEntry = [NSMutableData dataWithLength:sizeof(struct DMStatisticsEntry)];
+            mergeEntry(mergedEntry.mutableBytes, entry);
+        }
+        pthread_mutex_unlock(&record->mutex);
+    };
+    pthread_mutex_lock(&threadRecordsMutex); {
+        for (struct DMStatisticsThreadRecord *record = threadRecords; record; record = record->next)
+            mergeRecord(record);
+        mergeRecord(&retiredThreadsRecord);
+    } pthread_mutex_unlock(&threadRecordsMutex);
+
+    NSMutableArray *const observers = [NSMutableArray arrayWithCapacity:mergedEntriesByClassNames.count];
+    [mergedEntriesByClassNames enumerateKeysAndObjectsUsingBlock:^(NSArray *classNames, NSData *mergedEntry, BOOL *stop) {
+        const struct DMStatisticsEntry *const entry = mergedEntry.bytes;
+        const uint64_t *const eventCounts = entry->eventCounts;
+        if (!entry->fireCount && !eventCounts[DMObserverStatisticsEventAttach] && !eventCounts[DMObserverStatisticsEventInvalidate])
+            return; // an empty overflow entry
+        NSMutableArray *const histogram = [NSMutableArray arrayWithCapacity:DMLatencyBucketCount];
+        for (NSUInteger i = 0; i < DMLatencyBucketCount; i++)
+            [histogram addObject:@(entry->fireLatencyHistogram[i])];
+        [observers addObject:@{
+            @"observerClass": classNames[0],
+            @"ownerClass": classNames[1],
+            @"attached": @(eventCounts[DMObserverStatisticsEventAttach]),
+            @"invalidated": @(eventCounts[DMObserverStatisticsEventInvalidate]),
+            @"ownerDeallocTeardowns": @(eventCounts[DMObserverStatisticsEventOwnerDeallocTeardown]),
+            @"live": @((int64_t)(eventCounts[DMObserverStatisticsEventAttach] - eventCounts[DMObserverStatisticsEventInvalidate])),
+            @"fired": @(entry->fireCount),
+            @"fireNanoseconds": @(entry->fireNanoseconds),
+            @"fireLatencyHistogram": histogram,
+        }];
+    }];
+    return @{@"observers": observers};
+}
+
++ (void)reset;
+{
+    pthread_mutex_lock(&threadRecordsMutex); {
+        for (struct DMStatisticsThreadRecord *record = threadRecords; record; record = record->next) {
+            pthread_mutex_lock(&record->mutex);
+            memset(record->entries, 0, sizeof(record->entries));
+            pthread_mutex_unlock(&record->mutex);
+        }
+        pthread_mutex_lock(&retiredThreadsRecord.mutex);
+        memset(retiredThreadsRecord.entries, 0, sizeof(retiredThreadsRecord.entries));
+        pthread_mutex_unlock(&retiredThreadsRecord.mutex);
+    } pthread_mutex_unlock(&threadRecordsMutex);
+}
+
+@end
@@ -0,0 +1,38 @@
+//
+//  DMRelationshipTraversal.h
+//  DMAutoInvalidation
+//
+//  Created by agent on 2026-10-17.
+//  Copyright (c) 2026 Delicious Monster Software.
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+
+
+/* Called once per level with the objects whose `key` is about to be read, so their values can be loaded in one go
+ * (for managed objects, one fetch with relationship prefetching instead of a fault per object). */
+typedef void(^DMRelationshipPrefetchBlock)(NSString *key, NSSet *objects);
+
+
+/* Follows a key path of relationships from many objects at once, a level at a time: all objects at one level are read
+ * together and each object is read at most once, however many paths lead to it. Values can be nil, a single object
+ * (to-one), or an NSSet or NSOrderedSet (to-many). Values read are remembered for the traversal's lifetime, so later
+ * calls on the same traversal only read objects not seen before; make a new one when the objects may have changed. */
+@interface DMRelationshipTraversal : NSObject
+
+- (id)initWithKeyPath:(NSString *)keyPath prefetchBlock:(DMRelationshipPrefetchBlock)prefetchBlock __attribute__((nonnull(1)));
+
+@property (readonly, nonatomic, copy) NSString *keyPath;
+
+- (NSSet *)destinationsOfObjects:(id<NSFastEnumeration>)objects; // Union of what the key path reaches from each
+
+@end
@@ -0,0 +1,94 @@
+//
+//  DMRelationshipTraversal.m
+//  DMAutoInvalidation
+//
+//  Created by agent on 2026-10-17.
+//  Copyright (c) 2026 Delicious Monster Software.
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#import "DMRelationshipTraversal.h"
+
+#if !__has_feature(objc_arc)
+#error This file must be compiled with Automatic Reference Counting (ARC).
+#endif
+
+
+static NSSet *relationshipAsSet(id relationshipValue)
+{
+    if (!relationshipValue)
+        return [NSSet set];
+    else if ([relationshipValue isKindOfClass:[NSSet class]])
+        return relationshipValue;
+    else if ([relationshipValue isKindOfClass:[NSOrderedSet class]])
+        return ((NSOrderedSet *)relationshipValue).set;
+    else
+        return [NSSet setWithObject:relationshipValue]; // assume to-one
+}
+
+
+@implementation DMRelationshipTraversal {
+    NSArray *_keys;
+    DMRelationshipPrefetchBlock _prefetchBlock;
+    NSArray *_destinationsByObjectForLevel; // an NSMapTable (by identity) per key
+}
+
+@synthesize keyPath = _keyPath;
+
+#pragma mark API
+
+- (id)initWithKeyPath:(NSString *)keyPath prefetchBlock:(DMRelationshipPrefetchBlock)prefetchBlock;
+{
+    NSParameterAssert(keyPath.length);
+    if (!(self = [super init]))
+        return nil;
+    _keyPath = [keyPath copy];
+    _keys = [_keyPath componentsSeparatedByString:@"."];
+    _prefetchBlock = [prefetchBlock copy];
+
+    NSMutableArray *const destinationsByObjectForLevel = [NSMutableArray arrayWithCapacity:_keys.count];
+    for (NSUInteger level = 0; level < _keys.count; level++)
+        [destinationsByObjectForLevel addObject:[[NSMapTable alloc] initWithKeyOptions:(NSPointerFunctionsStrongMemory | NSPointerFunctionsObjectPointerPersonality) valueOptions:NSPointerFunctionsStrongMemory capacity:0]];
+    _destinationsByObjectForLevel = destinationsByObjectForLevel;
+    return self;
+}
+
+- (NSSet *)destinationsOfObjects:(id<NSFastEnumeration>)objects;
+{
+    NSMutableSet *frontier = [NSMutableSet new];
+    for (id object in objects)
+        [frontier addObject:object];
+
+    for (NSUInteger level = 0; level < _keys.count && frontier.count; level++) {
+        NSString *const key = _keys[level];
+        NSMapTable *const destinationsByObject = _destinationsByObjectForLevel[level];
+
+        NSMutableSet *const unreadObjects = [NSMutableSet new];
+        for (id object in frontier)
+            if (![destinationsByObject objectForKey:object])
+                [unreadObjects addObject:object];
+        if (unreadObjects.count) {
+            if (_prefetchBlock)
+                _prefetchBlock(key, unreadObjects);
+            for (id object in unreadObjects)
+                [destinationsByObject setObject:relationshipAsSet([object valueForKey:key]) forKey:object];
+        }
+
+        // The frontier is a set, so an object reached along several paths is only followed once
+        NSMutableSet *const nextFrontier = [NSMutableSet new];
+        for (id object in frontier)
+            [nextFrontier unionSet:[destinationsByObject objectForKey:object]];
+        frontier = nextFrontier;
+    }
+    return frontier;
+}
+
+@end
@@ -18,18 +18,59 @@
 #import <Foundation/Foundation.h>
 #import "DMAutoInvalidation.h"
 
+#if __APPLE__
+#import <CoreServices/CoreServices.h>
+#else
+typedef uint64_t FSEventStreamEventId;
+#define kFSEventStreamEventIdSinceNow 0xFFFFFFFFFFFFFFFFULL
+#endif
+
+/* What happened to a path in a batch. Several kinds may be set when events for one path are coalesced. */
+typedef NS_OPTIONS(NSUInteger, LIFilesystemEventKind) {
+    LIFilesystemEventCreated = 1 << 0,
+    LIFilesystemEventRemoved = 1 << 1,
+    LIFilesystemEventRenamed = 1 << 2, // along with Created (moved to here) or Removed (moved away)
+    LIFilesystemEventModified = 1 << 3,
+    LIFilesystemEventMetadataChanged = 1 << 4,
+    LIFilesystemEventIsDirectory = 1 << 5,
+    LIFilesystemEventMustRescan = 1 << 6, // events under this path were dropped or can't be trusted; rescan it recursively
+};
+
+/* The path with every symlink resolved, so /tmp and NSTemporaryDirectory() come out under /private the way the kernel
+ * spells them in events. Observers register their directories, and snapshots record their roots, under this spelling.
+ * A path that doesn't exist is only standardized. */
+extern NSString *LIFilesystemCanonicalPath(NSString *path);
+
+@interface LIFilesystemEvent : NSObject
+- (id)initWithPath:(NSString *)path kind:(LIFilesystemEventKind)kind eventId:(FSEventStreamEventId)eventId;
+@property (readonly, nonatomic, copy) NSString *path;
+@property (readonly, nonatomic) LIFilesystemEventKind kind;
+@property (readonly, nonatomic) FSEventStreamEventId eventId; // latest ID coalesced into this event; 0 where the system has no event IDs
+@end
+
 @class LIFilesystemEventObserver;
-// Not all info is passed to block callback, just because no-one needs it (yet).
+// The plain action only says that something changed. Use a batch action to get what changed.
 typedef void(^LIFilesystemEventActionBlock)(id localSelf, LIFilesystemEventObserver *observer); // ‘localSelf’ param is actually the owner, which is almost always used as ‘self’
+typedef void(^LIFilesystemEventBatchActionBlock)(NSArray *events, id localSelf, LIFilesystemEventObserver *observer); // LIFilesystemEvents, one per path
 
 
+/* Events are delivered on the main queue (or the given delivery queue), coalesced over `latency` seconds. Delivery
+ * and invalidation are serialized, so an action on another queue never runs after -invalidate returns.
+ * All observers in the process share kernel subscriptions through LIFilesystemWatchManager, so observing overlapping
+ * trees is cheap. On Apple platforms that's a file-level FSEvents stream. On Linux, directory trees are watched with
+ * inotify (one watch per directory, added as subdirectories appear) and an epoll thread; there's no event history, so
+ * `since` is ignored. Use LIFilesystemSnapshot to find what changed while the process wasn't running. */
 @interface LIFilesystemEventObserver : NSObject <DMAutoInvalidation>
 
 + (instancetype)observerForDirectoryPaths:(NSArray *)paths attachedToOwner:(id)owner action:(LIFilesystemEventActionBlock)actionBlock __attribute__((nonnull(1,2,3)));
++ (instancetype)observerForDirectoryPaths:(NSArray *)paths attachedToOwner:(id)owner batchAction:(LIFilesystemEventBatchActionBlock)batchActionBlock __attribute__((nonnull(1,2,3)));
 
 - (id)initWithDirectoryPaths:(NSArray *)paths attachedToOwner:(id)owner since:(FSEventStreamEventId)since latency:(NSTimeInterval)latency action:(LIFilesystemEventActionBlock)actionBlock __attribute__((nonnull(1,2,5)));
+- (id)initWithDirectoryPaths:(NSArray *)paths attachedToOwner:(id)owner since:(FSEventStreamEventId)since latency:(NSTimeInterval)latency batchAction:(LIFilesystemEventBatchActionBlock)batchActionBlock __attribute__((nonnull(1,2,5)));
+- (id)initWithDirectoryPaths:(NSArray *)paths attachedToOwner:(id)owner since:(FSEventStreamEventId)since latency:(NSTimeInterval)latency deliveryQueue:(dispatch_queue_t)deliveryQueue batchAction:(LIFilesystemEventBatchActionBlock)batchActionBlock __attribute__((nonnull(1,2,5,6)));
 
-- (void)fireAction;
+- (void)fireAction; // batch actions get an empty batch
+- (void)fireActionWithEvents:(NSArray *)events;
 - (void)invalidate;
 
 @end
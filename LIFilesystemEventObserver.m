@@ -18,20 +18,57 @@
 #import "LIFilesystemEventObserver.h"
 // <dmclean.filter: lines.sort.uniq>
 #import "DMBlockUtilities.h"
+#import "DMObserverStatistics.h"
+#import "LIFilesystemWatchManager.h"
 
 
-static void callback(ConstFSEventStreamRef streamRef, void *clientCallbackInfo, size_t numEvents, void *eventPaths, const FSEventStreamEventFlags eventFlags[], const FSEventStreamEventId eventIds[])
+@interface LIFilesystemEventObserver ()
+- (id)_initWithDirectoryPaths:(NSArray *)paths attachedToOwner:(id)owner since:(FSEventStreamEventId)since latency:(NSTimeInterval)latency deliveryQueue:(dispatch_queue_t)deliveryQueue action:(LIFilesystemEventActionBlock)actionBlock batchAction:(LIFilesystemEventBatchActionBlock)batchActionBlock;
+@end
+
+
+NSString *LIFilesystemCanonicalPath(NSString *path)
+{
+    NSString *const standardizedPath = path.stringByStandardizingPath;
+    char *const resolvedPath = realpath(standardizedPath.fileSystemRepresentation, NULL);
+    if (!resolvedPath)
+        return standardizedPath; // Nothing to resolve yet
+    NSString *const canonicalPath = [[NSFileManager defaultManager] stringWithFileSystemRepresentation:resolvedPath length:strlen(resolvedPath)];
+    free(resolvedPath);
+    return canonicalPath;
+}
+
+
+@implementation LIFilesystemEvent
+
+@synthesize path = _path;
+@synthesize kind = _kind;
+@synthesize eventId = _eventId;
+
+- (id)initWithPath:(NSString *)path kind:(LIFilesystemEventKind)kind eventId:(FSEventStreamEventId)eventId;
 {
-    LIFilesystemEventObserver *observer = (__bridge id)clientCallbackInfo;
-    [observer fireAction];
+    NSParameterAssert(path);
+    if (!(self = [super init]))
+        return nil;
+    _path = [path copy];
+    _kind = kind;
+    _eventId = eventId;
+    return self;
 }
 
+- (NSString *)description;
+{ return [NSString stringWithFormat:@"<%@ %p: %@ kind=0x%lx eventId=%llu>", [self class], self, _path, (unsigned long)_kind, (unsigned long long)_eventId]; }
+
+@end
+
 
 @implementation LIFilesystemEventObserver {
     BOOL _invalidated;
-    FSEventStreamRef _eventStreamRef;
+    LIFilesystemEventBuffer *_eventBuffer;
     LIFilesystemEventActionBlock _actionBlock;
+    LIFilesystemEventBatchActionBlock _batchActionBlock;
     __unsafe_unretained id _unsafeOwner;
+    struct DMObserverInvalidatorLink _invalidatorLink;
 }
 
 #pragma mark NSObject
@@ -46,20 +83,25 @@ static void callback(ConstFSEventStreamRef streamRef, void *clientCallbackInfo,
 
 - (void)invalidate;
 {
-    if (_invalidated)
-        return;
-    _invalidated = YES;
+    @synchronized (self) { // Waits for an action running on another queue
+        if (_invalidated)
+            return;
+        _invalidated = YES;
+    }
     
-    FSEventStreamStop(_eventStreamRef);
-    FSEventStreamInvalidate(_eventStreamRef);
-    FSEventStreamRelease(_eventStreamRef);
-    _eventStreamRef = NULL;
+    if (_eventBuffer)
+        [[LIFilesystemWatchManager sharedManager] removeEventBuffer:_eventBuffer];
+    _eventBuffer = nil;
     
     _actionBlock = nil;
+    _batchActionBlock = nil;
     _unsafeOwner = nil;
     [DMObserverInvalidator observerDidInvalidate:self];
 }
 
+- (struct DMObserverInvalidatorLink *)observerInvalidatorLink;
+{ return &_invalidatorLink; }
+
 
 #pragma mark API
 
@@ -69,39 +111,86 @@ static void callback(ConstFSEventStreamRef streamRef, void *clientCallbackInfo,
     return [[self alloc] initWithDirectoryPaths:paths attachedToOwner:owner since:kFSEventStreamEventIdSinceNow latency:DEFAULT_LATENCY action:actionBlock];
 }
 
++ (instancetype)observerForDirectoryPaths:(NSArray *)paths attachedToOwner:(id)owner batchAction:(LIFilesystemEventBatchActionBlock)batchActionBlock;
+{ return [[self alloc] initWithDirectoryPaths:paths attachedToOwner:owner since:kFSEventStreamEventIdSinceNow latency:DEFAULT_LATENCY batchAction:batchActionBlock]; }
+
 - (id)initWithDirectoryPaths:(NSArray *)paths attachedToOwner:(id)owner since:(FSEventStreamEventId)since latency:(NSTimeInterval)latency action:(LIFilesystemEventActionBlock)actionBlock;
 {
-    NSParameterAssert(paths && owner && actionBlock);
+    NSParameterAssert(actionBlock);
+#ifndef NS_BLOCK_ASSERTIONS
+    if ([DMBlockUtilities isObject:owner implicitlyRetainedByBlock:actionBlock])
+        DMBlockRetainCycleDetected([NSString stringWithFormat:@"%s action captures owner; use localSelf (localOwner) parameter to fix.", __func__]);
+#endif
+    return [self _initWithDirectoryPaths:paths attachedToOwner:owner since:since latency:latency deliveryQueue:dispatch_get_main_queue() action:actionBlock batchAction:nil];
+}
+
+- (id)initWithDirectoryPaths:(NSArray *)paths attachedToOwner:(id)owner since:(FSEventStreamEventId)since latency:(NSTimeInterval)latency batchAction:(LIFilesystemEventBatchActionBlock)batchActionBlock;
+{
+    return [self initWithDirectoryPaths:paths attachedToOwner:owner since:since latency:latency deliveryQueue:dispatch_get_main_queue() batchAction:batchActionBlock];
+}
+
+- (id)initWithDirectoryPaths:(NSArray *)paths attachedToOwner:(id)owner since:(FSEventStreamEventId)since latency:(NSTimeInterval)latency deliveryQueue:(dispatch_queue_t)deliveryQueue batchAction:(LIFilesystemEventBatchActionBlock)batchActionBlock;
+{
+    NSParameterAssert(batchActionBlock);
+#ifndef NS_BLOCK_ASSERTIONS
+    if ([DMBlockUtilities isObject:owner implicitlyRetainedByBlock:batchActionBlock])
+        DMBlockRetainCycleDetected([NSString stringWithFormat:@"%s action captures owner; use localSelf (localOwner) parameter to fix.", __func__]);
+#endif
+    return [self _initWithDirectoryPaths:paths attachedToOwner:owner since:since latency:latency deliveryQueue:deliveryQueue action:nil batchAction:batchActionBlock];
+}
+
+- (void)fireAction;
+{
+    [self fireActionWithEvents:@[]];
+}
+
+- (void)fireActionWithEvents:(NSArray *)events;
+{
+    @synchronized (self) {
+        if (_invalidated)
+            return;
+        
+        // If our owner has deallocated, we should be invalidated at this point. Since we're not, our owner must still be alive.
+        // Use local references, as the action block could call -invalidate on us
+        LIFilesystemEventBatchActionBlock batchActionBlock = [_batchActionBlock copy];
+        LIFilesystemEventActionBlock actionBlock = [_actionBlock copy];
+        const DMObserverStatisticsFire fire = DMObserverStatisticsFireWillBegin(_unsafeOwner);
+        if (batchActionBlock)
+            batchActionBlock(events ? : @[], _unsafeOwner, self);
+        else
+            actionBlock(_unsafeOwner, self);
+        DMObserverStatisticsFireDidEnd(self, fire);
+    }
+}
+
+
+#pragma mark Private
+
+- (id)_initWithDirectoryPaths:(NSArray *)paths attachedToOwner:(id)owner since:(FSEventStreamEventId)since latency:(NSTimeInterval)latency deliveryQueue:(dispatch_queue_t)deliveryQueue action:(LIFilesystemEventActionBlock)actionBlock batchAction:(LIFilesystemEventBatchActionBlock)batchActionBlock;
+{
+    NSParameterAssert(paths && owner && deliveryQueue && (actionBlock || batchActionBlock));
     if (!(self = [super init]))
         return nil;
     
     _unsafeOwner = owner;
     _actionBlock = [actionBlock copy];
+    _batchActionBlock = [batchActionBlock copy];
     
-    FSEventStreamContext filesystemEventStreamContext = {.version = 0, .info = (__bridge void *)self};
-    _eventStreamRef = FSEventStreamCreate(kCFAllocatorDefault, callback, &filesystemEventStreamContext, (__bridge CFArrayRef)paths, since, latency, kFSEventStreamCreateFlagNone);
-    
-    FSEventStreamScheduleWithRunLoop(_eventStreamRef, [[NSRunLoop mainRunLoop] getCFRunLoop], kCFRunLoopDefaultMode);
-    if (!FSEventStreamStart(_eventStreamRef))
+    // Observers share kernel subscriptions through the watch manager, which matches the kernel's spelling of paths
+    // component by component. Events are reported back under the caller's spelling.
+    NSMutableOrderedSet *const canonicalPaths = [NSMutableOrderedSet orderedSetWithCapacity:paths.count];
+    NSMutableDictionary *const callerPathsByCanonicalPath = [NSMutableDictionary dictionaryWithCapacity:paths.count];
+    for (NSString *path in paths) {
+        NSString *const canonicalPath = LIFilesystemCanonicalPath(path);
+        [canonicalPaths addObject:canonicalPath];
+        callerPathsByCanonicalPath[canonicalPath] = path.stringByStandardizingPath;
+    }
+    _eventBuffer = [[LIFilesystemEventBuffer alloc] initWithObserver:self latency:latency deliveryQueue:deliveryQueue callerPathsByCanonicalPath:callerPathsByCanonicalPath];
+    if (![[LIFilesystemWatchManager sharedManager] addEventBuffer:_eventBuffer forDirectoryPaths:canonicalPaths.array since:since])
         return nil;
     
     [DMObserverInvalidator attachObserver:self toOwner:owner];
-
-#ifndef NS_BLOCK_ASSERTIONS
-    if ([DMBlockUtilities isObject:owner implicitlyRetainedByBlock:actionBlock])
-        DMBlockRetainCycleDetected([NSString stringWithFormat:@"%s action captures owner; use localSelf (localOwner) parameter to fix.", __func__]);
-#endif
     return self;
 }
 
-- (void)fireAction;
-{
-    if (_invalidated)
-        return;
-    
-    // If our owner has deallocated, we should be invalidated at this point. Since we're not, our owner must still be alive.
-    LIFilesystemEventActionBlock actionBlock = [_actionBlock copy]; // Use a local reference, as the actionBock could call -invalidate on us
-    actionBlock(_unsafeOwner, self);
-}
-
 @end
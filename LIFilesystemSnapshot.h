@@ -0,0 +1,42 @@
+//
+//  LIFilesystemSnapshot.h
+//  DMAutoInvalidation
+//
+//  Created by agent on 2026-10-17.
+//  Copyright (c) 2026 Delicious Monster Software.
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+#import "LIFilesystemEventObserver.h"
+
+
+/* The device, inode number and modification time of every directory in some trees, sorted by path in a flat binary
+ * format that's read straight from a memory-mapped file. Comparing the snapshot saved at the end of the last run with
+ * a fresh one answers "what changed since last run" without reading old state into objects, which is useful where
+ * the system keeps no event history (Linux).
+ * A directory's modification time changes when entries are added, removed or renamed in it, not when a file in it is
+ * written to; so a changed directory means its entries should be listed again, not that its files should be reread. */
+@interface LIFilesystemSnapshot : NSObject
+
++ (instancetype)snapshotOfDirectoryPaths:(NSArray *)paths;
++ (instancetype)snapshotWithContentsOfFile:(NSString *)path; // nil if missing or not a snapshot
+
+- (BOOL)writeToFile:(NSString *)path error:(NSError **)outError;
+
+@property (readonly, nonatomic) NSUInteger directoryCount;
+
+/* One event per directory that differs, all with IsDirectory: Created or Removed, Modified when its entries changed,
+ * and Removed|Created when the path now refers to a different directory. Pass nil to get every directory as Created.
+ * Paths are spelled with the roots canonicalized by LIFilesystemCanonicalPath(). */
+- (NSArray *)eventsSinceSnapshot:(LIFilesystemSnapshot *)olderSnapshot;
+
+@end
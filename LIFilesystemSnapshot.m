@@ -0,0 +1,209 @@
+//
+//  LIFilesystemSnapshot.m
+//  DMAutoInvalidation
+//
+//  Created by agent on 2026-10-17.
+//  Copyright (c) 2026 Delicious Monster Software.
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#import "LIFilesystemSnapshot.h"
+
+#import <dirent.h>
+#import <sys/stat.h>
+
+#if !__has_feature(objc_arc)
+#error This file must be compiled with Automatic Reference Counting (ARC).
+#endif
+
+
+/* File layout: header, records sorted by path (bytewise), then the NUL-terminated paths they point into.
+ * Fixed-size fields in host byte order; a snapshot is a cache for this machine, not an interchange format. */
+#define LI_SNAPSHOT_MAGIC 0x5346494cU // "LIFS"
+#define LI_SNAPSHOT_VERSION 1U
+
+struct LIFilesystemSnapshotHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t recordCount;
+};
+
+struct LIFilesystemSnapshotRecord {
+    uint64_t device;
+    uint64_t inode;
+    int64_t modificationSeconds;
+    int64_t modificationNanoseconds;
+    uint64_t pathOffset; // from the start of the path table
+};
+
+
+@interface LIFilesystemSnapshot ()
+- (id)_initWithData:(NSData *)data;
+@end
+
+
+static void addDirectoryTree(const char *directoryPath, NSMutableData *records, NSMutableData *pathTable)
+{
+    struct stat directoryStat;
+    if (lstat(directoryPath, &directoryStat) || !S_ISDIR(directoryStat.st_mode))
+        return;
+
+#if __APPLE__
+    const struct timespec modificationTime = directoryStat.st_mtimespec;
+#else
+    const struct timespec modificationTime = directoryStat.st_mtim;
+#endif
+    const struct LIFilesystemSnapshotRecord record = {
+        .device = (uint64_t)directoryStat.st_dev,
+        .inode = (uint64_t)directoryStat.st_ino,
+        .modificationSeconds = modificationTime.tv_sec,
+        .modificationNanoseconds = modificationTime.tv_nsec,
+        .pathOffset = pathTable.length,
+    };
+    [records appendBytes:&record length:sizeof(record)];
+    [pathTable appendBytes:directoryPath length:strlen(directoryPath) + 1];
+
+    DIR *const directory = opendir(directoryPath);
+    if (!directory)
+        return;
+    const size_t directoryPathLength = strlen(directoryPath);
+    const struct dirent *entry;
+    while ((entry = readdir(directory))) {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..") || (entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN))
+            continue;
+        char childPath[directoryPathLength + strlen(entry->d_name) + 2];
+        snprintf(childPath, sizeof(childPath), (directoryPath[directoryPathLength - 1] == '/') ? "%s%s" : "%s/%s", directoryPath, entry->d_name);
+        addDirectoryTree(childPath, records, pathTable); // Not a directory (DT_UNKNOWN) is caught by the lstat
+    }
+    closedir(directory);
+}
+
+
+@implementation LIFilesystemSnapshot {
+    NSData *_data; // memory-mapped when read from a file
+    const struct LIFilesystemSnapshotRecord *_records;
+    const char *_pathTable;
+}
+
+@synthesize directoryCount = _directoryCount;
+
+#pragma mark API
+
++ (instancetype)snapshotOfDirectoryPaths:(NSArray *)paths;
+{
+    NSMutableData *const records = [NSMutableData data];
+    NSMutableData *const pathTable = [NSMutableData data];
+    for (NSString *path in paths)
+        addDirectoryTree(LIFilesystemCanonicalPath(path).fileSystemRepresentation, records, pathTable); // Symlinks below the roots aren't followed
+
+    // Sort the records by path, so comparing two snapshots is one merge pass
+    const struct LIFilesystemSnapshotRecord *const unsortedRecords = records.bytes;
+    const char *const pathBytes = pathTable.bytes;
+    const NSUInteger recordCount = records.length / sizeof(struct LIFilesystemSnapshotRecord);
+    NSMutableArray *const recordIndexes = [NSMutableArray arrayWithCapacity:recordCount];
+    for (NSUInteger i = 0; i < recordCount; i++)
+        [recordIndexes addObject:@(i)];
+    [recordIndexes sortUsingComparator:^NSComparisonResult(NSNumber *index1, NSNumber *index2) {
+        const int order = strcmp(pathBytes + unsortedRecords[index1.unsignedIntegerValue].pathOffset, pathBytes + unsortedRecords[index2.unsignedIntegerValue].pathOffset);
+        return (order < 0) ? NSOrderedAscending : (order > 0) ? NSOrderedDescending : NSOrderedSame;
+    }];
+
+    const struct LIFilesystemSnapshotHeader header = {.magic = LI_SNAPSHOT_MAGIC, .version = LI_SNAPSHOT_VERSION, .recordCount = recordCount};
+    NSMutableData *const data = [NSMutableData dataWithCapacity:(sizeof(header) + records.length + pathTable.length)];
+    [data appendBytes:&header length:sizeof(header)];
+    NSNumber *previousIndex = nil;
+    for (NSNumber *index in recordIndexes) {
+        // Overlapping paths put the same directories in twice
+        if (previousIndex && !strcmp(pathBytes + unsortedRecords[previousIndex.unsignedIntegerValue].pathOffset, pathBytes + unsortedRecords[index.unsignedIntegerValue].pathOffset)) {
+            ((struct LIFilesystemSnapshotHeader *)data.mutableBytes)->recordCount--;
+            continue;
+        }
+        [data appendBytes:&unsortedRecords[index.unsignedIntegerValue] length:sizeof(struct LIFilesystemSnapshotRecord)];
+        previousIndex = index;
+    }
+    [data appendData:pathTable];
+    return [[self alloc] _initWithData:data];
+}
+
++ (instancetype)snapshotWithContentsOfFile:(NSString *)path;
+{
+    NSData *const data = [NSData dataWithContentsOfFile:path options:NSDataReadingMappedAlways error:NULL];
+    return data ? [[self alloc] _initWithData:data] : nil;
+}
+
+- (BOOL)writeToFile:(NSString *)path error:(NSError **)outError;
+{ return [_data writeToFile:path options:NSDataWritingAtomic error:outError]; }
+
+- (NSArray *)eventsSinceSnapshot:(LIFilesystemSnapshot *)olderSnapshot;
+{
+    NSFileManager *const fileManager = [NSFileManager defaultManager];
+    NSMutableArray *const events = [NSMutableArray array];
+    void (^addEvent)(const char *, LIFilesystemEventKind) = ^(const char *path, LIFilesystemEventKind kind) {
+        [events addObject:[[LIFilesystemEvent alloc] initWithPath:[fileManager stringWithFileSystemRepresentation:path length:strlen(path)] kind:(kind | LIFilesystemEventIsDirectory) eventId:0]];
+    };
+
+    NSUInteger oldIndex = 0, newIndex = 0;
+    const NSUInteger oldCount = olderSnapshot ? olderSnapshot->_directoryCount : 0;
+    while (oldIndex < oldCount || newIndex < _directoryCount) {
+        const struct LIFilesystemSnapshotRecord *const oldRecord = (oldIndex < oldCount) ? &olderSnapshot->_records[oldIndex] : NULL;
+        const struct LIFilesystemSnapshotRecord *const newRecord = (newIndex < _directoryCount) ? &_records[newIndex] : NULL;
+        const char *const oldPath = oldRecord ? olderSnapshot->_pathTable + oldRecord->pathOffset : NULL;
+        const char *const newPath = newRecord ? _pathTable + newRecord->pathOffset : NULL;
+        const int order = !oldPath ? 1 : !newPath ? -1 : strcmp(oldPath, newPath);
+
+        if (order < 0) {
+            addEvent(oldPath, LIFilesystemEventRemoved);
+            oldIndex++;
+        } else if (order > 0) {
+            addEvent(newPath, LIFilesystemEventCreated);
+            newIndex++;
+        } else {
+            if (oldRecord->device != newRecord->device || oldRecord->inode != newRecord->inode)
+                addEvent(newPath, (LIFilesystemEventRemoved | LIFilesystemEventCreated));
+            else if (oldRecord->modificationSeconds != newRecord->modificationSeconds || oldRecord->modificationNanoseconds != newRecord->modificationNanoseconds)
+                addEvent(newPath, LIFilesystemEventModified);
+            oldIndex++;
+            newIndex++;
+        }
+    }
+    return events;
+}
+
+
+#pragma mark Private
+
+- (id)_initWithData:(NSData *)data;
+{
+    // Check everything we'll dereference later, since the file could be truncated or from anywhere
+    const struct LIFilesystemSnapshotHeader *const header = data.bytes;
+    if (data.length < sizeof(*header) || header->magic != LI_SNAPSHOT_MAGIC || header->version != LI_SNAPSHOT_VERSION)
+        return nil;
+    if (header->recordCount > (data.length - sizeof(*header)) / sizeof(struct LIFilesystemSnapshotRecord))
+        return nil;
+    const struct LIFilesystemSnapshotRecord *const records = (const void *)(header + 1);
+    const char *const pathTable = (const char *)(records + header->recordCount);
+    const size_t pathTableLength = (const char *)data.bytes + data.length - pathTable;
+    if (pathTableLength && pathTable[pathTableLength - 1] != '\0')
+        return nil;
+    for (uint64_t i = 0; i < header->recordCount; i++)
+        if (records[i].pathOffset >= pathTableLength)
+            return nil;
+
+    if (!(self = [super init]))
+        return nil;
+    _data = data;
+    _directoryCount = (NSUInteger)header->recordCount;
+    _records = records;
+    _pathTable = pathTable;
+    return self;
+}
+
+@end
@@ -0,0 +1,46 @@
+//
+//  LIFilesystemWatchManager.h
+//  DMAutoInvalidation
+//
+//  Created by agent on 2026-10-17.
+//  Copyright (c) 2026 Delicious Monster Software.
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#import "LIFilesystemEventObserver.h"
+
+
+/* Collects the events for one observer, coalesces them by path over the observer's latency, and then delivers them
+ * on the observer's delivery queue, respelling paths under each watched directory the way the observer was given it.
+ * It only references the observer weakly, so a pending delivery doesn't extend the observer's life. */
+@interface LIFilesystemEventBuffer : NSObject
+
+- (id)initWithObserver:(LIFilesystemEventObserver *)observer latency:(NSTimeInterval)latency deliveryQueue:(dispatch_queue_t)deliveryQueue callerPathsByCanonicalPath:(NSDictionary *)callerPathsByCanonicalPath;
+
+@property (readonly, nonatomic) NSTimeInterval latency;
+
+- (void)addEvents:(NSArray *)events elapsedLatency:(NSTimeInterval)elapsedLatency; // elapsedLatency: how long the source already coalesced for
+
+@end
+
+
+/* Keeps one kernel subscription per watched directory for the whole process, however many observers watch it,
+ * and hands each event to the buffers registered for the path or one of its ancestors (found with a path-component trie).
+ * On Apple platforms that's one FSEvents stream for the topmost registered paths, except that registrations that
+ * replay history from an event ID get a stream of their own. On Linux it's one inotify watch per directory. */
+@interface LIFilesystemWatchManager : NSObject
+
++ (instancetype)sharedManager;
+
+- (BOOL)addEventBuffer:(LIFilesystemEventBuffer *)eventBuffer forDirectoryPaths:(NSArray *)canonicalPaths since:(FSEventStreamEventId)since;
+- (void)removeEventBuffer:(LIFilesystemEventBuffer *)eventBuffer;
+
+@end
@@ -0,0 +1,708 @@
+//
+//  LIFilesystemWatchManager.m
+//  DMAutoInvalidation
+//
+//  Created by agent on 2026-10-17.
+//  Copyright (c) 2026 Delicious Monster Software.
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+
+#import "LIFilesystemWatchManager.h"
+
+#if __linux__
+#import <dirent.h>
+#import <errno.h>
+#import <pthread.h>
+#import <sys/epoll.h>
+#import <sys/inotify.h>
+#import <sys/stat.h>
+#import <unistd.h>
+#elif !__APPLE__
+#error LIFilesystemWatchManager needs FSEvents or inotify.
+#endif
+
+#if !__has_feature(objc_arc)
+#error This file must be compiled with Automatic Reference Counting (ARC).
+#endif
+
+
+/* Adds an event to a batch, merging it into any earlier event for the same path. */
+static void addCoalescedEvent(NSMutableArray *events, NSMutableDictionary *eventIndexesByPath, NSString *path, LIFilesystemEventKind kind, FSEventStreamEventId eventId)
+{
+    NSNumber *const existingIndex = eventIndexesByPath[path];
+    if (!existingIndex) {
+        eventIndexesByPath[path] = @(events.count);
+        [events addObject:[[LIFilesystemEvent alloc] initWithPath:path kind:kind eventId:eventId]];
+    } else {
+        LIFilesystemEvent *const existingEvent = events[existingIndex.unsignedIntegerValue];
+        events[existingIndex.unsignedIntegerValue] = [[LIFilesystemEvent alloc] initWithPath:path kind:(existingEvent.kind | kind) eventId:MAX(existingEvent.eventId, eventId)];
+    }
+}
+
+/* Respells a canonical path under the longest watched directory that contains it, the way the caller spelled that directory. */
+static NSString *callerPathForPath(NSDictionary *callerPathsByCanonicalPath, NSString *path)
+{
+    NSString *longestCanonicalPath = nil;
+    for (NSString *canonicalPath in callerPathsByCanonicalPath) {
+        if (canonicalPath.length <= longestCanonicalPath.length || ![path hasPrefix:canonicalPath])
+            continue;
+        if (path.length == canonicalPath.length || [path characterAtIndex:canonicalPath.length] == '/')
+            longestCanonicalPath = canonicalPath;
+    }
+    if (!longestCanonicalPath)
+        return path;
+    return [callerPathsByCanonicalPath[longestCanonicalPath] stringByAppendingString:[path substringFromIndex:longestCanonicalPath.length]];
+}
+
+
+@implementation LIFilesystemEventBuffer {
+    __weak LIFilesystemEventObserver *_observer;
+    dispatch_queue_t _deliveryQueue;
+    NSDictionary *_callerPathsByCanonicalPath; // nil when the caller already used canonical paths
+    dispatch_semaphore_t _mutex; // guards the following
+    NSMutableArray *_events; // nil when no delivery is scheduled
+    NSMutableDictionary *_eventIndexesByPath;
+}
+
+@synthesize latency = _latency;
+
+- (id)initWithObserver:(LIFilesystemEventObserver *)observer latency:(NSTimeInterval)latency deliveryQueue:(dispatch_queue_t)deliveryQueue callerPathsByCanonicalPath:(NSDictionary *)callerPathsByCanonicalPath;
+{
+    NSParameterAssert(observer && deliveryQueue);
+    if (!(self = [super init]))
+        return nil;
+    _observer = observer;
+    _latency = MAX(latency, 0);
+    _deliveryQueue = deliveryQueue;
+    for (NSString *canonicalPath in callerPathsByCanonicalPath)
+        if (![callerPathsByCanonicalPath[canonicalPath] isEqualToString:canonicalPath]) {
+            _callerPathsByCanonicalPath = [callerPathsByCanonicalPath copy];
+            break;
+        }
+    _mutex = dispatch_semaphore_create(1);
+    return self;
+}
+
+- (void)addEvents:(NSArray *)events elapsedLatency:(NSTimeInterval)elapsedLatency;
+{
+    BOOL needsSchedule;
+    dispatch_semaphore_wait(_mutex, DISPATCH_TIME_FOREVER); {
+        needsSchedule = !_events;
+        if (needsSchedule) {
+            _events = [NSMutableArray array];
+            _eventIndexesByPath = [NSMutableDictionary dictionary];
+        }
+        for (LIFilesystemEvent *event in events) {
+            NSString *const path = _callerPathsByCanonicalPath ? callerPathForPath(_callerPathsByCanonicalPath, event.path) : event.path;
+            addCoalescedEvent(_events, _eventIndexesByPath, path, event.kind, event.eventId);
+        }
+    } dispatch_semaphore_signal(_mutex);
+
+    if (!needsSchedule)
+        return;
+
+    const NSTimeInterval remainingLatency = MAX(_latency - elapsedLatency, 0);
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(remainingLatency * NSEC_PER_SEC)), _deliveryQueue, ^{
+        NSArray *eventsToDeliver;
+        dispatch_semaphore_wait(_mutex, DISPATCH_TIME_FOREVER); {
+            eventsToDeliver = _events;
+            _events = nil;
+            _eventIndexesByPath = nil;
+        } dispatch_semaphore_signal(_mutex);
+        [_observer fireActionWithEvents:eventsToDeliver];
+    });
+}
+
+@end
+
+
+#if __APPLE__
+/* FSEvents callbacks (turning paths into strings, finding registrations, and fanning out events) run on this queue,
+ * and streams are rebuilt and torn down on it, so none of that work lands on the main thread. */
+static dispatch_queue_t eventStreamQueue(void)
+{
+    static dispatch_queue_t queue;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        queue = dispatch_queue_create("LIFilesystemEventStream", DISPATCH_QUEUE_SERIAL);
+    });
+    return queue;
+}
+
+
+/* Owns one FSEvents stream on eventStreamQueue(), and hands each callback's events, coalesced by path, to a block. */
+@interface LIFilesystemEventStream : NSObject
+- (id)initWithPaths:(NSArray *)paths since:(FSEventStreamEventId)since latency:(NSTimeInterval)latency handler:(void (^)(NSArray *events))handler;
+@property (readonly, nonatomic) NSArray *paths;
+@property (readonly, nonatomic) NSTimeInterval latency;
+@property (readonly, nonatomic) FSEventStreamEventId latestEventId;
+- (void)invalidate;
+- (void)handleEventCount:(size_t)eventCount paths:(char *const *)eventPaths flags:(const FSEventStreamEventFlags *)eventFlags ids:(const FSEventStreamEventId *)eventIds;
+@end
+
+static LIFilesystemEventKind kindForEventFlags(FSEventStreamEventFlags flags)
+{
+    LIFilesystemEventKind kind = 0;
+    if (flags & kFSEventStreamEventFlagItemCreated)
+        kind |= LIFilesystemEventCreated;
+    if (flags & kFSEventStreamEventFlagItemRemoved)
+        kind |= LIFilesystemEventRemoved;
+    if (flags & kFSEventStreamEventFlagItemRenamed)
+        kind |= LIFilesystemEventRenamed;
+    if (flags & kFSEventStreamEventFlagItemModified)
+        kind |= LIFilesystemEventModified;
+    if (flags & (kFSEventStreamEventFlagItemInodeMetaMod | kFSEventStreamEventFlagItemChangeOwner | kFSEventStreamEventFlagItemFinderInfoMod | kFSEventStreamEventFlagItemXattrMod))
+        kind |= LIFilesystemEventMetadataChanged;
+    if (flags & kFSEventStreamEventFlagItemIsDir)
+        kind |= LIFilesystemEventIsDirectory;
+    if (flags & (kFSEventStreamEventFlagMustScanSubDirs | kFSEventStreamEventFlagUserDropped | kFSEventStreamEventFlagKernelDropped | kFSEventStreamEventFlagRootChanged))
+        kind |= LIFilesystemEventMustRescan;
+    return kind;
+}
+
+static void callback(ConstFSEventStreamRef streamRef, void *clientCallbackInfo, size_t numEvents, void *eventPaths, const FSEventStreamEventFlags eventFlags[], const FSEventStreamEventId eventIds[])
+{
+    LIFilesystemEventStream *stream = (__bridge id)clientCallbackInfo;
+    [stream handleEventCount:numEvents paths:eventPaths flags:eventFlags ids:eventIds];
+}
+
+@implementation LIFilesystemEventStream {
+    FSEventStreamRef _eventStreamRef;
+    void (^_handler)(NSArray *events);
+}
+
+@synthesize paths = _paths;
+@synthesize latency = _latency;
+
+- (id)initWithPaths:(NSArray *)paths since:(FSEventStreamEventId)since latency:(NSTimeInterval)latency handler:(void (^)(NSArray *events))handler;
+{
+    NSParameterAssert(paths.count && handler);
+    if (!(self = [super init]))
+        return nil;
+    _paths = [paths copy];
+    _latency = latency;
+    _handler = [handler copy];
+
+    FSEventStreamContext filesystemEventStreamContext = {.version = 0, .info = (__bridge void *)self};
+    _eventStreamRef = FSEventStreamCreate(kCFAllocatorDefault, callback, &filesystemEventStreamContext, (__bridge CFArrayRef)_paths, since, latency, kFSEventStreamCreateFlagFileEvents);
+    if (!_eventStreamRef)
+        return nil;
+
+    FSEventStreamSetDispatchQueue(_eventStreamRef, eventStreamQueue());
+    if (!FSEventStreamStart(_eventStreamRef))
+        return nil;
+    return self;
+}
+
+- (void)dealloc;
+{
+    [self invalidate];
+}
+
+- (FSEventStreamEventId)latestEventId;
+{ return _eventStreamRef ? FSEventStreamGetLatestEventId(_eventStreamRef) : kFSEventStreamEventIdSinceNow; }
+
+- (void)invalidate;
+{
+    if (!_eventStreamRef)
+        return;
+    FSEventStreamStop(_eventStreamRef);
+    FSEventStreamInvalidate(_eventStreamRef);
+    FSEventStreamRelease(_eventStreamRef);
+    _eventStreamRef = NULL;
+    _handler = nil;
+}
+
+- (void)handleEventCount:(size_t)eventCount paths:(char *const *)eventPaths flags:(const FSEventStreamEventFlags *)eventFlags ids:(const FSEventStreamEventId *)eventIds;
+{
+    NSFileManager *const fileManager = [NSFileManager defaultManager];
+    NSMutableArray *const events = [NSMutableArray arrayWithCapacity:eventCount];
+    NSMutableDictionary *const eventIndexesByPath = [NSMutableDictionary dictionaryWithCapacity:eventCount];
+    for (size_t i = 0; i < eventCount; i++) {
+        if (eventFlags[i] & kFSEventStreamEventFlagHistoryDone)
+            continue;
+        NSString *const path = [fileManager stringWithFileSystemRepresentation:eventPaths[i] length:strlen(eventPaths[i])];
+        addCoalescedEvent(events, eventIndexesByPath, path, kindForEventFlags(eventFlags[i]), eventIds[i]);
+    }
+    void (^handler)(NSArray *) = _handler; // Use a local reference, as the handler could invalidate us
+    if (events.count && handler)
+        handler(events);
+}
+
+@end
+
+#elif __linux__
+#define LI_INOTIFY_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_EXCL_UNLINK)
+
+static LIFilesystemEventKind kindForInotifyMask(uint32_t mask)
+{
+    LIFilesystemEventKind kind = 0;
+    if (mask & (IN_CREATE | IN_MOVED_TO))
+        kind |= LIFilesystemEventCreated;
+    if (mask & (IN_DELETE | IN_DELETE_SELF | IN_MOVED_FROM | IN_MOVE_SELF))
+        kind |= LIFilesystemEventRemoved;
+    if (mask & (IN_MOVED_FROM | IN_MOVED_TO | IN_MOVE_SELF))
+        kind |= LIFilesystemEventRenamed;
+    if (mask & IN_MODIFY)
+        kind |= LIFilesystemEventModified;
+    if (mask & IN_ATTRIB)
+        kind |= LIFilesystemEventMetadataChanged;
+    if (mask & (IN_ISDIR | IN_DELETE_SELF | IN_MOVE_SELF)) // We only watch directories
+        kind |= LIFilesystemEventIsDirectory;
+    return kind;
+}
+#endif
+
+
+/* One node per path component in the trie of registered paths. */
+@interface LIFilesystemWatchNode : NSObject
+@property (readonly, nonatomic) NSMutableDictionary *children; // path component -> LIFilesystemWatchNode
+@property (readonly, nonatomic) NSMutableArray *eventBuffers; // one entry per registration of exactly this path
+@end
+
+@implementation LIFilesystemWatchNode
+
+@synthesize children = _children;
+@synthesize eventBuffers = _eventBuffers;
+
+- (id)init;
+{
+    if (!(self = [super init]))
+        return nil;
+    _children = [NSMutableDictionary dictionary];
+    _eventBuffers = [NSMutableArray array];
+    return self;
+}
+
+@end
+
+
+@interface LIFilesystemWatchManager ()
+- (void)_dispatchEvents:(NSArray *)events elapsedLatency:(NSTimeInterval)elapsedLatency;
+- (void)_addEventBuffersForPath:(NSString *)path toArray:(NSMutableArray *)eventBuffers;
+- (BOOL)_isPathCovered:(NSString *)path;
+- (void)_collectTopmostPathsUnderNode:(LIFilesystemWatchNode *)node components:(NSMutableArray *)components intoArray:(NSMutableArray *)paths;
+#if __APPLE__
+- (void)_scheduleSharedStreamRebuild;
+- (void)_rebuildSharedStream;
+#elif __linux__
+- (void)_runWatchLoop;
+- (void)_handleInotifyEvents:(const char *)buffer length:(size_t)length;
+- (void)_addWatchesForDirectoryTree:(NSString *)directoryPath;
+- (void)_removeWatchesForDirectoryTree:(NSString *)directoryPath onlyUncovered:(BOOL)onlyUncovered;
+#endif
+@end
+
+
+#if __linux__
+static void *watchThreadMain(void *info)
+{
+    LIFilesystemWatchManager *const manager = (__bridge id)info; // The shared manager is never deallocated
+    [manager _runWatchLoop];
+    return NULL;
+}
+#endif
+
+
+@implementation LIFilesystemWatchManager {
+    dispatch_semaphore_t _mutex; // guards the following
+    LIFilesystemWatchNode *_rootNode;
+    NSMapTable *_pathsByEventBuffer; // LIFilesystemEventBuffer -> NSMutableArray of registered paths
+    NSMapTable *_registrationEventIdsByEventBuffer; // LIFilesystemEventBuffer -> NSNumber; earlier events predate the registration
+#if __APPLE__
+    NSMapTable *_historyStreamsByEventBuffer; // LIFilesystemEventBuffer -> LIFilesystemEventStream
+    BOOL _sharedStreamRebuildScheduled;
+    FSEventStreamEventId _sharedStreamRebuildSince;
+
+    LIFilesystemEventStream *_sharedStream; // eventStreamQueue() only
+#elif __linux__
+    int _inotifyFD, _epollFD;
+    NSMutableDictionary *_pathsByWatchDescriptor;
+    NSMutableDictionary *_watchDescriptorsByPath;
+#endif
+}
+
+#pragma mark NSObject
+
+- (id)init;
+{
+    if (!(self = [super init]))
+        return nil;
+
+    _mutex = dispatch_semaphore_create(1);
+    _rootNode = [LIFilesystemWatchNode new];
+    _pathsByEventBuffer = [[NSMapTable alloc] initWithKeyOptions:(NSPointerFunctionsStrongMemory | NSPointerFunctionsObjectPointerPersonality) valueOptions:NSPointerFunctionsStrongMemory capacity:0];
+    _registrationEventIdsByEventBuffer = [[NSMapTable alloc] initWithKeyOptions:(NSPointerFunctionsStrongMemory | NSPointerFunctionsObjectPointerPersonality) valueOptions:NSPointerFunctionsStrongMemory capacity:0];
+#if __APPLE__
+    _historyStreamsByEventBuffer = [[NSMapTable alloc] initWithKeyOptions:(NSPointerFunctionsStrongMemory | NSPointerFunctionsObjectPointerPersonality) valueOptions:NSPointerFunctionsStrongMemory capacity:0];
+#elif __linux__
+    _pathsByWatchDescriptor = [NSMutableDictionary dictionary];
+    _watchDescriptorsByPath = [NSMutableDictionary dictionary];
+    _inotifyFD = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    _epollFD = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event inotifyReadable = {.events = EPOLLIN, .data.fd = _inotifyFD};
+    pthread_t watchThread;
+    if (_inotifyFD < 0 || _epollFD < 0 || epoll_ctl(_epollFD, EPOLL_CTL_ADD, _inotifyFD, &inotifyReadable) || pthread_create(&watchThread, NULL, watchThreadMain, (__bridge void *)self)) {
+        NSLog(@"%s Can't watch the filesystem: %s", __func__, strerror(errno));
+        if (_inotifyFD >= 0)
+            close(_inotifyFD);
+        _inotifyFD = -1;
+    } else
+        pthread_detach(watchThread);
+#endif
+    return self;
+}
+
+
+#pragma mark API
+
++ (instancetype)sharedManager;
+{
+    static LIFilesystemWatchManager *sharedManager;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        sharedManager = [[self alloc] init];
+    });
+    return sharedManager;
+}
+
+- (BOOL)addEventBuffer:(LIFilesystemEventBuffer *)eventBuffer forDirectoryPaths:(NSArray *)canonicalPaths since:(FSEventStreamEventId)since;
+{
+    NSParameterAssert(eventBuffer && canonicalPaths);
+#if __APPLE__
+    if (since != kFSEventStreamEventIdSinceNow) {
+        // A replay of history is for this registration alone
+        const NSTimeInterval latency = eventBuffer.latency;
+        LIFilesystemEventStream *const historyStream = [[LIFilesystemEventStream alloc] initWithPaths:canonicalPaths since:since latency:latency handler:^(NSArray *events) {
+            [eventBuffer addEvents:events elapsedLatency:latency];
+        }];
+        if (!historyStream)
+            return NO;
+        dispatch_semaphore_wait(_mutex, DISPATCH_TIME_FOREVER); {
+            [_historyStreamsByEventBuffer setObject:historyStream forKey:eventBuffer];
+        } dispatch_semaphore_signal(_mutex);
+        return YES;
+    }
+#elif __linux__
+    // inotify keeps no history, so there's nothing to replay from `since`
+    if (_inotifyFD < 0)
+        return NO;
+#endif
+
+#if __APPLE__
+    // A rebuilt shared stream resumes from where the old one left off, which can be before this registration
+    const FSEventStreamEventId registrationEventId = FSEventsGetCurrentEventId();
+#elif __linux__
+    const FSEventStreamEventId registrationEventId = 0;
+#endif
+    dispatch_semaphore_wait(_mutex, DISPATCH_TIME_FOREVER); {
+        NSMutableArray *registeredPaths = [_pathsByEventBuffer objectForKey:eventBuffer];
+        if (!registeredPaths) {
+            [_pathsByEventBuffer setObject:(registeredPaths = [NSMutableArray array]) forKey:eventBuffer];
+            [_registrationEventIdsByEventBuffer setObject:@(registrationEventId) forKey:eventBuffer];
+        }
+
+        for (NSString *path in canonicalPaths) {
+#if __linux__
+            if (![self _isPathCovered:path])
+                [self _addWatchesForDirectoryTree:path]; // Otherwise an ancestor's registration is already watching it
+#endif
+            LIFilesystemWatchNode *node = _rootNode;
+            for (NSString *component in path.pathComponents) {
+                LIFilesystemWatchNode *child = node.children[component];
+                if (!child)
+                    node.children[component] = (child = [LIFilesystemWatchNode new]);
+                node = child;
+            }
+            [node.eventBuffers addObject:eventBuffer];
+            [registeredPaths addObject:path];
+        }
+    } dispatch_semaphore_signal(_mutex);
+
+#if __APPLE__
+    [self _scheduleSharedStreamRebuild];
+#endif
+    return YES;
+}
+
+- (void)removeEventBuffer:(LIFilesystemEventBuffer *)eventBuffer;
+{
+    NSParameterAssert(eventBuffer);
+    NSArray *registeredPaths;
+#if __APPLE__
+    LIFilesystemEventStream *historyStream;
+#endif
+    dispatch_semaphore_wait(_mutex, DISPATCH_TIME_FOREVER); {
+#if __APPLE__
+        historyStream = [_historyStreamsByEventBuffer objectForKey:eventBuffer];
+        [_historyStreamsByEventBuffer removeObjectForKey:eventBuffer];
+#endif
+        registeredPaths = [_pathsByEventBuffer objectForKey:eventBuffer];
+        [_pathsByEventBuffer removeObjectForKey:eventBuffer];
+        [_registrationEventIdsByEventBuffer removeObjectForKey:eventBuffer];
+
+        for (NSString *path in registeredPaths) {
+            // Remove one registration, then prune the branch back to the nearest node that's still in use
+            NSMutableArray *const nodePath = [NSMutableArray arrayWithObject:_rootNode];
+            for (NSString *component in path.pathComponents)
+                [nodePath addObject:[nodePath.lastObject children][component]];
+            LIFilesystemWatchNode *const node = nodePath.lastObject;
+            [node.eventBuffers removeObjectAtIndex:[node.eventBuffers indexOfObjectIdenticalTo:eventBuffer]];
+            NSArray *const components = path.pathComponents;
+            for (NSUInteger i = components.count; i > 0; i--) {
+                LIFilesystemWatchNode *const child = nodePath[i];
+                if (child.eventBuffers.count || child.children.count)
+                    break;
+                [[nodePath[i - 1] children] removeObjectForKey:components[i - 1]];
+            }
+#if __linux__
+            if (![self _isPathCovered:path])
+                [self _removeWatchesForDirectoryTree:path onlyUncovered:YES];
+#endif
+        }
+    } dispatch_semaphore_signal(_mutex);
+
+#if __APPLE__
+    if (historyStream)
+        dispatch_async(eventStreamQueue(), ^{
+            [historyStream invalidate];
+        });
+    if (registeredPaths.count)
+        [self _scheduleSharedStreamRebuild];
+#endif
+}
+
+
+#pragma mark Private
+
+- (void)_dispatchEvents:(NSArray *)events elapsedLatency:(NSTimeInterval)elapsedLatency;
+{
+    NSMapTable *const eventsByEventBuffer = [[NSMapTable alloc] initWithKeyOptions:(NSPointerFunctionsStrongMemory | NSPointerFunctionsObjectPointerPersonality) valueOptions:NSPointerFunctionsStrongMemory capacity:0];
+    NSMutableArray *const eventBuffers = [NSMutableArray array];
+    dispatch_semaphore_wait(_mutex, DISPATCH_TIME_FOREVER); {
+        for (LIFilesystemEvent *event in events) {
+            [eventBuffers removeAllObjects];
+            [self _addEventBuffersForPath:event.path toArray:eventBuffers];
+            for (LIFilesystemEventBuffer *eventBuffer in eventBuffers) {
+                if (event.eventId && event.eventId <= [[_registrationEventIdsByEventBuffer objectForKey:eventBuffer] unsignedLongLongValue])
+                    continue; // Replayed from before this buffer was registered
+                NSMutableArray *bufferEvents = [eventsByEventBuffer objectForKey:eventBuffer];
+                if (!bufferEvents)
+                    [eventsByEventBuffer setObject:(bufferEvents = [NSMutableArray array]) forKey:eventBuffer];
+                [bufferEvents addObject:event];
+            }
+        }
+    } dispatch_semaphore_signal(_mutex);
+
+    for (LIFilesystemEventBuffer *eventBuffer in eventsByEventBuffer)
+        [eventBuffer addEvents:[eventsByEventBuffer objectForKey:eventBuffer] elapsedLatency:elapsedLatency];
+}
+
+- (void)_addEventBuffersForPath:(NSString *)path toArray:(NSMutableArray *)eventBuffers;
+{
+    // Registrations for the path itself and for each of its ancestors
+    LIFilesystemWatchNode *node = _rootNode;
+    for (NSString *component in path.pathComponents) {
+        if (!(node = node.children[component]))
+            return;
+        [eventBuffers addObjectsFromArray:node.eventBuffers];
+    }
+}
+
+- (BOOL)_isPathCovered:(NSString *)path;
+{
+    LIFilesystemWatchNode *node = _rootNode;
+    for (NSString *component in path.pathComponents) {
+        if (!(node = node.children[component]))
+            return NO;
+        if (node.eventBuffers.count)
+            return YES;
+    }
+    return NO;
+}
+
+- (void)_collectTopmostPathsUnderNode:(LIFilesystemWatchNode *)node components:(NSMutableArray *)components intoArray:(NSMutableArray *)paths;
+{
+    if (node.eventBuffers.count) {
+        [paths addObject:[NSString pathWithComponents:components]];
+        return; // Everything below is already covered
+    }
+    for (NSString *component in node.children) {
+        [components addObject:component];
+        [self _collectTopmostPathsUnderNode:node.children[component] components:components intoArray:paths];
+        [components removeLastObject];
+    }
+}
+
+#if __APPLE__
+- (void)_scheduleSharedStreamRebuild;
+{
+    // Registrations usually come in bursts, so rebuild the stream once per burst. The new stream resumes from where
+    // the old one left off (or from now, if there wasn't one), so nothing is missed in between; -_dispatchEvents:
+    // drops what that replays from before each buffer's registration.
+    BOOL needsSchedule;
+    dispatch_semaphore_wait(_mutex, DISPATCH_TIME_FOREVER); {
+        needsSchedule = !_sharedStreamRebuildScheduled;
+        if (needsSchedule) {
+            _sharedStreamRebuildScheduled = YES;
+            _sharedStreamRebuildSince = FSEventsGetCurrentEventId();
+        }
+    } dispatch_semaphore_signal(_mutex);
+
+    if (needsSchedule)
+        dispatch_async(eventStreamQueue(), ^{
+            [self _rebuildSharedStream];
+        });
+}
+
+- (void)_rebuildSharedStream;
+{
+    NSMutableArray *const topmostPaths = [NSMutableArray array];
+    NSTimeInterval latency = DBL_MAX;
+    FSEventStreamEventId since;
+    dispatch_semaphore_wait(_mutex, DISPATCH_TIME_FOREVER); {
+        _sharedStreamRebuildScheduled = NO;
+        since = _sharedStreamRebuildSince;
+        [self _collectTopmostPathsUnderNode:_rootNode components:[NSMutableArray array] intoArray:topmostPaths];
+        for (LIFilesystemEventBuffer *eventBuffer in _pathsByEventBuffer)
+            latency = MIN(latency, eventBuffer.latency);
+    } dispatch_semaphore_signal(_mutex);
+
+    if ([_sharedStream.paths isEqualToArray:topmostPaths] && _sharedStream.latency == latency)
+        return;
+    if (_sharedStream && _sharedStream.latestEventId != kFSEventStreamEventIdSinceNow)
+        since = _sharedStream.latestEventId;
+    [_sharedStream invalidate];
+    _sharedStream = nil;
+    if (!topmostPaths.count)
+        return;
+
+    // The stream waits out the shortest latency; each buffer waits out whatever remains of its own
+    _sharedStream = [[LIFilesystemEventStream alloc] initWithPaths:topmostPaths since:since latency:latency handler:^(NSArray *events) {
+        [self _dispatchEvents:events elapsedLatency:latency];
+    }];
+}
+
+#elif __linux__
+- (void)_runWatchLoop;
+{
+    char buffer[16 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        struct epoll_event readyEvent;
+        const int readyCount = epoll_wait(_epollFD, &readyEvent, 1, -1);
+        if (readyCount < 0 && errno != EINTR)
+            return;
+        if (readyCount <= 0)
+            continue;
+
+        @autoreleasepool {
+            ssize_t length;
+            while ((length = read(_inotifyFD, buffer, sizeof(buffer))) > 0)
+                [self _handleInotifyEvents:buffer length:(size_t)length];
+        }
+    }
+}
+
+- (void)_handleInotifyEvents:(const char *)buffer length:(size_t)length;
+{
+    NSFileManager *const fileManager = [NSFileManager defaultManager];
+    NSMutableArray *const events = [NSMutableArray array];
+    NSMutableDictionary *const eventIndexesByPath = [NSMutableDictionary dictionary];
+    NSMapTable *overflowedPathsByEventBuffer = nil;
+
+    dispatch_semaphore_wait(_mutex, DISPATCH_TIME_FOREVER); {
+        for (const char *cursor = buffer; cursor < buffer + length; ) {
+            const struct inotify_event *const event = (const void *)cursor;
+            cursor += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                overflowedPathsByEventBuffer = [_pathsByEventBuffer copy];
+                continue;
+            }
+            if (event->mask & IN_IGNORED) {
+                NSString *const watchedPath = _pathsByWatchDescriptor[@(event->wd)];
+                if (watchedPath && [_watchDescriptorsByPath[watchedPath] isEqual:@(event->wd)])
+                    [_watchDescriptorsByPath removeObjectForKey:watchedPath];
+                [_pathsByWatchDescriptor removeObjectForKey:@(event->wd)];
+                continue;
+            }
+            NSString *const directoryPath = _pathsByWatchDescriptor[@(event->wd)];
+            if (!directoryPath)
+                continue;
+
+            NSString *const path = event->len ? [directoryPath stringByAppendingPathComponent:[fileManager stringWithFileSystemRepresentation:event->name length:strlen(event->name)]] : directoryPath;
+            LIFilesystemEventKind kind = kindForInotifyMask(event->mask);
+            if ((event->mask & IN_ISDIR) && (event->mask & IN_MOVED_FROM))
+                [self _removeWatchesForDirectoryTree:path onlyUncovered:NO]; // If it moved within a watched tree, it's added again under its new name
+            if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+                // Anything created in it before our watch was added went unreported
+                [self _addWatchesForDirectoryTree:path];
+                kind |= LIFilesystemEventMustRescan;
+            }
+            addCoalescedEvent(events, eventIndexesByPath, path, kind, 0);
+        }
+    } dispatch_semaphore_signal(_mutex);
+
+    // Events were lost, so everyone needs to rescan everything
+    for (LIFilesystemEventBuffer *eventBuffer in overflowedPathsByEventBuffer) {
+        NSMutableArray *const rescanEvents = [NSMutableArray array];
+        for (NSString *path in [overflowedPathsByEventBuffer objectForKey:eventBuffer])
+            [rescanEvents addObject:[[LIFilesystemEvent alloc] initWithPath:path kind:(LIFilesystemEventIsDirectory | LIFilesystemEventMustRescan) eventId:0]];
+        [eventBuffer addEvents:rescanEvents elapsedLatency:0];
+    }
+    if (events.count)
+        [self _dispatchEvents:events elapsedLatency:0];
+}
+
+- (void)_addWatchesForDirectoryTree:(NSString *)directoryPath;
+{
+    // Watching the same directory again just returns its existing descriptor
+    const int watchDescriptor = inotify_add_watch(_inotifyFD, directoryPath.fileSystemRepresentation, LI_INOTIFY_WATCH_MASK);
+    if (watchDescriptor < 0)
+        return; // Gone already, not a directory, or out of watches
+    _pathsByWatchDescriptor[@(watchDescriptor)] = directoryPath;
+    _watchDescriptorsByPath[directoryPath] = @(watchDescriptor);
+
+    DIR *const directory = opendir(directoryPath.fileSystemRepresentation);
+    if (!directory)
+        return;
+    NSFileManager *const fileManager = [NSFileManager defaultManager];
+    const struct dirent *entry;
+    while ((entry = readdir(directory))) {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..") || (entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN))
+            continue;
+        @autoreleasepool {
+            NSString *const childPath = [directoryPath stringByAppendingPathComponent:[fileManager stringWithFileSystemRepresentation:entry->d_name length:strlen(entry->d_name)]];
+            struct stat childStat;
+            if (entry->d_type == DT_DIR || (!lstat(childPath.fileSystemRepresentation, &childStat) && S_ISDIR(childStat.st_mode)))
+                [self _addWatchesForDirectoryTree:childPath];
+        }
+    }
+    closedir(directory);
+}
+
+- (void)_removeWatchesForDirectoryTree:(NSString *)directoryPath onlyUncovered:(BOOL)onlyUncovered;
+{
+    NSString *const directoryPrefix = [directoryPath stringByAppendingString:@"/"];
+    for (NSString *watchedPath in [_watchDescriptorsByPath allKeys]) {
+        if (!([watchedPath isEqualToString:directoryPath] || [watchedPath hasPrefix:directoryPrefix]))
+            continue;
+        if (onlyUncovered && [self _isPathCovered:watchedPath])
+            continue; // A registration inside this tree still needs it
+        NSNumber *const watchDescriptor = _watchDescriptorsByPath[watchedPath];
+        inotify_rm_watch(_inotifyFD, watchDescriptor.intValue);
+        [_pathsByWatchDescriptor removeObjectForKey:watchDescriptor];
+        [_watchDescriptorsByPath removeObjectForKey:watchedPath];
+    }
+}
+#endif
+
+@end